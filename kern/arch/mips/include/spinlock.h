@@ -46,6 +46,15 @@ SPINLOCK_INLINE
 spinlock_data_t spinlock_data_get(volatile spinlock_data_t *sd);
 SPINLOCK_INLINE
 spinlock_data_t spinlock_data_testandset(volatile spinlock_data_t *sd);
+SPINLOCK_INLINE
+spinlock_data_t spinlock_data_fetchinc(volatile spinlock_data_t *sd);
+SPINLOCK_INLINE
+bool spinlock_data_cas(volatile spinlock_data_t *sd,
+		       spinlock_data_t old, spinlock_data_t new);
+
+/* Cycle counter, for timing how long locks are held */
+SPINLOCK_INLINE
+unsigned spinlock_cycles(void);
 
 ////////////////////////////////////////////////////////////
 
@@ -96,5 +105,69 @@ spinlock_data_testandset(volatile spinlock_data_t *sd)
 	return x;
 }
 
+SPINLOCK_INLINE
+spinlock_data_t
+spinlock_data_fetchinc(volatile spinlock_data_t *sd)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	/*
+	 * Atomic increment using LL/SC; returns the old value.
+	 * Retry until the SC succeeds.
+	 */
+
+	do {
+		__asm volatile(
+			".set push;"		/* save assembler mode */
+			".set mips32;"		/* allow MIPS32 instructions */
+			".set volatile;"	/* avoid unwanted optimization */
+			"ll %0, 0(%2);"		/*   x = *sd */
+			"addiu %1, %0, 1;"	/*   y = x + 1 */
+			"sc %1, 0(%2);"		/*   *sd = y; y = success? */
+			".set pop"		/* restore assembler mode */
+			: "=&r" (x), "=&r" (y) : "r" (sd));
+	} while (y == 0);
+	return x;
+}
+
+SPINLOCK_INLINE
+bool
+spinlock_data_cas(volatile spinlock_data_t *sd,
+		  spinlock_data_t old, spinlock_data_t new)
+{
+	spinlock_data_t x;
+	spinlock_data_t y;
+
+	/*
+	 * Compare-and-swap using LL/SC: store NEW only if the word
+	 * still contains OLD. If it doesn't, the SC is skipped. Fails
+	 * if the SC does, too; callers either retry or give up.
+	 */
+
+	y = new;
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set volatile;"	/* avoid unwanted optimization */
+		"ll %0, 0(%3);"		/*   x = *sd */
+		"bne %0, %2, 1f;"	/*   if (x != old) skip the store */
+		"sc %1, 0(%3);"		/*   *sd = y; y = success? */
+		"1:"
+		".set pop"		/* restore assembler mode */
+		: "=&r" (x), "+r" (y) : "r" (old), "r" (sd));
+	return x == old && y != 0;
+}
+
+SPINLOCK_INLINE
+unsigned
+spinlock_cycles(void)
+{
+	unsigned x;
+
+	__asm volatile("mfc0 %0, $9" : "=r" (x));	/* c0_count */
+	return x;
+}
+
 
 #endif /* _MIPS_SPINLOCK_H_ */
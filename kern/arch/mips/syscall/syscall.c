@@ -37,6 +37,7 @@
 #include <current.h>
 #include <copyinout.h>
 #include <syscall.h>
+#include "opt-dumbvm.h"
 
 
 /*
@@ -221,6 +222,54 @@ syscall(struct trapframe *tf)
                                 tf->tf_a2, /* option (always 0) */
                                 &retval); /* return pid value */
                 break;
+
+#if !OPT_DUMBVM
+            case SYS_sbrk:
+                err = sys_sbrk((intptr_t)tf->tf_a0, &retval);
+                break;
+
+            case SYS_mmap:
+                {
+                        /*
+                         * The fifth argument (the fd) is on the stack,
+                         * and so is the 64-bit offset, which is
+                         * aligned to 8 bytes and so skips a slot.
+                         */
+                        uint64_t offset;
+                        uint32_t offhi, offlo;
+                        int fd;
+
+                        err = copyin((userptr_t)tf->tf_sp + 16,
+                                     &fd, sizeof(int));
+                        if (err) {
+                                break;
+                        }
+                        err = copyin((userptr_t)tf->tf_sp + 24,
+                                     &offhi, sizeof(uint32_t));
+                        if (err) {
+                                break;
+                        }
+                        err = copyin((userptr_t)tf->tf_sp + 28,
+                                     &offlo, sizeof(uint32_t));
+                        if (err) {
+                                break;
+                        }
+                        join32to64(offhi, offlo, &offset);
+
+                        err = sys_mmap((userptr_t)tf->tf_a0, tf->tf_a1,
+                                       tf->tf_a2, tf->tf_a3, fd, offset,
+                                       &retval);
+                }
+                break;
+
+            case SYS_munmap:
+                err = sys_munmap((userptr_t)tf->tf_a0, tf->tf_a1);
+                break;
+
+            case SYS_msync:
+                err = sys_msync((userptr_t)tf->tf_a0, tf->tf_a1, tf->tf_a2);
+                break;
+#endif
                 
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
@@ -845,13 +845,16 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 
 /*
  * VOP_MMAP
+ *
+ * Files can be mapped; the VM system moves the pages with VOP_READ and
+ * VOP_WRITE.
  */
 static
 int
 emufs_mmap(struct vnode *v)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 //////////////////////////////
@@ -1090,6 +1093,7 @@ static const struct vnode_ops emufs_fileops = {
 	.vop_mmap = emufs_mmap,
 	.vop_truncate = emufs_truncate,
 	.vop_namefile = emufs_uio_op_notdir,
+	.vop_readahead = vopnull_readahead,
 
 	.vop_creat = emufs_creat_notdir,
 	.vop_symlink = emufs_symlink_notdir,
@@ -1124,6 +1128,7 @@ static const struct vnode_ops emufs_dirops = {
 	.vop_mmap = emufs_void_op_isdir,
 	.vop_truncate = emufs_truncate_isdir,
 	.vop_namefile = emufs_namefile,
+	.vop_readahead = vopnull_readahead,
 
 	.vop_creat = emufs_creat,
 	.vop_symlink = emufs_symlink,
@@ -36,7 +36,9 @@
 #include <lib.h>
 #include <uio.h>
 #include <membar.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <vm.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -96,28 +98,184 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * I/O queue.
+ *
+ * Requests wait on lh_queue until the disk gets to them. The disk only
+ * transfers one sector at a time, but the interrupt handler moves the
+ * data and starts the next sector itself, so a request costs one
+ * interrupt per sector and no context switches until it is done.
+ *
+ * When a request is queued that continues (or is continued by) one
+ * already waiting in the same direction, it is merged into that one's
+ * run, up to LHD_MAXRUN sectors, and the two are done back to back.
+ * Runs are picked in C-LOOK order: the lowest-numbered one at or past
+ * the last sector started, or if there is none the lowest overall.
+ */
+#define LHD_MAXRUN  128
+
+/*
+ * Start the sector lh_curidx of lh_cur.
+ */
+static
+void
+lhd_startsector(struct lhd_softc *lh)
+{
+	struct devreq *req = lh->lh_cur;
+	uint32_t statval = LHD_WORKING;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (req->dr_write) {
+		memcpy(lh->lh_buf,
+		       (char *)req->dr_data + lh->lh_curidx * LHD_SECTSIZE,
+		       LHD_SECTSIZE);
+		membar_store_store();
+		statval |= LHD_ISWRITE;
+	}
+	lh->lh_head = req->dr_block + lh->lh_curidx;
+	lhd_wreg(lh, LHD_REG_SECT, lh->lh_head);
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * If the disk is idle, pick the next run and start it.
+ */
+static
+void
+lhd_startrun(struct lhd_softc *lh)
+{
+	struct devreq *req, **pp, **best, **lowest;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lh->lh_active != NULL || lh->lh_queue == NULL) {
+		return;
+	}
+
+	best = lowest = NULL;
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->dr_next) {
+		req = *pp;
+		if (lowest == NULL || req->dr_block < (*lowest)->dr_block) {
+			lowest = pp;
+		}
+		if (req->dr_block >= lh->lh_head &&
+		    (best == NULL || req->dr_block < (*best)->dr_block)) {
+			best = pp;
+		}
+	}
+	if (best == NULL) {
+		best = lowest;
+	}
+
+	req = *best;
+	*best = req->dr_next;
+	lh->lh_active = lh->lh_cur = req;
+	lh->lh_curidx = 0;
+	lhd_startsector(lh);
+}
+
+/*
+ * Add a request to the queue, merging it into a run if it can be.
  */
 static
 void
-lhd_iodone(struct lhd_softc *lh, int err)
+lhd_enqueue(struct lhd_softc *lh, struct devreq *req)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	struct devreq *run, **pp;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	req->dr_merged = NULL;
+	req->dr_last = req;
+	req->dr_runlen = req->dr_nblocks;
+
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->dr_next) {
+		run = *pp;
+		if (run->dr_write != req->dr_write ||
+		    run->dr_runlen + req->dr_nblocks > LHD_MAXRUN) {
+			continue;
+		}
+		if (run->dr_block + run->dr_runlen == req->dr_block) {
+			/* Goes on the end */
+			run->dr_last->dr_merged = req;
+			run->dr_last = req;
+			run->dr_runlen += req->dr_nblocks;
+			return;
+		}
+		if (req->dr_block + req->dr_nblocks == run->dr_block) {
+			/* Goes on the front, taking the run's place */
+			req->dr_merged = run;
+			req->dr_last = run->dr_last;
+			req->dr_runlen += run->dr_runlen;
+			req->dr_next = run->dr_next;
+			*pp = req;
+			return;
+		}
+	}
+
+	req->dr_next = lh->lh_queue;
+	lh->lh_queue = req;
+}
+
+/*
+ * A sector has finished with result ERR. Copy the data in if it was
+ * a read and move on to the next sector. Requests that are finished
+ * are put on *DONE, linked through dr_next, with the result in
+ * dr_result, for the caller to report once the lock is released. On
+ * error the rest of the failed request is skipped.
+ */
+static
+void
+lhd_sectordone(struct lhd_softc *lh, int err, struct devreq **done)
+{
+	struct devreq *req = lh->lh_cur;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (err == 0 && !req->dr_write) {
+		membar_load_load();
+		memcpy((char *)req->dr_data + lh->lh_curidx * LHD_SECTSIZE,
+		       lh->lh_buf, LHD_SECTSIZE);
+	}
+
+	lh->lh_curidx++;
+	if (err == 0 && lh->lh_curidx < req->dr_nblocks) {
+		lhd_startsector(lh);
+		return;
+	}
+
+	/* This request is done; go on to the next in the run, if any */
+	lh->lh_cur = req->dr_merged;
+	lh->lh_curidx = 0;
+	req->dr_result = err;
+	req->dr_next = *done;
+	*done = req;
+
+	if (lh->lh_cur != NULL) {
+		lhd_startsector(lh);
+	}
+	else {
+		lh->lh_active = NULL;
+		lhd_startrun(lh);
+	}
 }
 
 /*
  * Interrupt handler for lhd.
  * Read the status register; if an operation finished, clear the status
- * register and report completion.
+ * register, move on to the next sector, and report any requests that
+ * are done.
  */
 void
 lhd_irq(void *vlh)
 {
 	struct lhd_softc *lh = vlh;
+	struct devreq *done, *req;
 	uint32_t val;
 
+	done = NULL;
+
+	spinlock_acquire(&lh->lh_lock);
 	val = lhd_rdreg(lh, LHD_REG_STAT);
 
 	switch (val & LHD_STATEMASK) {
@@ -128,9 +286,19 @@ lhd_irq(void *vlh)
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
 		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
+		if (lh->lh_active != NULL) {
+			lhd_sectordone(lh, lhd_code_to_errno(lh, val), &done);
+		}
 		break;
 	}
+	spinlock_release(&lh->lh_lock);
+
+	/* The callbacks get called without the lock held */
+	while (done != NULL) {
+		req = done;
+		done = req->dr_next;
+		req->dr_done(req, req->dr_result);
+	}
 }
 
 /*
@@ -179,8 +347,109 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Queue an asynchronous request.
+ */
+static
+int
+lhd_strategy(struct device *d, struct devreq *req)
+{
+	struct lhd_softc *lh = d->d_data;
+
+	/* Don't allow empty requests or I/O past the end of the disk. */
+	if (req->dr_nblocks == 0 || req->dr_block >= lh->lh_dev.d_blocks ||
+	    req->dr_nblocks > lh->lh_dev.d_blocks - req->dr_block) {
+		return EINVAL;
+	}
+
+	spinlock_acquire(&lh->lh_lock);
+	lhd_enqueue(lh, req);
+	lhd_startrun(lh);
+	spinlock_release(&lh->lh_lock);
+
+	return 0;
+}
+
+/*
+ * Synchronous I/O goes through the queue like anything else, with
+ * lhd_syncdone as the callback; the caller just waits for it.
+ *
+ * Waiters are spread over several wait channels by the address of
+ * their request, so a completion only wakes the few threads that
+ * happen to share its channel rather than every one with a request
+ * outstanding. The requests live on their callers' stacks, which
+ * differ in the page number more than the offset.
+ */
+struct lhd_syncreq {
+	struct devreq sr_req;
+	struct lhd_softc *sr_lh;
+	int sr_result;
+	bool sr_done;
+};
+
+static
+struct wchan *
+lhd_syncwchan(struct lhd_softc *lh, struct lhd_syncreq *sr)
+{
+	uintptr_t x = (uintptr_t)sr;
+
+	return lh->lh_wchans[((x >> 12) ^ (x >> 4)) % LHD_NWCHANS];
+}
+
+static
+void
+lhd_syncdone(struct devreq *req, int result)
+{
+	struct lhd_syncreq *sr = req->dr_arg;
+	struct lhd_softc *lh = sr->sr_lh;
+
+	spinlock_acquire(&lh->lh_lock);
+	sr->sr_result = result;
+	sr->sr_done = true;
+	wchan_wakeall(lhd_syncwchan(lh, sr), &lh->lh_lock);
+	spinlock_release(&lh->lh_lock);
+}
+
+/*
+ * Transfer NSECT sectors starting at SECTOR to or from the kernel
+ * buffer DATA, and wait for it.
+ */
+static
+int
+lhd_syncio(struct lhd_softc *lh, uint32_t sector, uint32_t nsect,
+	   void *data, bool write)
+{
+	struct lhd_syncreq sr;
+	int result;
+
+	sr.sr_req.dr_block = sector;
+	sr.sr_req.dr_nblocks = nsect;
+	sr.sr_req.dr_data = data;
+	sr.sr_req.dr_write = write;
+	sr.sr_req.dr_done = lhd_syncdone;
+	sr.sr_req.dr_arg = &sr;
+	sr.sr_lh = lh;
+	sr.sr_done = false;
+
+	result = lhd_strategy(&lh->lh_dev, &sr.sr_req);
+	if (result) {
+		return result;
+	}
+
+	spinlock_acquire(&lh->lh_lock);
+	while (!sr.sr_done) {
+		wchan_sleep(lhd_syncwchan(lh, &sr), &lh->lh_lock);
+	}
+	spinlock_release(&lh->lh_lock);
+
+	return sr.sr_result;
+}
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * A kernel buffer in one piece is transferred into directly, all at
+ * once. Anything else goes through a bounce buffer, a page at a time.
  */
 static
 int
@@ -192,8 +461,10 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	bool write = uio->uio_rw == UIO_WRITE;
+	struct iovec *iov;
+	char *bounce;
+	uint32_t n;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -202,72 +473,66 @@ lhd_io(struct device *d, struct uio *uio)
 	}
 
 	/* Don't allow I/O past the end of the disk. */
-	/* XXX this check can overflow */
-	if (sector+len > lh->lh_dev.d_blocks) {
+	if (sector > lh->lh_dev.d_blocks ||
+	    len > lh->lh_dev.d_blocks - sector) {
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+	if (len == 0) {
+		return 0;
 	}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	iov = uio->uio_iov;
+	if (uio->uio_segflg == UIO_SYSSPACE && uio->uio_iovcnt == 1 &&
+	    iov->iov_len == uio->uio_resid) {
+		result = lhd_syncio(lh, sector, len, iov->iov_kbase, write);
+		if (result) {
+			return result;
+		}
+		iov->iov_kbase = (char *)iov->iov_kbase + uio->uio_resid;
+		iov->iov_len = 0;
+		uio->uio_offset += uio->uio_resid;
+		uio->uio_resid = 0;
+		return 0;
+	}
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			membar_store_store();
+	bounce = kmalloc(PAGE_SIZE);
+	if (bounce == NULL) {
+		return ENOMEM;
+	}
+	result = 0;
+	while (len > 0) {
+		n = len < PAGE_SIZE / LHD_SECTSIZE ?
+			len : PAGE_SIZE / LHD_SECTSIZE;
+		if (write) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
 			if (result) {
-				V(lh->lh_clear);
-				return result;
+				break;
 			}
 		}
-
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			membar_load_load();
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
+		result = lhd_syncio(lh, sector, n, bounce, write);
 		if (result) {
-			return result;
+			break;
+		}
+		if (!write) {
+			result = uiomove(bounce, n * LHD_SECTSIZE, uio);
+			if (result) {
+				break;
+			}
 		}
+		sector += n;
+		len -= n;
 	}
+	kfree(bounce);
 
-	return 0;
+	return result;
 }
 
 static const struct device_ops lhd_devops = {
 	.devop_eachopen = lhd_eachopen,
 	.devop_io = lhd_io,
 	.devop_ioctl = lhd_ioctl,
+	.devop_strategy = lhd_strategy,
 };
 
 /*
@@ -277,6 +542,7 @@ int
 config_lhd(struct lhd_softc *lh, int lhdno)
 {
 	char name[32];
+	unsigned i;
 
 	/* Figure out what our name is. */
 	snprintf(name, sizeof(name), "lhd%d", lhdno);
@@ -284,17 +550,22 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
-		return ENOMEM;
+	/* Set up the queue. */
+	for (i=0; i<LHD_NWCHANS; i++) {
+		lh->lh_wchans[i] = wchan_create("lhd");
+		if (lh->lh_wchans[i] == NULL) {
+			while (i > 0) {
+				wchan_destroy(lh->lh_wchans[--i]);
+			}
+			return ENOMEM;
+		}
 	}
+	spinlock_init(&lh->lh_lock);
+	lh->lh_queue = NULL;
+	lh->lh_active = NULL;
+	lh->lh_cur = NULL;
+	lh->lh_curidx = 0;
+	lh->lh_head = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_ops = &lhd_devops;
@@ -31,12 +31,20 @@
 #define _LAMEBUS_LHD_H_
 
 #include <device.h>
+#include <spinlock.h>
+
+struct wchan;
 
 /*
  * Our sector size
  */
 #define LHD_SECTSIZE  512
 
+/*
+ * Number of wait channels synchronous requests are spread over
+ */
+#define LHD_NWCHANS   16
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,9 +59,13 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* protects the rest */
+	struct wchan *lh_wchans[LHD_NWCHANS]; /* for synchronous I/O */
+	struct devreq *lh_queue;	/* requests waiting, unordered */
+	struct devreq *lh_active;	/* request (run) in progress */
+	struct devreq *lh_cur;		/* part of lh_active in progress */
+	uint32_t lh_curidx;		/* sector of lh_cur in progress */
+	uint32_t lh_head;		/* last sector started */
 
 	struct device lh_dev;		/* VFS device structure */
 };
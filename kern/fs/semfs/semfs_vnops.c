@@ -664,6 +664,7 @@ static const struct vnode_ops semfs_dirops = {
 	.vop_mmap = vopfail_mmap_isdir,
 	.vop_truncate = vopfail_truncate_isdir,
 	.vop_namefile = semfs_namefile,
+	.vop_readahead = vopnull_readahead,
 
 	.vop_creat = semfs_creat,
 	.vop_symlink = vopfail_symlink_nosys,
@@ -697,6 +698,7 @@ static const struct vnode_ops semfs_semops = {
 	.vop_mmap = vopfail_mmap_perm,
 	.vop_truncate = semfs_truncate,
 	.vop_namefile = vopfail_uio_notdir,
+	.vop_readahead = vopnull_readahead,
 
 	.vop_creat = vopfail_creat_notdir,
 	.vop_symlink = vopfail_symlink_notdir,
@@ -35,56 +35,170 @@
 #include <types.h>
 #include <lib.h>
 #include <bitmap.h>
+#include <synch.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
 /*
- * Zero out a disk block.
+ * Zero out a disk block. This happens in the buffer cache; the zeros
+ * reach the disk when the buffer is written back.
  */
 static
 int
 sfs_clearblock(struct sfs_fs *sfs, daddr_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
+	struct sfs_buf *buf;
+	int result;
 
-	return sfs_writeblock(sfs, block, zeros, SFS_BLOCKSIZE);
+	result = sfs_bget(sfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	bzero(buf->b_data, SFS_BLOCKSIZE);
+	sfs_bdirty(buf);
+	sfs_brelse(buf);
+	return 0;
 }
 
 /*
- * Allocate a block.
+ * Mark up to MAXRUN free blocks in use, starting with the first free
+ * one at or after GOAL.
  */
+static
 int
-sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock)
+sfs_ballocrun(struct sfs_fs *sfs, daddr_t goal, unsigned maxrun,
+	      daddr_t *start, unsigned *count)
 {
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	result = bitmap_alloc_run(sfs->sfs_freemap, goal, maxrun,
+				  start, count);
 	if (result) {
+		lock_release(sfs->sfs_freemaplock);
 		return result;
 	}
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 
-	if (*diskblock >= sfs->sfs_sb.sb_nblocks) {
-		panic("sfs: balloc: invalid block %u\n", *diskblock);
+	if (*start + *count > sfs->sfs_sb.sb_nblocks) {
+		panic("sfs: balloc: invalid block %u\n", *start);
 	}
+	return 0;
+}
+
+/*
+ * Clear a block we just took. On failure, give it back.
+ */
+static
+int
+sfs_bclaim(struct sfs_fs *sfs, daddr_t block)
+{
+	int result;
 
-	/* Clear block before returning it */
-	result = sfs_clearblock(sfs, *diskblock);
+	/*
+	 * Nobody else knows about the block yet, so this doesn't need
+	 * the freemap lock.
+	 */
+	result = sfs_clearblock(sfs, block);
 	if (result) {
-		bitmap_unmark(sfs->sfs_freemap, *diskblock);
+		lock_acquire(sfs->sfs_freemaplock);
+		bitmap_unmark(sfs->sfs_freemap, block);
+		lock_release(sfs->sfs_freemaplock);
 	}
 	return result;
 }
 
+/*
+ * Allocate a block, as close after GOAL as possible.
+ */
+int
+sfs_balloc(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock)
+{
+	unsigned count;
+	int result;
+
+	result = sfs_ballocrun(sfs, goal, 1, diskblock, &count);
+	if (result) {
+		return result;
+	}
+	return sfs_bclaim(sfs, *diskblock);
+}
+
+/*
+ * Allocate a block for the file SV, as close after GOAL as possible.
+ *
+ * So that a file written sequentially ends up contiguous even when
+ * other files are being written at the same time, each file reserves
+ * a run of up to SFS_RESERVE blocks and hands them out in order while
+ * its writes keep asking for the next one. The reserved blocks are
+ * marked in use in the freemap, so other allocations go around them.
+ * Unused reservations are given back by sfs_bunreserve.
+ */
+#define SFS_RESERVE 8
+
+int
+sfs_balloc_file(struct sfs_vnode *sv, daddr_t goal, daddr_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_resvcount > 0 && sv->sv_resvstart != goal) {
+		sfs_bunreserve(sv);
+	}
+	if (sv->sv_resvcount == 0) {
+		result = sfs_ballocrun(sfs, goal, SFS_RESERVE,
+				       &sv->sv_resvstart, &sv->sv_resvcount);
+		if (result) {
+			return result;
+		}
+	}
+
+	*diskblock = sv->sv_resvstart++;
+	sv->sv_resvcount--;
+	return sfs_bclaim(sfs, *diskblock);
+}
+
+/*
+ * Give back the blocks SV has reserved but not used. This is done
+ * whenever the inode is synced, so reservations never reach the
+ * freemap on disk for long.
+ */
+void
+sfs_bunreserve(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	unsigned i;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_resvcount == 0) {
+		return;
+	}
+	lock_acquire(sfs->sfs_freemaplock);
+	for (i=0; i<sv->sv_resvcount; i++) {
+		bitmap_unmark(sfs->sfs_freemap, sv->sv_resvstart + i);
+	}
+	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
+	sv->sv_resvcount = 0;
+}
+
 /*
  * Free a block.
  */
 void
 sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	/* Don't let a stale cached copy outlive the block */
+	sfs_binval(sfs, diskblock);
+
+	lock_acquire(sfs->sfs_freemaplock);
 	bitmap_unmark(sfs->sfs_freemap, diskblock);
 	sfs->sfs_freemapdirty = true;
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -93,10 +207,15 @@ sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock)
 int
 sfs_bused(struct sfs_fs *sfs, daddr_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_sb.sb_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n",
 		      diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
 }
 
@@ -35,39 +35,101 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Where a new block of a file should go: right after PREV, the disk
+ * block holding the file block before it, if there is one. Otherwise
+ * where the file's reservation continues, or failing that, right
+ * after the inode.
+ */
+static
+daddr_t
+sfs_bgoal(struct sfs_vnode *sv, daddr_t prev)
+{
+	if (prev != 0) {
+		return prev + 1;
+	}
+	if (sv->sv_resvcount > 0) {
+		return sv->sv_resvstart;
+	}
+	return sv->sv_ino + 1;
+}
+
+/*
+ * Number of file blocks mapped by an indirect block at each level;
+ * level 1 holds pointers to data blocks, and level 0 is a data block.
+ */
+static const uint32_t sfs_ispan[SFS_ILEVELS+1] = {
+	1,
+	SFS_DBPERIDB,
+	SFS_DBPERIDB * SFS_DBPERIDB,
+	SFS_DBPERIDB * SFS_DBPERIDB * SFS_DBPERIDB,
+};
+
+/*
+ * The inode field holding the top indirect block of the tree with
+ * LEVEL levels.
+ */
+static
+uint32_t *
+sfs_iroot(struct sfs_vnode *sv, unsigned level)
+{
+	switch (level) {
+	    case 1: return &sv->sv_i.sfi_indirect;
+	    case 2: return &sv->sv_i.sfi_dindirect;
+	    case 3: return &sv->sv_i.sfi_tindirect;
+	}
+	panic("sfs: Invalid indirection level %u\n", level);
+	return NULL;
+}
+
+/*
+ * Forget the cached indirect path, because indirect blocks are
+ * being freed.
+ */
+static
+void
+sfs_ipath_clear(struct sfs_vnode *sv)
+{
+	unsigned i;
+
+	for (i=0; i<SFS_ILEVELS; i++) {
+		sv->sv_ipblock[i] = 0;
+	}
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
  * allocated.
+ *
+ * Past the direct blocks come the blocks mapped by the indirect
+ * block, then by the double indirect block, then by the triple
+ * indirect block. The indirect blocks visited on the way to the last
+ * block looked up are remembered in sv_ipblock, by level, along with
+ * the first file block each one maps (sv_ipstart). The walk down
+ * starts from the lowest of those that maps the block wanted, so
+ * sequential access reads only the level 1 block most of the time.
  */
 int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	 daddr_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
-	daddr_t block;
+	struct sfs_buf *idbuf;
+	uint32_t *idptrs, *rootp;
+	daddr_t block, prev;
 	daddr_t idblock;
-	uint32_t idnum, idoff;
+	uint32_t start, idoff;
+	unsigned level, l;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	/* Since we're using a static buffer, we'd better be locked. */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -82,7 +144,10 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			prev = fileblock > 0 ?
+				sv->sv_i.sfi_direct[fileblock-1] : 0;
+			result = sfs_balloc_file(sv, sfs_bgoal(sv, prev),
+						 &block);
 			if (result) {
 				return result;
 			}
@@ -104,86 +169,110 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
-	 */
-
-	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
-
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
+	 * It's not a direct block. Find the lowest cached indirect
+	 * block that maps it, if any. (If FILEBLOCK is below
+	 * sv_ipstart the subtraction wraps and the test fails.)
 	 */
-	if (idnum >= SFS_NINDIRECT) {
-		return EFBIG;
+	for (l=1; l<=SFS_ILEVELS; l++) {
+		if (sv->sv_ipblock[l-1] != 0 &&
+		    fileblock - sv->sv_ipstart[l-1] < sfs_ispan[l]) {
+			break;
+		}
 	}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
-
-	if (idblock==0 && !doalloc) {
-		/*
-		 * There's no indirect block allocated. We weren't
-		 * asked to allocate anything, so pretend the indirect
-		 * block was filled with all zeros.
-		 */
-		*diskblock = 0;
-		return 0;
+	if (l <= SFS_ILEVELS) {
+		idblock = sv->sv_ipblock[l-1];
+		start = sv->sv_ipstart[l-1];
 	}
-	else if (idblock==0) {
+	else {
 		/*
-		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
+		 * Start from the top. Find which tree the block is in,
+		 * and the first file block that tree maps.
 		 */
-		result = sfs_balloc(sfs, &idblock);
-		if (result) {
-			return result;
+		start = SFS_NDIRECT;
+		for (level=1; fileblock - start >= sfs_ispan[level]; level++) {
+			if (level == SFS_ILEVELS) {
+				/* Off the end of the triple indirect block */
+				return EFBIG;
+			}
+			start += sfs_ispan[level];
+		}
+		l = level;
+		rootp = sfs_iroot(sv, level);
+		idblock = *rootp;
+
+		if (idblock==0 && !doalloc) {
+			/*
+			 * There's no indirect block allocated. We weren't
+			 * asked to allocate anything, so pretend the
+			 * indirect block was filled with all zeros.
+			 */
+			*diskblock = 0;
+			return 0;
 		}
+		else if (idblock==0) {
+			/* Allocate it, near the end of the previous tree */
+			prev = level > 1 ? *sfs_iroot(sv, level-1) :
+				sv->sv_i.sfi_direct[SFS_NDIRECT-1];
+			result = sfs_balloc_file(sv, sfs_bgoal(sv, prev),
+						 &idblock);
+			if (result) {
+				return result;
+			}
 
-		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
+			/* Remember the block we just allocated */
+			*rootp = idblock;
 
-		/* Mark the inode dirty */
-		sv->sv_dirty = true;
+			/* Mark the inode dirty */
+			sv->sv_dirty = true;
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
-	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
+			/* sfs_balloc has already zeroed it in the cache */
 		}
 	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	/*
+	 * Walk down to level 1, allocating missing indirect blocks
+	 * along the way if asked to.
+	 */
+	while (1) {
+		sv->sv_ipblock[l-1] = idblock;
+		sv->sv_ipstart[l-1] = start;
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+		/* Load the indirect block */
+		result = sfs_bread(sfs, idblock, &idbuf);
 		if (result) {
 			return result;
 		}
+		idptrs = idbuf->b_data;
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+		/* Get the next block out of the indirect block buffer */
+		idoff = (fileblock - start) / sfs_ispan[l-1];
+		block = idptrs[idoff];
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_writeblock(sfs, idblock, idbuf, sizeof(idbuf));
-		if (result) {
-			return result;
+		/* If there's no block there, allocate one */
+		if (block==0 && doalloc) {
+			prev = idoff > 0 ? idptrs[idoff-1] : idblock;
+			result = sfs_balloc_file(sv, sfs_bgoal(sv, prev),
+						 &block);
+			if (result) {
+				sfs_brelse(idbuf);
+				return result;
+			}
+
+			/* Remember the block we allocated */
+			idptrs[idoff] = block;
+
+			/* The indirect block is now dirty */
+			sfs_bdirty(idbuf);
 		}
+		sfs_brelse(idbuf);
+
+		if (l == 1 || block == 0) {
+			break;
+		}
+		start += idoff * sfs_ispan[l-1];
+		idblock = block;
+		l--;
 	}
 
 	/* Hand back the result and return. */
@@ -196,34 +285,105 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Discard the blocks from file block BLOCKLEN on that are mapped by
+ * the indirect block in *IDBLOCKP, which is at level LEVEL and maps
+ * file blocks from START on. If that leaves it empty, free it too,
+ * clear *IDBLOCKP and set *DIRTYP.
+ *
+ * The indirect block stays locked while the levels below it are
+ * done, as sfs_bmap also locks indirect blocks before the blocks
+ * they point to.
  */
+static
 int
-sfs_itrunc(struct sfs_vnode *sv, off_t len)
+sfs_itrunc_ind(struct sfs_vnode *sv, uint32_t *idblockp, unsigned level,
+	       uint32_t start, uint32_t blocklen, bool *dirtyp)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *idbuf;
+	uint32_t *idptrs;
+	uint32_t j, span;
+	bool hasnonzero, iddirty;
+	int result;
+
+	span = sfs_ispan[level-1];
+	if (*idblockp == 0 || blocklen >= start + sfs_ispan[level]) {
+		/* Nothing here, or nothing past the proposed EOF */
+		return 0;
+	}
 
+	/* Read the indirect block */
+	result = sfs_bread(sfs, *idblockp, &idbuf);
+	if (result) {
+		return result;
+	}
+	idptrs = idbuf->b_data;
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		if (level > 1) {
+			result = sfs_itrunc_ind(sv, &idptrs[j], level-1,
+						start + j*span, blocklen,
+						&iddirty);
+			if (result) {
+				if (iddirty) {
+					sfs_bdirty(idbuf);
+				}
+				sfs_brelse(idbuf);
+				return result;
+			}
+		}
+		/* Discard any blocks that are past the new EOF */
+		else if (blocklen <= start+j && idptrs[j] != 0) {
+			sfs_bfree(sfs, idptrs[j]);
+			idptrs[j] = 0;
+			iddirty = true;
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (idptrs[j]!=0) {
+			hasnonzero = true;
+		}
+	}
+
+	if (!hasnonzero) {
+		/*
+		 * The whole indirect block is empty now; free it.
+		 * Let go of the buffer first, as freeing the block
+		 * invalidates it.
+		 */
+		sfs_brelse(idbuf);
+		sfs_bfree(sfs, *idblockp);
+		*idblockp = 0;
+		*dirtyp = true;
+	}
+	else {
+		/* The indirect block gets written back later */
+		if (iddirty) {
+			sfs_bdirty(idbuf);
+		}
+		sfs_brelse(idbuf);
+	}
+	return 0;
+}
+
+/*
+ * Called for ftruncate() and from sfs_reclaim, with the vnode locked.
+ */
+int
+sfs_itrunc(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
 	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
 
-	uint32_t i, j;
-	daddr_t block, idblock;
-	uint32_t baseblock, highblock;
+	uint32_t i, start;
+	daddr_t block;
+	unsigned level;
 	int result;
-	int hasnonzero, iddirty;
-
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
 
-	vfs_biglock_acquire();
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -238,55 +398,23 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_readblock(sfs, idblock, idbuf, sizeof(idbuf));
+	/*
+	 * Then the indirect trees, from the one mapping the highest
+	 * blocks down. Forget the cached indirect path first, as the
+	 * blocks on it may be freed.
+	 */
+	sfs_ipath_clear(sv);
+	start = SFS_NDIRECT;
+	for (level=1; level<SFS_ILEVELS; level++) {
+		start += sfs_ispan[level];
+	}
+	for (level=SFS_ILEVELS; level>=1; level--) {
+		result = sfs_itrunc_ind(sv, sfs_iroot(sv, level), level,
+					start, blocklen, &sv->sv_dirty);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
-
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
-			sv->sv_dirty = true;
-		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_writeblock(sfs, idblock, idbuf,
-						sizeof(idbuf));
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
+		start -= sfs_ispan[level-1];
 	}
 
 	/* Set the file size */
@@ -295,7 +423,5 @@ sfs_itrunc(struct sfs_vnode *sv, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
-
@@ -0,0 +1,743 @@
+/*
+ * SFS filesystem
+ *
+ * Buffer cache.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <wchan.h>
+#include <vfs.h>
+#include <device.h>
+#include <sfs.h>
+#include "sfsprivate.h"
+
+/*
+ * Every block of an SFS volume other than the superblock and the free
+ * block bitmap is read and written through this cache, except that
+ * whole-block file data that is read goes straight from the disk to
+ * the user (see sfs_blockio) unless the block happens to be cached.
+ *
+ * Buffers are shared by all mounted volumes and found by (volume,
+ * block) through a hash table. The identity of a buffer, its place in
+ * the hash table and on the LRU list, and its reference count are
+ * protected by sfs_buflock. The contents and the b_valid and b_dirty
+ * flags are protected by the buffer's own b_lock, which is held from
+ * sfs_bread or sfs_bget until sfs_brelse. A referenced buffer is never
+ * given another identity.
+ *
+ * Read-ahead (sfs_bprefetch) hands a buffer to the disk driver
+ * without holding b_lock, since the I/O finishes in interrupt context.
+ * Instead the buffer is marked busy and keeps a reference until the
+ * read is done, and anyone who locks it waits for that.
+ *
+ * Unreferenced buffers sit on the LRU list, least recently used at
+ * the head. Once SFS_NBUFS buffers exist, the head one is reused for
+ * a block that isn't cached, after being written back if it is dirty.
+ * Otherwise dirty buffers are only written back by sfs_bsync, which
+ * the sync thread (see vfs_syncer) calls every few seconds. Its
+ * writes are asynchronous like read-ahead, and busy in the same way.
+ *
+ * Buffers are never freed. If every one is in use, more than
+ * SFS_NBUFS are made.
+ */
+#define SFS_NBUFS     128
+#define SFS_BUFHASH   64              /* hash buckets; a power of 2 */
+
+static struct spinlock sfs_buflock = SPINLOCK_INITIALIZER;
+static struct sfs_buf *sfs_bufhash[SFS_BUFHASH];
+static struct sfs_buf *sfs_buflru_head, *sfs_buflru_tail;
+static struct sfs_buf *sfs_buflist;   /* every buffer, via b_allnext */
+static unsigned sfs_nbufs;
+
+static
+unsigned
+sfs_bufhashfn(struct sfs_fs *sfs, daddr_t block)
+{
+        return (block ^ ((uintptr_t)sfs >> 4)) & (SFS_BUFHASH - 1);
+}
+
+static
+struct sfs_buf *
+sfs_buffind(struct sfs_fs *sfs, daddr_t block)
+{
+        struct sfs_buf *b;
+
+        KASSERT(spinlock_do_i_hold(&sfs_buflock));
+
+        for (b = sfs_bufhash[sfs_bufhashfn(sfs, block)]; b != NULL;
+             b = b->b_hashnext) {
+                if (b->b_fs == sfs && b->b_block == block) {
+                        return b;
+                }
+        }
+        return NULL;
+}
+
+static
+void
+sfs_bufhashin(struct sfs_buf *b, struct sfs_fs *sfs, daddr_t block)
+{
+        unsigned h = sfs_bufhashfn(sfs, block);
+
+        KASSERT(b->b_fs == NULL);
+        b->b_fs = sfs;
+        b->b_block = block;
+        b->b_valid = false;
+        b->b_dirty = false;
+        b->b_hashnext = sfs_bufhash[h];
+        sfs_bufhash[h] = b;
+}
+
+static
+void
+sfs_bufunhash(struct sfs_buf *b)
+{
+        struct sfs_buf **pp;
+
+        KASSERT(b->b_fs != NULL);
+        pp = &sfs_bufhash[sfs_bufhashfn(b->b_fs, b->b_block)];
+        while (*pp != b) {
+                KASSERT(*pp != NULL);
+                pp = &(*pp)->b_hashnext;
+        }
+        *pp = b->b_hashnext;
+        b->b_hashnext = NULL;
+        b->b_fs = NULL;
+}
+
+/*
+ * LRU list manipulation. Buffers go on at the tail when released, or
+ * at the head if they no longer hold anything worth keeping.
+ */
+static
+void
+sfs_buflru_remove(struct sfs_buf *b)
+{
+        if (b->b_lruprev != NULL) {
+                b->b_lruprev->b_lrunext = b->b_lrunext;
+        }
+        else {
+                sfs_buflru_head = b->b_lrunext;
+        }
+        if (b->b_lrunext != NULL) {
+                b->b_lrunext->b_lruprev = b->b_lruprev;
+        }
+        else {
+                sfs_buflru_tail = b->b_lruprev;
+        }
+        b->b_lrunext = b->b_lruprev = NULL;
+}
+
+static
+void
+sfs_buflru_insert(struct sfs_buf *b, bool athead)
+{
+        if (athead) {
+                b->b_lruprev = NULL;
+                b->b_lrunext = sfs_buflru_head;
+                if (sfs_buflru_head != NULL) {
+                        sfs_buflru_head->b_lruprev = b;
+                }
+                else {
+                        sfs_buflru_tail = b;
+                }
+                sfs_buflru_head = b;
+        }
+        else {
+                b->b_lrunext = NULL;
+                b->b_lruprev = sfs_buflru_tail;
+                if (sfs_buflru_tail != NULL) {
+                        sfs_buflru_tail->b_lrunext = b;
+                }
+                else {
+                        sfs_buflru_head = b;
+                }
+                sfs_buflru_tail = b;
+        }
+}
+
+/*
+ * Take a reference to a buffer.
+ */
+static
+void
+sfs_bufref(struct sfs_buf *b)
+{
+        KASSERT(spinlock_do_i_hold(&sfs_buflock));
+
+        if (b->b_refcount == 0) {
+                sfs_buflru_remove(b);
+        }
+        b->b_refcount++;
+}
+
+/*
+ * Drop a reference, putting the buffer back on the LRU list if it was
+ * the last. A buffer that no longer holds a valid block is forgotten
+ * and goes first in line for reuse, as does one the caller says to.
+ */
+static
+void
+sfs_bufunref(struct sfs_buf *b, bool reusefirst)
+{
+        KASSERT(spinlock_do_i_hold(&sfs_buflock));
+        KASSERT(b->b_refcount > 0);
+
+        b->b_refcount--;
+        if (b->b_refcount == 0) {
+                /* Nobody holds it, so b_valid can be looked at */
+                if (!b->b_valid && b->b_fs != NULL) {
+                        sfs_bufunhash(b);
+                }
+                sfs_buflru_insert(b, reusefirst || b->b_fs == NULL);
+        }
+}
+
+static
+struct sfs_buf *
+sfs_bufcreate(void)
+{
+        struct sfs_buf *b;
+
+        b = kmalloc(sizeof(struct sfs_buf));
+        if (b == NULL) {
+                return NULL;
+        }
+        b->b_data = kmalloc(SFS_BLOCKSIZE);
+        if (b->b_data == NULL) {
+                kfree(b);
+                return NULL;
+        }
+        b->b_lock = lock_create("sfs buffer");
+        if (b->b_lock == NULL) {
+                kfree(b->b_data);
+                kfree(b);
+                return NULL;
+        }
+        b->b_wchan = wchan_create("sfs buffer");
+        if (b->b_wchan == NULL) {
+                lock_destroy(b->b_lock);
+                kfree(b->b_data);
+                kfree(b);
+                return NULL;
+        }
+        b->b_fs = NULL;
+        b->b_block = 0;
+        b->b_hashnext = NULL;
+        b->b_lrunext = b->b_lruprev = NULL;
+        b->b_allnext = NULL;
+        b->b_refcount = 0;
+        b->b_busy = false;
+        b->b_valid = false;
+        b->b_dirty = false;
+        return b;
+}
+
+static
+void
+sfs_bufdestroy(struct sfs_buf *b)
+{
+        wchan_destroy(b->b_wchan);
+        lock_destroy(b->b_lock);
+        kfree(b->b_data);
+        kfree(b);
+}
+
+/*
+ * Lock a referenced buffer, first waiting for any read-ahead into it
+ * to finish.
+ */
+static
+void
+sfs_bufacquire(struct sfs_buf *b)
+{
+        lock_acquire(b->b_lock);
+
+        spinlock_acquire(&sfs_buflock);
+        while (b->b_busy) {
+                wchan_sleep(b->b_wchan, &sfs_buflock);
+        }
+        spinlock_release(&sfs_buflock);
+}
+
+/*
+ * Write a locked buffer back to disk.
+ */
+static
+int
+sfs_bufwrite(struct sfs_buf *b)
+{
+        int result;
+
+        KASSERT(lock_do_i_hold(b->b_lock));
+        KASSERT(b->b_valid);
+
+        result = sfs_writeblock(b->b_fs, b->b_block, b->b_data,
+                                SFS_BLOCKSIZE);
+        if (result) {
+                kprintf("sfs: writeback of block %u failed: %s\n",
+                        b->b_block, strerror(result));
+                return result;
+        }
+        b->b_dirty = false;
+        return 0;
+}
+
+/*
+ * Find or make the buffer for BLOCK of SFS, referenced and locked.
+ * If it isn't cached, it is read in if DOREAD is set and zeroed
+ * otherwise.
+ */
+static
+int
+sfs_bufget(struct sfs_fs *sfs, daddr_t block, bool doread,
+           struct sfs_buf **ret)
+{
+        struct sfs_buf *b, *new;
+        bool grow;
+        int result;
+
+        new = NULL;
+        grow = true;
+
+        spinlock_acquire(&sfs_buflock);
+        while (1) {
+                b = sfs_buffind(sfs, block);
+                if (b != NULL) {
+                        sfs_bufref(b);
+                        break;
+                }
+
+                /* Make a new buffer if there are few, or none to reuse */
+                if (new != NULL) {
+                        b = new;
+                        new = NULL;
+                        b->b_allnext = sfs_buflist;
+                        sfs_buflist = b;
+                        sfs_nbufs++;
+                        sfs_bufhashin(b, sfs, block);
+                        b->b_refcount = 1;
+                        break;
+                }
+                if (grow && (sfs_nbufs < SFS_NBUFS ||
+                             sfs_buflru_head == NULL)) {
+                        spinlock_release(&sfs_buflock);
+                        new = sfs_bufcreate();
+                        spinlock_acquire(&sfs_buflock);
+                        grow = new != NULL;
+                        continue;
+                }
+
+                /* Reuse the least recently used one */
+                b = sfs_buflru_head;
+                if (b == NULL) {
+                        spinlock_release(&sfs_buflock);
+                        return ENOMEM;
+                }
+                sfs_bufref(b);
+                if (b->b_fs == NULL || !b->b_dirty) {
+                        if (b->b_fs != NULL) {
+                                sfs_bufunhash(b);
+                        }
+                        sfs_bufhashin(b, sfs, block);
+                        break;
+                }
+
+                /*
+                 * Dirty; write it back first. Someone may look it
+                 * up meanwhile, so start over afterwards.
+                 */
+                spinlock_release(&sfs_buflock);
+                sfs_bufacquire(b);
+                result = b->b_dirty ? sfs_bufwrite(b) : 0;
+                lock_release(b->b_lock);
+                spinlock_acquire(&sfs_buflock);
+                sfs_bufunref(b, true);
+                if (result) {
+                        spinlock_release(&sfs_buflock);
+                        return result;
+                }
+        }
+        spinlock_release(&sfs_buflock);
+
+        /* Made a buffer but didn't need it after all */
+        if (new != NULL) {
+                sfs_bufdestroy(new);
+        }
+
+        sfs_bufacquire(b);
+        if (!b->b_valid) {
+                if (doread) {
+                        result = sfs_readblock(sfs, block, b->b_data,
+                                               SFS_BLOCKSIZE);
+                        if (result) {
+                                sfs_brelse(b);
+                                return result;
+                        }
+                }
+                else {
+                        bzero(b->b_data, SFS_BLOCKSIZE);
+                }
+                b->b_valid = true;
+        }
+
+        *ret = b;
+        return 0;
+}
+
+int
+sfs_bread(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret)
+{
+        return sfs_bufget(sfs, block, true, ret);
+}
+
+int
+sfs_bget(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret)
+{
+        return sfs_bufget(sfs, block, false, ret);
+}
+
+struct sfs_buf *
+sfs_bpeek(struct sfs_fs *sfs, daddr_t block)
+{
+        struct sfs_buf *b;
+
+        spinlock_acquire(&sfs_buflock);
+        b = sfs_buffind(sfs, block);
+        if (b != NULL) {
+                sfs_bufref(b);
+        }
+        spinlock_release(&sfs_buflock);
+
+        if (b == NULL) {
+                return NULL;
+        }
+        sfs_bufacquire(b);
+        if (!b->b_valid) {
+                sfs_brelse(b);
+                return NULL;
+        }
+        return b;
+}
+
+/*
+ * Completion callback for read-ahead, called from the disk's interrupt
+ * handler. Drops the reference sfs_bprefetch took.
+ */
+static
+void
+sfs_bprefetchdone(struct devreq *req, int result)
+{
+        struct sfs_buf *b = req->dr_arg;
+
+        spinlock_acquire(&sfs_buflock);
+        KASSERT(b->b_busy);
+        b->b_valid = (result == 0);
+        b->b_busy = false;
+        wchan_wakeall(b->b_wchan, &sfs_buflock);
+        sfs_bufunref(b, false);
+        spinlock_release(&sfs_buflock);
+}
+
+void
+sfs_bprefetch(struct sfs_fs *sfs, daddr_t block)
+{
+        struct device *dev = sfs->sfs_device;
+        struct sfs_buf *b, *new;
+        int result;
+
+        if (dev->d_ops->devop_strategy == NULL) {
+                return;
+        }
+
+        /* Unlocked peek; it doesn't matter if we get it wrong */
+        new = NULL;
+        if (sfs_nbufs < SFS_NBUFS) {
+                new = sfs_bufcreate();
+        }
+
+        spinlock_acquire(&sfs_buflock);
+        if (sfs_buffind(sfs, block) != NULL) {
+                /* Cached already, or on its way */
+                spinlock_release(&sfs_buflock);
+                if (new != NULL) {
+                        sfs_bufdestroy(new);
+                }
+                return;
+        }
+        if (new != NULL) {
+                b = new;
+                b->b_allnext = sfs_buflist;
+                sfs_buflist = b;
+                sfs_nbufs++;
+                b->b_refcount = 1;
+        }
+        else {
+                /* Don't wait to write anything back */
+                b = sfs_buflru_head;
+                if (b == NULL || (b->b_fs != NULL && b->b_dirty)) {
+                        spinlock_release(&sfs_buflock);
+                        return;
+                }
+                sfs_bufref(b);
+                if (b->b_fs != NULL) {
+                        sfs_bufunhash(b);
+                }
+        }
+        sfs_bufhashin(b, sfs, block);
+        b->b_busy = true;
+        spinlock_release(&sfs_buflock);
+
+        b->b_req.dr_block = block;
+        b->b_req.dr_nblocks = 1;
+        b->b_req.dr_data = b->b_data;
+        b->b_req.dr_write = false;
+        b->b_req.dr_done = sfs_bprefetchdone;
+        b->b_req.dr_arg = b;
+        result = DEVOP_STRATEGY(dev, &b->b_req);
+        if (result) {
+                /* Never mind; b_valid is still false, so it is dropped */
+                spinlock_acquire(&sfs_buflock);
+                b->b_busy = false;
+                wchan_wakeall(b->b_wchan, &sfs_buflock);
+                sfs_bufunref(b, false);
+                spinlock_release(&sfs_buflock);
+        }
+}
+
+void
+sfs_bdirty(struct sfs_buf *b)
+{
+        KASSERT(lock_do_i_hold(b->b_lock));
+        KASSERT(b->b_valid);
+        b->b_dirty = true;
+}
+
+void
+sfs_brelse(struct sfs_buf *b)
+{
+        lock_release(b->b_lock);
+
+        spinlock_acquire(&sfs_buflock);
+        sfs_bufunref(b, false);
+        spinlock_release(&sfs_buflock);
+}
+
+void
+sfs_binval(struct sfs_fs *sfs, daddr_t block)
+{
+        struct sfs_buf *b;
+
+        spinlock_acquire(&sfs_buflock);
+        b = sfs_buffind(sfs, block);
+        if (b != NULL) {
+                sfs_bufref(b);
+        }
+        spinlock_release(&sfs_buflock);
+
+        if (b == NULL) {
+                return;
+        }
+        sfs_bufacquire(b);
+        b->b_valid = false;
+        b->b_dirty = false;
+        sfs_brelse(b);
+}
+
+/*
+ * Completion of a write started by sfs_bsync, called from the disk
+ * interrupt handler. sfs_bsync still holds its reference and looks
+ * at the result.
+ */
+static
+void
+sfs_bwritedone(struct devreq *req, int result)
+{
+        struct sfs_buf *b = req->dr_arg;
+
+        spinlock_acquire(&sfs_buflock);
+        KASSERT(b->b_busy);
+        req->dr_result = result;
+        b->b_busy = false;
+        wchan_wakeall(b->b_wchan, &sfs_buflock);
+        spinlock_release(&sfs_buflock);
+}
+
+/*
+ * Start writing back a referenced buffer, if it is dirty. Like
+ * read-ahead, the write runs with the buffer busy rather than locked.
+ * If the device can't take it that way it is written synchronously.
+ * Returns true if a write was started.
+ */
+static
+bool
+sfs_bstartwrite(struct sfs_buf *b, int *err)
+{
+        struct device *dev = b->b_fs->sfs_device;
+        int result;
+
+        sfs_bufacquire(b);
+        if (!b->b_valid || !b->b_dirty) {
+                lock_release(b->b_lock);
+                return false;
+        }
+
+        if (dev->d_ops->devop_strategy != NULL) {
+                spinlock_acquire(&sfs_buflock);
+                b->b_busy = true;
+                spinlock_release(&sfs_buflock);
+                b->b_dirty = false;
+
+                b->b_req.dr_block = b->b_block;
+                b->b_req.dr_nblocks = 1;
+                b->b_req.dr_data = b->b_data;
+                b->b_req.dr_write = true;
+                b->b_req.dr_done = sfs_bwritedone;
+                b->b_req.dr_arg = b;
+                b->b_req.dr_result = 0;
+                result = DEVOP_STRATEGY(dev, &b->b_req);
+                if (result == 0) {
+                        lock_release(b->b_lock);
+                        return true;
+                }
+                spinlock_acquire(&sfs_buflock);
+                b->b_busy = false;
+                wchan_wakeall(b->b_wchan, &sfs_buflock);
+                spinlock_release(&sfs_buflock);
+                b->b_dirty = true;
+        }
+
+        result = sfs_bufwrite(b);
+        if (result && *err == 0) {
+                *err = result;
+        }
+        lock_release(b->b_lock);
+        return false;
+}
+
+/*
+ * Wait for a write started by sfs_bstartwrite. If it failed, try
+ * again synchronously (sfs_writeblock retries); if that fails too the
+ * buffer is left dirty.
+ */
+static
+void
+sfs_bwaitwrite(struct sfs_buf *b, int *err)
+{
+        int result;
+
+        spinlock_acquire(&sfs_buflock);
+        while (b->b_busy) {
+                wchan_sleep(b->b_wchan, &sfs_buflock);
+        }
+        spinlock_release(&sfs_buflock);
+
+        if (b->b_req.dr_result == 0) {
+                return;
+        }
+        sfs_bufacquire(b);
+        if (b->b_valid) {
+                result = sfs_bufwrite(b);
+                if (result) {
+                        b->b_dirty = true;
+                        if (*err == 0) {
+                                *err = result;
+                        }
+                }
+        }
+        lock_release(b->b_lock);
+}
+
+/*
+ * Write back every dirty buffer of SFS. Buffers are taken in batches;
+ * each batch is sorted by block number and all of its writes are
+ * started before any is waited for, so the disk driver can stream
+ * them (and merge adjacent blocks). Only one buffer is locked at a
+ * time.
+ */
+#define SFS_SYNCBATCH 32
+
+int
+sfs_bsync(struct sfs_fs *sfs)
+{
+        struct sfs_buf *batch[SFS_SYNCBATCH];
+        bool started[SFS_SYNCBATCH];
+        struct sfs_buf *b, *next;
+        unsigned n, i, j;
+        int result;
+
+        result = 0;
+
+        /* The list only ever grows at the head, so this is safe */
+        spinlock_acquire(&sfs_buflock);
+        next = sfs_buflist;
+        while (next != NULL) {
+                n = 0;
+                for (; next != NULL && n < SFS_SYNCBATCH;
+                     next = next->b_allnext) {
+                        b = next;
+                        if (b->b_fs != sfs ||
+                            (b->b_refcount == 0 && !b->b_dirty)) {
+                                continue;
+                        }
+                        sfs_bufref(b);
+
+                        /* Insertion sort by block number */
+                        for (j = n; j > 0 &&
+                                     batch[j-1]->b_block > b->b_block; j--) {
+                                batch[j] = batch[j-1];
+                        }
+                        batch[j] = b;
+                        n++;
+                }
+                spinlock_release(&sfs_buflock);
+
+                for (i = 0; i < n; i++) {
+                        started[i] = sfs_bstartwrite(batch[i], &result);
+                }
+                for (i = 0; i < n; i++) {
+                        if (started[i]) {
+                                sfs_bwaitwrite(batch[i], &result);
+                        }
+                }
+
+                spinlock_acquire(&sfs_buflock);
+                for (i = 0; i < n; i++) {
+                        sfs_bufunref(batch[i], false);
+                }
+        }
+        spinlock_release(&sfs_buflock);
+
+        return result;
+}
+
+void
+sfs_bdetach(struct sfs_fs *sfs)
+{
+        struct sfs_buf *b;
+
+        spinlock_acquire(&sfs_buflock);
+        for (b = sfs_buflist; b != NULL; b = b->b_allnext) {
+                /* Read-ahead can still be in flight */
+                while (b->b_fs == sfs && b->b_busy) {
+                        wchan_sleep(b->b_wchan, &sfs_buflock);
+                }
+                if (b->b_fs != sfs) {
+                        continue;
+                }
+                KASSERT(b->b_refcount == 0);
+                if (b->b_dirty) {
+                        kprintf("sfs: discarding dirty block %u\n",
+                                b->b_block);
+                }
+                sfs_buflru_remove(b);
+                sfs_bufunhash(b);
+                b->b_valid = false;
+                b->b_dirty = false;
+                sfs_buflru_insert(b, true);
+        }
+        spinlock_release(&sfs_buflock);
+}
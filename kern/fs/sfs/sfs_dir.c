@@ -94,6 +94,443 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 	return size / sizeof(struct sfs_direntry);
 }
 
+/*
+ * Directory index (see <kern/sfs.h>).
+ *
+ * A directory gets an index once it has SFS_DIRHASH_THRESH slots, and
+ * from then on lookups, creates and removes probe the index instead of
+ * reading every entry. The table is rebuilt, with twice as many
+ * buckets as entries, whenever more than 3/4 of its buckets are in use
+ * or deleted; so probes stay short and rebuilding costs O(1) per
+ * insert amortized. A directory too big for the largest table loses
+ * its index and is searched linearly again.
+ *
+ * The index is only a shortcut: if it can't be updated (no space for
+ * an index block, say), or turns out not to match the entries, it is
+ * dropped and the entries stay as they are. One stamped with another
+ * generation may not match after a crash, and is rebuilt before use. A directory too big to index
+ * remembers how many entries it has in sv_dhbig, so that it isn't
+ * tried again until enough of them are removed.
+ *
+ * sv_dirfree lets inserts into an indexed directory find a free slot
+ * without the linear search: every slot below it is known to be in use.
+ */
+
+#define SFS_DIRHASH_THRESH  64          /* slots before indexing */
+
+/*
+ * What the index functions return when the index doesn't match the
+ * entries; the caller drops it.
+ */
+#define SFS_DH_BAD          EINVAL
+
+/*
+ * Hash a name for the index.
+ */
+static
+uint32_t
+sfs_dirhash(const char *name)
+{
+	uint32_t h;
+
+	h = SFS_DH_FNVBASIS;
+	for (; *name != 0; name++) {
+		h ^= (unsigned char)*name;
+		h *= SFS_DH_FNVPRIME;
+	}
+	return h;
+}
+
+/*
+ * Find the block that holds bucket I of the index, or 0 if it has
+ * none. If DOALLOC is set, allocate it (and its map block) instead.
+ */
+static
+int
+sfs_dh_bmap(struct sfs_vnode *sv, unsigned i, bool doalloc, daddr_t *ret)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *mapbuf;
+	uint32_t *mapp, *map;
+	unsigned idx;
+	daddr_t block;
+	int result;
+
+	idx = i / SFS_DHPERBLOCK;
+	KASSERT(idx < SFS_NDIRHASH * SFS_DBPERIDB);
+
+	mapp = &sv->sv_i.sfi_dirhashblocks[idx / SFS_DBPERIDB];
+	if (*mapp == 0) {
+		if (!doalloc) {
+			*ret = 0;
+			return 0;
+		}
+		/* sfs_balloc zeroes it, which makes every entry 0 */
+		result = sfs_balloc(sfs, sv->sv_ino, &block);
+		if (result) {
+			return result;
+		}
+		*mapp = block;
+		sv->sv_dirty = true;
+	}
+
+	result = sfs_bread(sfs, *mapp, &mapbuf);
+	if (result) {
+		return result;
+	}
+	map = mapbuf->b_data;
+	block = map[idx % SFS_DBPERIDB];
+	if (block == 0 && doalloc) {
+		/* Likewise, this makes every bucket empty */
+		result = sfs_balloc(sfs, sv->sv_ino, &block);
+		if (result) {
+			sfs_brelse(mapbuf);
+			return result;
+		}
+		map[idx % SFS_DBPERIDB] = block;
+		sfs_bdirty(mapbuf);
+	}
+	sfs_brelse(mapbuf);
+
+	*ret = block;
+	return 0;
+}
+
+/*
+ * Read bucket I of the index.
+ */
+static
+int
+sfs_dh_read(struct sfs_vnode *sv, unsigned i, struct sfs_dirhashent *ent)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dirhashent *ents;
+	struct sfs_buf *buf;
+	daddr_t block;
+	int result;
+
+	result = sfs_dh_bmap(sv, i, false, &block);
+	if (result) {
+		return result;
+	}
+	if (block == 0) {
+		ent->sdh_hash = 0;
+		ent->sdh_slot = SFS_DH_EMPTY;
+		return 0;
+	}
+	result = sfs_bread(sfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	ents = buf->b_data;
+	*ent = ents[i % SFS_DHPERBLOCK];
+	sfs_brelse(buf);
+	return 0;
+}
+
+/*
+ * Write bucket I of the index, allocating its block if need be.
+ */
+static
+int
+sfs_dh_write(struct sfs_vnode *sv, unsigned i,
+	     const struct sfs_dirhashent *ent)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_dirhashent *ents;
+	struct sfs_buf *buf;
+	daddr_t block;
+	int result;
+
+	result = sfs_dh_bmap(sv, i, true, &block);
+	if (result) {
+		return result;
+	}
+	result = sfs_bread(sfs, block, &buf);
+	if (result) {
+		return result;
+	}
+	ents = buf->b_data;
+	ents[i % SFS_DHPERBLOCK] = *ent;
+	sfs_bdirty(buf);
+	sfs_brelse(buf);
+	return 0;
+}
+
+/*
+ * Throw the index away, freeing its blocks. If a map block can't be
+ * read, the index blocks it lists are lost until sfsck frees them.
+ */
+void
+sfs_dir_dropindex(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *mapbuf;
+	uint32_t *map;
+	unsigned i, j;
+
+	for (i=0; i<SFS_NDIRHASH; i++) {
+		if (sv->sv_i.sfi_dirhashblocks[i] == 0) {
+			continue;
+		}
+		if (sfs_bread(sfs, sv->sv_i.sfi_dirhashblocks[i],
+			      &mapbuf) == 0) {
+			map = mapbuf->b_data;
+			for (j=0; j<SFS_DBPERIDB; j++) {
+				if (map[j] != 0) {
+					sfs_bfree(sfs, map[j]);
+				}
+			}
+			sfs_brelse(mapbuf);
+		}
+		sfs_bfree(sfs, sv->sv_i.sfi_dirhashblocks[i]);
+		sv->sv_i.sfi_dirhashblocks[i] = 0;
+		sv->sv_dirty = true;
+	}
+	if (sv->sv_i.sfi_dirhash != 0) {
+		sv->sv_i.sfi_dirhash = 0;
+		sv->sv_i.sfi_dhused = 0;
+		sv->sv_i.sfi_dhdeleted = 0;
+		sv->sv_i.sfi_dhgen = 0;
+		sv->sv_dirty = true;
+	}
+}
+
+/*
+ * Add slot SLOT, holding a name that hashes to HASH, to the index.
+ */
+static
+int
+sfs_dh_insert(struct sfs_vnode *sv, uint32_t hash, int slot)
+{
+	struct sfs_dirhashent ent;
+	unsigned mask, i, n;
+	int result;
+
+	mask = sv->sv_i.sfi_dirhash - 1;
+	for (n = 0, i = hash & mask; ; n++, i = (i + 1) & mask) {
+		if (n > mask) {
+			/* No free bucket; the counts were wrong */
+			return SFS_DH_BAD;
+		}
+		result = sfs_dh_read(sv, i, &ent);
+		if (result) {
+			return result;
+		}
+		if (ent.sdh_slot == SFS_DH_EMPTY ||
+		    ent.sdh_slot == SFS_DH_DELETED) {
+			break;
+		}
+	}
+
+	if (ent.sdh_slot == SFS_DH_DELETED) {
+		sv->sv_i.sfi_dhdeleted--;
+	}
+	ent.sdh_hash = hash;
+	ent.sdh_slot = slot + 1;
+	result = sfs_dh_write(sv, i, &ent);
+	if (result) {
+		return result;
+	}
+	sv->sv_i.sfi_dhused++;
+	sv->sv_dirty = true;
+	return 0;
+}
+
+/*
+ * Mark the bucket for slot SLOT, holding a name that hashes to HASH,
+ * deleted.
+ */
+static
+int
+sfs_dh_remove(struct sfs_vnode *sv, uint32_t hash, int slot)
+{
+	struct sfs_dirhashent ent;
+	unsigned mask, i, n;
+	int result;
+
+	mask = sv->sv_i.sfi_dirhash - 1;
+	for (n = 0, i = hash & mask; ; n++, i = (i + 1) & mask) {
+		if (n > mask) {
+			return SFS_DH_BAD;
+		}
+		result = sfs_dh_read(sv, i, &ent);
+		if (result) {
+			return result;
+		}
+		if (ent.sdh_slot == SFS_DH_EMPTY) {
+			/* The slot isn't in the index */
+			return SFS_DH_BAD;
+		}
+		if (ent.sdh_slot == (uint32_t)slot + 1) {
+			break;
+		}
+	}
+
+	ent.sdh_slot = SFS_DH_DELETED;
+	result = sfs_dh_write(sv, i, &ent);
+	if (result) {
+		return result;
+	}
+	sv->sv_i.sfi_dhused--;
+	sv->sv_i.sfi_dhdeleted++;
+	sv->sv_dirty = true;
+	return 0;
+}
+
+/*
+ * Replace the index (if any) with a new one sized for the entries
+ * there are now, or with none if that would be too big. Failing to
+ * make it just leaves the directory without one.
+ */
+static
+void
+sfs_dh_build(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_direntry tsd;
+	unsigned size, nlive;
+	int nentries, i, result;
+
+	sfs_dir_dropindex(sv);
+
+	nentries = sfs_dir_nentries(sv);
+	nlive = 0;
+	for (i=0; i<nentries; i++) {
+		result = sfs_readdir(sv, i, &tsd);
+		if (result) {
+			return;
+		}
+		if (tsd.sfd_ino != SFS_NOINO) {
+			nlive++;
+		}
+	}
+
+	size = SFS_DIRHASH_MIN;
+	while (size < 2 * nlive) {
+		size *= 2;
+	}
+	if (size > SFS_DIRHASH_MAX) {
+		sv->sv_dhbig = nlive;
+		return;
+	}
+	sv->sv_dhbig = 0;
+	sv->sv_i.sfi_dirhash = size;
+	sv->sv_i.sfi_dhgen = sfs->sfs_sb.sb_dhgen;
+	sv->sv_dirty = true;
+
+	for (i=0; i<nentries; i++) {
+		result = sfs_readdir(sv, i, &tsd);
+		if (result) {
+			sfs_dir_dropindex(sv);
+			return;
+		}
+		if (tsd.sfd_ino == SFS_NOINO) {
+			continue;
+		}
+		tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+		result = sfs_dh_insert(sv, sfs_dirhash(tsd.sfd_name), i);
+		if (result) {
+			sfs_dir_dropindex(sv);
+			return;
+		}
+	}
+}
+
+/*
+ * Look up NAME with the index.
+ */
+static
+int
+sfs_dh_findname(struct sfs_vnode *sv, const char *name,
+		uint32_t *ino, int *slot)
+{
+	struct sfs_dirhashent ent;
+	struct sfs_direntry tsd;
+	uint32_t hash;
+	unsigned mask, i, n;
+	int result;
+
+	hash = sfs_dirhash(name);
+	mask = sv->sv_i.sfi_dirhash - 1;
+	for (n = 0, i = hash & mask; ; n++, i = (i + 1) & mask) {
+		if (n > mask) {
+			/* No empty bucket at all */
+			return SFS_DH_BAD;
+		}
+		result = sfs_dh_read(sv, i, &ent);
+		if (result) {
+			return result;
+		}
+		if (ent.sdh_slot == SFS_DH_EMPTY) {
+			return ENOENT;
+		}
+		if (ent.sdh_slot == SFS_DH_DELETED || ent.sdh_hash != hash) {
+			continue;
+		}
+		if (ent.sdh_slot > (uint32_t)sfs_dir_nentries(sv)) {
+			return SFS_DH_BAD;
+		}
+
+		result = sfs_readdir(sv, ent.sdh_slot - 1, &tsd);
+		if (result) {
+			return result;
+		}
+		tsd.sfd_name[sizeof(tsd.sfd_name)-1] = 0;
+		if (tsd.sfd_ino != SFS_NOINO && !strcmp(tsd.sfd_name, name)) {
+			if (slot != NULL) {
+				*slot = ent.sdh_slot - 1;
+			}
+			if (ino != NULL) {
+				*ino = tsd.sfd_ino;
+			}
+			return 0;
+		}
+	}
+}
+
+/*
+ * Rebuild the index if it was made under another generation, as a
+ * crash since may have left it out of step with the entries.
+ */
+static
+void
+sfs_dh_check(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+
+	if (sv->sv_i.sfi_dirhash != 0 &&
+	    sv->sv_i.sfi_dhgen != sfs->sfs_sb.sb_dhgen) {
+		sfs_dh_build(sv);
+	}
+}
+
+/*
+ * Find the first free slot at or after sv_dirfree, or the number of
+ * slots if there is none.
+ */
+static
+int
+sfs_dh_freeslot(struct sfs_vnode *sv, int *emptyslot)
+{
+	struct sfs_direntry tsd;
+	int nentries, i, result;
+
+	nentries = sfs_dir_nentries(sv);
+	for (i = sv->sv_dirfree; i < nentries; i++) {
+		result = sfs_readdir(sv, i, &tsd);
+		if (result) {
+			return result;
+		}
+		if (tsd.sfd_ino == SFS_NOINO) {
+			break;
+		}
+	}
+	sv->sv_dirfree = i;
+	*emptyslot = i;
+	return 0;
+}
+
 /*
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
@@ -106,6 +543,22 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 	struct sfs_direntry tsd;
 	int found, nentries, i, result;
 
+	sfs_dh_check(sv);
+	if (sv->sv_i.sfi_dirhash != 0) {
+		result = sfs_dh_findname(sv, name, ino, slot);
+		if (result == SFS_DH_BAD) {
+			/* Search the entries instead */
+			sfs_dir_dropindex(sv);
+		}
+		else if (result != ENOENT || emptyslot == NULL) {
+			return result;
+		}
+		else {
+			result = sfs_dh_freeslot(sv, emptyslot);
+			return result ? result : ENOENT;
+		}
+	}
+
 	nentries = sfs_dir_nentries(sv);
 
 	/* For each slot... */
@@ -155,6 +608,7 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	int emptyslot = -1;
 	int result;
 	struct sfs_direntry sd;
+	unsigned size, used;
 
 	/* Look up the name. We want to make sure it *doesn't* exist. */
 	result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
@@ -185,7 +639,38 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	}
 
 	/* Write the entry. */
-	return sfs_writedir(sv, emptyslot, &sd);
+	result = sfs_writedir(sv, emptyslot, &sd);
+	if (result) {
+		return result;
+	}
+	if (emptyslot == sv->sv_dirfree) {
+		sv->sv_dirfree++;
+	}
+
+	/* Index it, first making or rebuilding the index if it's time. */
+	size = sv->sv_i.sfi_dirhash;
+	used = sv->sv_i.sfi_dhused + sv->sv_i.sfi_dhdeleted;
+	if (size == 0 && sfs_dir_nentries(sv) < SFS_DIRHASH_THRESH) {
+		return 0;
+	}
+	if (size == 0 && sv->sv_dhbig != 0) {
+		/* Too big to index; see if it has shrunk enough */
+		sv->sv_dhbig++;
+		if (2 * sv->sv_dhbig > SFS_DIRHASH_MAX) {
+			return 0;
+		}
+	}
+	if (size == 0 || (used + 1) * 4 > size * 3) {
+		/* This picks up the new entry */
+		sfs_dh_build(sv);
+		return 0;
+	}
+	result = sfs_dh_insert(sv, sfs_dirhash(name), emptyslot);
+	if (result) {
+		/* The entry is there; do without the index */
+		sfs_dir_dropindex(sv);
+	}
+	return 0;
 }
 
 /*
@@ -195,13 +680,43 @@ int
 sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 {
 	struct sfs_direntry sd;
+	uint32_t hash = 0;
+	int result;
+
+	/* Get the name's hash first, to find it in the index */
+	sfs_dh_check(sv);
+	if (sv->sv_i.sfi_dirhash != 0) {
+		result = sfs_readdir(sv, slot, &sd);
+		if (result) {
+			return result;
+		}
+		sd.sfd_name[sizeof(sd.sfd_name)-1] = 0;
+		hash = sfs_dirhash(sd.sfd_name);
+	}
 
 	/* Initialize a suitable directory entry... */
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, slot, &sd);
+	result = sfs_writedir(sv, slot, &sd);
+	if (result) {
+		return result;
+	}
+	if (slot < sv->sv_dirfree) {
+		sv->sv_dirfree = slot;
+	}
+	if (sv->sv_dhbig != 0) {
+		sv->sv_dhbig--;
+	}
+
+	if (sv->sv_i.sfi_dirhash != 0) {
+		result = sfs_dh_remove(sv, hash, slot);
+		if (result) {
+			sfs_dir_dropindex(sv);
+		}
+	}
+	return 0;
 }
 
 /*
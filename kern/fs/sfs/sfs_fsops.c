@@ -38,6 +38,7 @@
 #include <lib.h>
 #include <array.h>
 #include <bitmap.h>
+#include <synch.h>
 #include <uio.h>
 #include <vfs.h>
 #include <device.h>
@@ -114,11 +115,12 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs;
-	unsigned i, num;
+	struct vnodearray *vnodes;
+	struct vnode *v;
+	struct sfs_vnode *sv;
+	unsigned i, h, num;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -151,18 +153,66 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
+	/*
+	 * Go over the table of loaded vnodes, syncing as we go. The
+	 * inode locks come before sfs_vnlock, so take a reference to
+	 * each vnode first and do the syncing after letting go of it.
+	 * Busy vnodes are skipped: one being loaded is clean, and
+	 * reclaim syncs one it is getting rid of itself.
+	 */
+	vnodes = vnodearray_create();
+	if (vnodes == NULL) {
+		return ENOMEM;
+	}
+	lock_acquire(sfs->sfs_vnlock);
+	num = sfs->sfs_nvnodes;
+	result = vnodearray_setsize(vnodes, num);
+	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		vnodearray_destroy(vnodes);
+		return result;
+	}
+	i = 0;
+	for (h=0; h<SFS_VNHASH; h++) {
+		for (sv = sfs->sfs_vnodes[h]; sv != NULL;
+		     sv = sv->sv_hashnext) {
+			if (sv->sv_busy) {
+				continue;
+			}
+			v = &sv->sv_absvn;
+			VOP_INCREF(v);
+			vnodearray_set(vnodes, i++, v);
+		}
+	}
+	KASSERT(i <= num);
+	num = i;
+	vnodearray_setsize(vnodes, num);
+	lock_release(sfs->sfs_vnlock);
+
 	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
+		v = vnodearray_get(vnodes, i);
+		sv = v->vn_data;
+		lock_acquire(sv->sv_lock);
+		sfs_sync_inode(sv);
+		lock_release(sv->sv_lock);
+		VOP_DECREF(v);
 	}
+	vnodearray_setsize(vnodes, 0);
+	vnodearray_destroy(vnodes);
+
+	/* Write back everything in the buffer cache, inodes included. */
+	result = sfs_bsync(sfs);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
 
 	/* If the free block map needs to be written, write it. */
 	if (sfs->sfs_freemapdirty) {
 		result = sfs_freemapio(sfs, UIO_WRITE);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_freemapdirty = false;
@@ -173,13 +223,13 @@ sfs_sync(struct fs *fs)
 		result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
 					sizeof(sfs->sfs_sb));
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
 
-	vfs_biglock_release();
+	lock_release(sfs->sfs_freemaplock);
 	return 0;
 }
 
@@ -193,13 +243,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
 
-	vfs_biglock_acquire();
-	ret = sfs->sfs_sb.sb_volname;
-	vfs_biglock_release();
-
-	return ret;
+	/* The volume name doesn't change after mount; no need to lock */
+	return sfs->sfs_sb.sb_volname;
 }
 
 /*
@@ -212,7 +258,11 @@ sfs_fs_destroy(struct sfs_fs *sfs)
 	if (sfs->sfs_freemap != NULL) {
 		bitmap_destroy(sfs->sfs_freemap);
 	}
-	vnodearray_destroy(sfs->sfs_vnodes);
+	KASSERT(sfs->sfs_nvnodes == 0);
+	cv_destroy(sfs->sfs_vncv);
+	lock_destroy(sfs->sfs_vnlock);
+	lock_destroy(sfs->sfs_freemaplock);
+	lock_destroy(sfs->sfs_sblock);
 	KASSERT(sfs->sfs_device == NULL);
 	kfree(sfs);
 }
@@ -227,19 +277,37 @@ int
 sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
+	int result;
 
-	vfs_biglock_acquire();
-
-	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	/*
+	 * Do we have any files open? If so, can't unmount. (The VFS
+	 * layer holds the big lock, so no new ones can be opened.)
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
+	/* Everything is on disk; the directory indexes can be trusted */
+	if (sfs->sfs_sb.sb_dirty) {
+		sfs->sfs_sb.sb_dirty = 0;
+		result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
+					sizeof(sfs->sfs_sb));
+		if (result) {
+			sfs->sfs_sb.sb_dirty = 1;
+			return result;
+		}
+	}
+
+	/* Drop our blocks from the buffer cache */
+	sfs_bdetach(sfs);
+
 	/* The vfs layer takes care of the device for us */
 	sfs->sfs_device = NULL;
 
@@ -247,7 +315,6 @@ sfs_unmount(struct fs *fs)
 	sfs_fs_destroy(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -296,22 +363,42 @@ sfs_fs_create(void)
 	/* superblock */
 	/* (ignore sfs_super, we'll read in over it shortly) */
 	sfs->sfs_superdirty = false;
+	sfs->sfs_sblock = lock_create("sfs_sblock");
+	if (sfs->sfs_sblock == NULL) {
+		goto cleanup_object;
+	}
 
 	/* device we mount on */
 	sfs->sfs_device = NULL;
 
 	/* vnode table */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
-		goto cleanup_object;
+	bzero(sfs->sfs_vnodes, sizeof(sfs->sfs_vnodes));
+	sfs->sfs_nvnodes = 0;
+	sfs->sfs_vnlock = lock_create("sfs_vnlock");
+	if (sfs->sfs_vnlock == NULL) {
+		goto cleanup_sblock;
+	}
+	sfs->sfs_vncv = cv_create("sfs_vncv");
+	if (sfs->sfs_vncv == NULL) {
+		goto cleanup_vnlock;
 	}
 
 	/* freemap */
 	sfs->sfs_freemap = NULL;
 	sfs->sfs_freemapdirty = false;
+	sfs->sfs_freemaplock = lock_create("sfs_freemaplock");
+	if (sfs->sfs_freemaplock == NULL) {
+		goto cleanup_vncv;
+	}
 
 	return sfs;
 
+cleanup_vncv:
+	cv_destroy(sfs->sfs_vncv);
+cleanup_vnlock:
+	lock_destroy(sfs->sfs_vnlock);
+cleanup_sblock:
+	lock_destroy(sfs->sfs_sblock);
 cleanup_object:
 	kfree(sfs);
 fail:
@@ -396,6 +483,21 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Ensure null termination of the volume name */
 	sfs->sfs_sb.sb_volname[sizeof(sfs->sfs_sb.sb_volname)-1] = 0;
 
+	/*
+	 * If the volume wasn't unmounted, directory indexes may not
+	 * match their entries: start a new generation (see <kern/sfs.h>).
+	 * sb_dirty, and with it the new generation, is written before
+	 * anything else is.
+	 */
+	if (sfs->sfs_sb.sb_dirty) {
+		sfs->sfs_sb.sb_dhgen++;
+		if (sfs->sfs_sb.sb_dhgen == 0) {
+			/* 0 is what a never-stamped index has */
+			sfs->sfs_sb.sb_dhgen = 1;
+		}
+		sfs->sfs_sb.sb_dirty = 0;
+	}
+
 	/* Load free block bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_FREEMAPBITS(sfs));
 	if (sfs->sfs_freemap == NULL) {
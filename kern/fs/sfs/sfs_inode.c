@@ -35,31 +35,80 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
 
+/*
+ * Loaded vnodes are found through a hash table in the sfs_fs, keyed
+ * by inode number. sfs_vnhits counts lookups that found the vnode
+ * loaded already; sfs_vnloads counts those that read the inode in.
+ */
+static struct spinlock sfs_vnstatlock = SPINLOCK_INITIALIZER;
+static unsigned sfs_vnhits, sfs_vnloads;
+
+static
+unsigned
+sfs_vnhashfn(uint32_t ino)
+{
+	return ino & (SFS_VNHASH - 1);
+}
 
 /*
- * Write an on-disk inode structure back out to disk.
+ * Write an on-disk inode structure back out to its block. That is in
+ * the buffer cache, so it only reaches the disk on sfs_bsync (or when
+ * the buffer is reused).
  */
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	int result;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	sfs_bunreserve(sv);
+
 	if (sv->sv_dirty) {
-		result = sfs_writeblock(sfs, sv->sv_ino, &sv->sv_i,
-					sizeof(sv->sv_i));
+		result = sfs_bget(sfs, sv->sv_ino, &buf);
 		if (result) {
 			return result;
 		}
+		memcpy(buf->b_data, &sv->sv_i, sizeof(sv->sv_i));
+		sfs_bdirty(buf);
+		sfs_brelse(buf);
 		sv->sv_dirty = false;
 	}
 	return 0;
 }
 
+/*
+ * Take SV out of the table and wake anyone waiting for it. Called with
+ * sfs_vnlock held, with SV busy.
+ */
+static
+void
+sfs_vnunhash(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **svp;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+	KASSERT(sv->sv_busy);
+
+	for (svp = &sfs->sfs_vnodes[sfs_vnhashfn(sv->sv_ino)];
+	     *svp != sv; svp = &(*svp)->sv_hashnext) {
+		if (*svp == NULL) {
+			panic("sfs: vnode %u not in vnode pool\n",
+			      sv->sv_ino);
+		}
+	}
+	*svp = sv->sv_hashnext;
+	sfs->sfs_nvnodes--;
+	cv_broadcast(sfs->sfs_vncv, sfs->sfs_vnlock);
+}
+
 /*
  * Called when the vnode refcount (in-memory usage count) hits zero.
  *
@@ -70,16 +119,15 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it. sfs_loadvnode only hands out
+	 * references while holding sfs_vnlock, so once we have it and
+	 * the count is 1, nobody else can get at the vnode.
 	 */
+	lock_acquire(sfs->sfs_vnlock);
 	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
 
@@ -88,26 +136,39 @@ sfs_reclaim(struct vnode *v)
 		v->vn_refcount--;
 
 		spinlock_release(&v->vn_countlock);
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
 	spinlock_release(&v->vn_countlock);
 
+	/*
+	 * Mark it busy, so it stays in the table (and a new
+	 * sfs_loadvnode waits rather than reading a stale copy of the
+	 * inode) while we sync it without holding sfs_vnlock.
+	 */
+	KASSERT(!sv->sv_busy);
+	sv->sv_busy = true;
+	lock_release(sfs->sfs_vnlock);
+
+	lock_acquire(sv->sv_lock);
+
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount == 0) {
+		sfs_dir_dropindex(sv);
 		result = sfs_itrunc(sv, 0);
 		if (result) {
-			vfs_biglock_release();
-			return result;
+			lock_release(sv->sv_lock);
+			goto fail;
 		}
 	}
 
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
-		return result;
+		lock_release(sv->sv_lock);
+		goto fail;
 	}
+	lock_release(sv->sv_lock);
 
 	/* If there are no on-disk references, discard the inode */
 	if (sv->sv_i.sfi_linkcount==0) {
@@ -115,68 +176,78 @@ sfs_reclaim(struct vnode *v)
 	}
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	lock_acquire(sfs->sfs_vnlock);
+	sfs_vnunhash(sfs, sv);
+	lock_release(sfs->sfs_vnlock);
 
 	vnode_cleanup(&sv->sv_absvn);
-
-	vfs_biglock_release();
+	lock_destroy(sv->sv_lock);
 
 	/* Release the storage for the vnode structure itself. */
 	kfree(sv);
 
 	/* Done */
 	return 0;
+
+fail:
+	lock_acquire(sfs->sfs_vnlock);
+	sv->sv_busy = false;
+	cv_broadcast(sfs->sfs_vncv, sfs->sfs_vnlock);
+	lock_release(sfs->sfs_vnlock);
+	return result;
 }
 
 /*
  * Function to load a inode into memory as a vnode, or dig up one
  * that's already resident.
+ *
+ * A vnode being loaded goes in the table right away, marked busy, so
+ * that the inode can be read without holding sfs_vnlock; other
+ * lookups of the same inode wait for it to be ready (or go away, if
+ * loading fails), and lookups of other inodes aren't held up.
  */
 int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
+	struct sfs_buf *buf;
 	const struct vnode_ops *ops;
-	unsigned i, num;
+	unsigned h;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	h = sfs_vnhashfn(ino);
 
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: Found inode %u in unallocated block\n",
-			      sv->sv_ino);
-		}
+	lock_acquire(sfs->sfs_vnlock);
 
+	/* Look in the vnodes table */
+again:
+	for (sv = sfs->sfs_vnodes[h]; sv != NULL; sv = sv->sv_hashnext) {
 		if (sv->sv_ino==ino) {
 			/* Found */
 
+			if (sv->sv_busy) {
+				/* Wait until loaded, or reclaimed */
+				cv_wait(sfs->sfs_vncv, sfs->sfs_vnlock);
+				goto again;
+			}
+
+			/* Every inode in memory must be in an allocated block */
+			if (!sfs_bused(sfs, sv->sv_ino)) {
+				panic("sfs: Found inode %u in unallocated "
+				      "block\n", sv->sv_ino);
+			}
+
 			/* forcetype is only allowed when creating objects */
 			KASSERT(forcetype==SFS_TYPE_INVAL);
 
 			VOP_INCREF(&sv->sv_absvn);
+			lock_release(sfs->sfs_vnlock);
+
+			spinlock_acquire(&sfs_vnstatlock);
+			sfs_vnhits++;
+			spinlock_release(&sfs_vnstatlock);
+
 			*ret = sv;
 			return 0;
 		}
@@ -186,6 +257,13 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+	sv->sv_lock = lock_create("sfs_vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -195,15 +273,28 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		      ino);
 	}
 
+	/* Hold its place in the table while we read it in */
+	sv->sv_ino = ino;
+	sv->sv_busy = true;
+	sv->sv_hashnext = sfs->sfs_vnodes[h];
+	sfs->sfs_vnodes[h] = sv;
+	sfs->sfs_nvnodes++;
+	lock_release(sfs->sfs_vnlock);
+
 	/* Read the block the inode is in */
-	result = sfs_readblock(sfs, ino, &sv->sv_i, sizeof(sv->sv_i));
+	result = sfs_bread(sfs, ino, &buf);
 	if (result) {
-		kfree(sv);
-		return result;
+		goto fail;
 	}
+	memcpy(&sv->sv_i, buf->b_data, sizeof(sv->sv_i));
+	sfs_brelse(buf);
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
+	sv->sv_resvcount = 0;
+	sv->sv_dirfree = 0;
+	sv->sv_dhbig = 0;
+	bzero(sv->sv_ipblock, sizeof(sv->sv_ipblock));
 
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
@@ -235,24 +326,30 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = vnode_init(&sv->sv_absvn, ops, &sfs->sfs_absfs, sv);
 	if (result) {
-		kfree(sv);
-		return result;
+		goto fail;
 	}
 
-	/* Set the other fields in our vnode structure */
-	sv->sv_ino = ino;
+	/* Ready; let anyone waiting for it have it */
+	lock_acquire(sfs->sfs_vnlock);
+	sv->sv_busy = false;
+	cv_broadcast(sfs->sfs_vncv, sfs->sfs_vnlock);
+	lock_release(sfs->sfs_vnlock);
 
-	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_absvn, NULL);
-	if (result) {
-		vnode_cleanup(&sv->sv_absvn);
-		kfree(sv);
-		return result;
-	}
+	spinlock_acquire(&sfs_vnstatlock);
+	sfs_vnloads++;
+	spinlock_release(&sfs_vnstatlock);
 
 	/* Hand it back */
 	*ret = sv;
 	return 0;
+
+fail:
+	lock_acquire(sfs->sfs_vnlock);
+	sfs_vnunhash(sfs, sv);
+	lock_release(sfs->sfs_vnlock);
+	lock_destroy(sv->sv_lock);
+	kfree(sv);
+	return result;
 }
 
 /*
@@ -269,7 +366,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, 0, &ino);
 	if (result) {
 		return result;
 	}
@@ -285,6 +382,23 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	return result;
 }
 
+/*
+ * Print the inode table statistics.
+ */
+void
+sfs_printstats(void)
+{
+	unsigned hits, loads;
+
+	spinlock_acquire(&sfs_vnstatlock);
+	hits = sfs_vnhits;
+	loads = sfs_vnloads;
+	spinlock_release(&sfs_vnstatlock);
+
+	kprintf("sfs: inode lookups: %u found loaded, %u read from disk\n",
+		hits, loads);
+}
+
 /*
  * Get vnode for the root of the filesystem.
  * The root vnode is always found in block 1 (SFS_ROOTDIR_INO).
@@ -296,24 +410,19 @@ sfs_getroot(struct fs *fs, struct vnode **ret)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOTDIR_INO, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		kprintf("sfs: getroot: Cannot load root vnode\n");
-		vfs_biglock_release();
 		return result;
 	}
 
+	/* The type never changes, so no need to lock */
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
 		kprintf("sfs: getroot: not directory (type %u)\n",
 		      sv->sv_i.sfi_type);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 
-	vfs_biglock_release();
-
 	*ret = &sv->sv_absvn;
 	return 0;
 }
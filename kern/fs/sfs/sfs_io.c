@@ -36,6 +36,7 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
@@ -62,8 +63,6 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n",
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
@@ -113,6 +112,29 @@ sfs_readblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 	return sfs_rwblock(sfs, &ku);
 }
 
+/*
+ * Before the first write of a mount, set sb_dirty on disk, so that
+ * a crash from then on shows at the next mount (see <kern/sfs.h>).
+ */
+static
+int
+sfs_markdirty(struct sfs_fs *sfs)
+{
+	int result = 0;
+
+	lock_acquire(sfs->sfs_sblock);
+	if (!sfs->sfs_sb.sb_dirty) {
+		sfs->sfs_sb.sb_dirty = 1;
+		result = sfs_writeblock(sfs, SFS_SUPER_BLOCK, &sfs->sfs_sb,
+					sizeof(sfs->sfs_sb));
+		if (result) {
+			sfs->sfs_sb.sb_dirty = 0;
+		}
+	}
+	lock_release(sfs->sfs_sblock);
+	return result;
+}
+
 /*
  * Write a block.
  */
@@ -121,9 +143,17 @@ sfs_writeblock(struct sfs_fs *sfs, daddr_t block, void *data, size_t len)
 {
 	struct iovec iov;
 	struct uio ku;
+	int result;
 
 	KASSERT(len == SFS_BLOCKSIZE);
 
+	if (block != SFS_SUPER_BLOCK) {
+		result = sfs_markdirty(sfs);
+		if (result) {
+			return result;
+		}
+	}
+
 	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
 	return sfs_rwblock(sfs, &ku);
 }
@@ -147,16 +177,8 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -165,9 +187,7 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	bool doalloc = (uio->uio_rw==UIO_WRITE);
 
 	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/* Compute the block offset of this block in the file */
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
@@ -181,40 +201,31 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_readblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block from the buffer cache.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = sfs_bread(sfs, diskblock, &buf);
 	if (result) {
 		return result;
 	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
+	 * If it was a write, the block gets written back later; even
+	 * a failed uiomove may have changed part of it.
 	 */
+	result = uiomove((char *)buf->b_data + skipstart, len, uio);
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_writeblock(sfs, diskblock, iobuf, sizeof(iobuf));
-		if (result) {
-			return result;
-		}
+		sfs_bdirty(buf);
 	}
+	sfs_brelse(buf);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -225,6 +236,7 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_absvn.vn_fs->fs_data;
+	struct sfs_buf *buf;
 	daddr_t diskblock;
 	uint32_t fileblock;
 	int result;
@@ -254,6 +266,45 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		return uiomovezeros(SFS_BLOCKSIZE, uio);
 	}
 
+	/*
+	 * If the block is in the buffer cache, use it there: the copy
+	 * on disk may be stale, and writing to the disk would leave the
+	 * cached copy stale.
+	 */
+	buf = sfs_bpeek(sfs, diskblock);
+	if (buf != NULL) {
+		result = uiomove(buf->b_data, SFS_BLOCKSIZE, uio);
+		if (uio->uio_rw == UIO_WRITE) {
+			sfs_bdirty(buf);
+		}
+		sfs_brelse(buf);
+		return result;
+	}
+
+	/*
+	 * Otherwise writes go into the cache too, to be written back
+	 * later by sfs_bsync. If the copy fails partway, the buffer
+	 * holds neither the old block nor the new one, so throw it
+	 * away.
+	 */
+	if (uio->uio_rw == UIO_WRITE) {
+		result = sfs_bget(sfs, diskblock, &buf);
+		if (result) {
+			return result;
+		}
+		result = uiomove(buf->b_data, SFS_BLOCKSIZE, uio);
+		if (result) {
+			buf->b_valid = false;
+		}
+		else {
+			sfs_bdirty(buf);
+		}
+		sfs_brelse(buf);
+		return result;
+	}
+
+	/* Whole blocks that are read bypass the cache */
+
 	/*
 	 * Do the I/O directly to the uio region. Save the uio_offset,
 	 * and substitute one that makes sense to the device.
@@ -293,6 +344,8 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	int result = 0;
 	uint32_t origresid, extraresid = 0;
 
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	origresid = uio->uio_resid;
 
 	/*
@@ -408,20 +461,11 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 	uint32_t vnblock;
 	uint32_t blockoffset;
 	daddr_t diskblock;
+	struct sfs_buf *buf;
 	bool doalloc;
 	int result;
 
-	/*
-	 * I/O buffer for metadata ops.
-	 *
-	 * Note: in real life (and when you've done the fs assignment) you
-	 * would get space from the disk buffer cache for this, not use a
-	 * static area.
-	 */
-	static char metaiobuf[SFS_BLOCKSIZE];
-
-	/* We're using a global static buffer; it had better be locked */
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/* Figure out which block of the vnode (directory, whatever) this is */
 	vnblock = actualpos / SFS_BLOCKSIZE;
@@ -443,26 +487,22 @@ sfs_metaio(struct sfs_vnode *sv, off_t actualpos, void *data, size_t len,
 		return 0;
 	}
 
-	/* Read the block */
-	result = sfs_readblock(sfs, diskblock, metaiobuf, sizeof(metaiobuf));
+	/* Get the block */
+	result = sfs_bread(sfs, diskblock, &buf);
 	if (result) {
 		return result;
 	}
 
 	if (rw == UIO_READ) {
 		/* Copy out the selected region */
-		memcpy(data, metaiobuf + blockoffset, len);
+		memcpy(data, (char *)buf->b_data + blockoffset, len);
+		sfs_brelse(buf);
 	}
 	else {
-		/* Update the selected region */
-		memcpy(metaiobuf + blockoffset, data, len);
-
-		/* Write the block back */
-		result = sfs_writeblock(sfs, diskblock,
-					metaiobuf, sizeof(metaiobuf));
-		if (result) {
-			return result;
-		}
+		/* Update the selected region; it is written back later */
+		memcpy((char *)buf->b_data + blockoffset, data, len);
+		sfs_bdirty(buf);
+		sfs_brelse(buf);
 
 		/* Update the vnode size if needed */
 		endpos = actualpos + len;
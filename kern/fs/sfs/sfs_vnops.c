@@ -38,9 +38,20 @@
 #include <stat.h>
 #include <lib.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
+#include "opt-dumbvm.h"
+
+#if OPT_DUMBVM
+/* No mmap, so nothing to be coherent with */
+#define vmobject_flush(vn, pos, len) 0
+#define vmobject_update(vn, pos, data, len) false
+#define vmobject_truncate(vn, len) ((void)0)
+#else
+#include <vmobject.h>
+#endif
 
 ////////////////////////////////////////////////////////////
 // Vnode operations.
@@ -90,6 +101,43 @@ sfs_eachopendir(struct vnode *v, int openflags)
 	return 0;
 }
 
+/*
+ * Reads and writes into user memory go through a kernel buffer this
+ * big, so that sv_lock is never held while copying to or from the
+ * user. A user buffer can be an mmap of this same file (or of another
+ * SFS file); touching it can fault, and filling or writing back a page
+ * of a mapped file goes through VOP_READ/VOP_WRITE and needs sv_lock
+ * in turn. Kernel buffers, which is what the page cache itself uses,
+ * cannot fault and are done directly.
+ *
+ * The same user transfers are kept coherent with the page cache of a
+ * mapped file (see vmobject_flush and vmobject_update); the page
+ * cache's own I/O of course is not.
+ */
+#define SFS_BOUNCESIZE (8 * SFS_BLOCKSIZE)
+
+/*
+ * Do one chunk of a read or write through the bounce buffer BUF.
+ * Returns in *DONE how many bytes were transferred; for a read that
+ * can be less than LEN at EOF.
+ */
+static
+int
+sfs_bounceio(struct sfs_vnode *sv, void *buf, size_t len, off_t pos,
+	     enum uio_rw rw, size_t *done)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	uio_kinit(&iov, &ku, buf, len, pos, rw);
+	lock_acquire(sv->sv_lock);
+	result = sfs_io(sv, &ku);
+	lock_release(sv->sv_lock);
+	*done = len - ku.uio_resid;
+	return result;
+}
+
 /*
  * Called for read(). sfs_io() does the work.
  */
@@ -98,33 +146,105 @@ int
 sfs_read(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	char *buf;
+	size_t len, got;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
-	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	if (uio->uio_segflg == UIO_SYSSPACE) {
+		lock_acquire(sv->sv_lock);
+		result = sfs_io(sv, uio);
+		lock_release(sv->sv_lock);
+		return result;
+	}
 
+	buf = kmalloc(SFS_BOUNCESIZE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	result = 0;
+	while (uio->uio_resid > 0) {
+		len = uio->uio_resid;
+		if (len > SFS_BOUNCESIZE) {
+			len = SFS_BOUNCESIZE;
+		}
+		result = vmobject_flush(v, uio->uio_offset, len);
+		if (result) {
+			break;
+		}
+		result = sfs_bounceio(sv, buf, len, uio->uio_offset,
+				      UIO_READ, &got);
+		if (result || got == 0) {
+			break;
+		}
+		result = uiomove(buf, got, uio);
+		if (result || got < len) {
+			break;
+		}
+	}
+
+	kfree(buf);
 	return result;
 }
 
 /*
  * Called for write(). sfs_io() does the work.
+ *
+ * A write bigger than SFS_BOUNCESIZE is done a chunk at a time, so it
+ * is no longer atomic with respect to other writers of the same file.
  */
 static
 int
 sfs_write(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	char *buf;
+	size_t len, done;
+	off_t pos;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
-	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	if (uio->uio_segflg == UIO_SYSSPACE) {
+		lock_acquire(sv->sv_lock);
+		result = sfs_io(sv, uio);
+		lock_release(sv->sv_lock);
+		return result;
+	}
+
+	buf = kmalloc(SFS_BOUNCESIZE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+
+	result = 0;
+	while (uio->uio_resid > 0) {
+		len = uio->uio_resid;
+		if (len > SFS_BOUNCESIZE) {
+			len = SFS_BOUNCESIZE;
+		}
+		pos = uio->uio_offset;
+		result = uiomove(buf, len, uio);
+		if (result) {
+			break;
+		}
+		do {
+			/* sfs_io writes all of it or fails */
+			result = sfs_bounceio(sv, buf, len, pos, UIO_WRITE,
+					      &done);
+			if (result) {
+				break;
+			}
+			KASSERT(done == len);
+		} while (vmobject_update(v, pos, buf, len));
+		if (result) {
+			break;
+		}
+	}
 
+	kfree(buf);
 	return result;
 }
 
@@ -164,8 +284,10 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
 	statbuf->st_nlink = sv->sv_i.sfi_linkcount;
+	lock_release(sv->sv_lock);
 
 	/* We don't support this yet */
 	statbuf->st_blocks = 0;
@@ -184,16 +306,13 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* The type never changes, so no need to lock */
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -223,34 +342,92 @@ sfs_fsync(struct vnode *v)
 	struct sfs_vnode *sv = v->vn_data;
 	int result;
 
-	vfs_biglock_acquire();
+	/*
+	 * The buffer cache doesn't know which blocks belong to which
+	 * file, so write back the whole volume's.
+	 */
+	lock_acquire(sv->sv_lock);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	if (result) {
+		return result;
+	}
 
-	return result;
+	return sfs_bsync(v->vn_fs->fs_data);
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Regular files can be mapped; the VM system reads
+ * and writes the pages through VOP_READ and VOP_WRITE.
  */
 static
 int
 sfs_mmap(struct vnode *v   /* add stuff as needed */)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 /*
- * Truncate a file.
+ * Truncate a file. Then cached pages of a mapped file past the new
+ * end must go too (after sv_lock is let go, as writing them back
+ * needs it).
  */
 static
 int
 sfs_truncate(struct vnode *v, off_t len)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	int result;
 
-	return sfs_itrunc(sv, len);
+	lock_acquire(sv->sv_lock);
+	result = sfs_itrunc(sv, len);
+	lock_release(sv->sv_lock);
+
+	if (result == 0) {
+		vmobject_truncate(v, len);
+	}
+	return result;
+}
+
+/*
+ * Called when the file seems to be being read in order. Start reading
+ * the blocks it's expected to want next into the buffer cache.
+ */
+static
+int
+sfs_readahead(struct vnode *v, off_t pos, off_t len)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	uint32_t fileblock, endblock;
+	daddr_t diskblock;
+	off_t end;
+
+	lock_acquire(sv->sv_lock);
+
+	end = pos + len;
+	if (end > (off_t)sv->sv_i.sfi_size) {
+		end = sv->sv_i.sfi_size;
+	}
+	if (pos >= end) {
+		lock_release(sv->sv_lock);
+		return 0;
+	}
+
+	endblock = DIVROUNDUP(end, SFS_BLOCKSIZE);
+	for (fileblock = pos / SFS_BLOCKSIZE; fileblock < endblock;
+	     fileblock++) {
+		if (sfs_bmap(sv, fileblock, false, &diskblock)) {
+			break;
+		}
+		if (diskblock != 0) {
+			sfs_bprefetch(sfs, diskblock);
+		}
+	}
+
+	lock_release(sv->sv_lock);
+	return 0;
 }
 
 /*
@@ -288,18 +465,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return EEXIST;
 	}
 
@@ -307,18 +484,18 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 		/* We got something; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
 			return result;
 		}
 		*ret = &newguy->sv_absvn;
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return 0;
 	}
 
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -329,19 +506,21 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
 		VOP_DECREF(&newguy->sv_absvn);
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	lock_release(newguy->sv_lock);
 
 	*ret = &newguy->sv_absvn;
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -360,26 +539,28 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Hard links to directories aren't allowed. */
 	if (f->sv_i.sfi_type == SFS_TYPE_DIR) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return EINVAL;
 	}
 
 	/* Create the link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* and update the link count, marking the inode dirty */
+	lock_acquire(f->sv_lock);
 	f->sv_i.sfi_linkcount++;
 	f->sv_dirty = true;
+	lock_release(f->sv_lock);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -395,12 +576,12 @@ sfs_remove(struct vnode *dir, const char *name)
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -408,15 +589,17 @@ sfs_remove(struct vnode *dir, const char *name)
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		lock_acquire(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		lock_release(victim->sv_lock);
 	}
 
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_absvn);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return result;
 }
 
@@ -436,7 +619,7 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOTDIR_INO);
@@ -444,7 +627,7 @@ sfs_rename(struct vnode *d1, const char *n1,
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -465,8 +648,10 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 
 	/* Increment the link count, and mark inode dirty */
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount++;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
 
 	/* Unlink the old slot */
 	result = sfs_dir_unlink(sv, slot1);
@@ -478,14 +663,16 @@ sfs_rename(struct vnode *d1, const char *n1,
 	 * Decrement the link count again, and mark the inode dirty again,
 	 * in case it's been synced behind our back.
 	 */
+	lock_acquire(g1->sv_lock);
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
+	lock_release(g1->sv_lock);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 
  puke_harder:
@@ -499,11 +686,13 @@ sfs_rename(struct vnode *d1, const char *n1,
 			strerror(result2));
 		panic("sfs: rename: Cannot recover\n");
 	}
+	lock_acquire(g1->sv_lock);
 	g1->sv_i.sfi_linkcount--;
+	lock_release(g1->sv_lock);
  puke:
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_absvn);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return result;
 }
 
@@ -521,15 +710,15 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -537,7 +726,7 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_absvn);
 	*ret = &sv->sv_absvn;
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -555,22 +744,22 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return ENOTDIR;
 	}
 
 	result = sfs_lookonce(sv, path, &final, NULL);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	*ret = &final->sv_absvn;
 
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 	return 0;
 }
 
@@ -598,6 +787,7 @@ const struct vnode_ops sfs_fileops = {
 	.vop_mmap = sfs_mmap,
 	.vop_truncate = sfs_truncate,
 	.vop_namefile = vopfail_uio_notdir,
+	.vop_readahead = sfs_readahead,
 
 	.vop_creat = vopfail_creat_notdir,
 	.vop_symlink = vopfail_symlink_notdir,
@@ -632,6 +822,7 @@ const struct vnode_ops sfs_dirops = {
 	.vop_mmap = vopfail_mmap_isdir,
 	.vop_truncate = vopfail_truncate_isdir,
 	.vop_namefile = sfs_namefile,
+	.vop_readahead = vopnull_readahead,
 
 	.vop_creat = sfs_creat,
 	.vop_symlink = vopfail_symlink_nosys,
@@ -31,6 +31,10 @@
 #define _SFSPRIVATE_H_
 
 #include <uio.h> /* for uio_rw */
+#include <device.h> /* for struct devreq */
+
+struct lock;
+struct wchan;
 
 
 /* ops tables (in sfs_vnops.c) */
@@ -42,11 +46,67 @@ extern const struct vnode_ops sfs_dirops;
     uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
 
 
+/*
+ * A buffer in the block cache (see sfs_buf.c). The data may only be
+ * used between getting the buffer and sfs_brelse, while b_lock is
+ * held. While b_busy is set the block is being read ahead into it
+ * and even the holder of b_lock must wait on b_wchan.
+ */
+struct sfs_buf {
+	void *b_data;                   /* SFS_BLOCKSIZE bytes */
+	struct sfs_fs *b_fs;            /* volume, or NULL if unused */
+	daddr_t b_block;                /* block number on b_fs */
+	struct lock *b_lock;            /* protects the rest */
+	bool b_valid;                   /* b_data holds the block */
+	bool b_dirty;                   /* b_data needs writing back */
+	unsigned b_refcount;            /* references (by sfs_buflock) */
+	bool b_busy;                    /* async I/O in progress (ditto) */
+	struct wchan *b_wchan;          /* for b_busy */
+	struct devreq b_req;            /* for async I/O */
+	struct sfs_buf *b_hashnext;     /* hash chain */
+	struct sfs_buf *b_lrunext;      /* LRU list, if unreferenced */
+	struct sfs_buf *b_lruprev;
+	struct sfs_buf *b_allnext;      /* list of all buffers */
+};
+
 /* Functions in sfs_balloc.c */
-int sfs_balloc(struct sfs_fs *sfs, daddr_t *diskblock);
+int sfs_balloc(struct sfs_fs *sfs, daddr_t goal, daddr_t *diskblock);
+int sfs_balloc_file(struct sfs_vnode *sv, daddr_t goal, daddr_t *diskblock);
+void sfs_bunreserve(struct sfs_vnode *sv);
 void sfs_bfree(struct sfs_fs *sfs, daddr_t diskblock);
 int sfs_bused(struct sfs_fs *sfs, daddr_t diskblock);
 
+/*
+ * Functions in sfs_buf.c:
+ *
+ *    sfs_bread   - get the buffer for BLOCK, referenced and locked,
+ *                  reading it in if it isn't cached.
+ *    sfs_bget    - the same, but for a block that is about to be
+ *                  overwritten entirely: it is zeroed instead of read
+ *                  if it isn't cached.
+ *    sfs_bpeek   - the same, but only if the block is cached; returns
+ *                  NULL otherwise.
+ *    sfs_bprefetch - start reading BLOCK into the cache, if it isn't
+ *                  there already, without waiting. Does nothing if
+ *                  that can't be done without waiting.
+ *    sfs_bdirty  - mark a buffer as needing to be written back.
+ *    sfs_brelse  - unlock a buffer and drop the reference.
+ *    sfs_binval  - forget a block (which is being freed) and discard
+ *                  any changes to it.
+ *    sfs_bsync   - write back every dirty buffer of a volume, in
+ *                  block order.
+ *    sfs_bdetach - forget every block of a volume being unmounted.
+ */
+int sfs_bread(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret);
+int sfs_bget(struct sfs_fs *sfs, daddr_t block, struct sfs_buf **ret);
+struct sfs_buf *sfs_bpeek(struct sfs_fs *sfs, daddr_t block);
+void sfs_bprefetch(struct sfs_fs *sfs, daddr_t block);
+void sfs_bdirty(struct sfs_buf *buf);
+void sfs_brelse(struct sfs_buf *buf);
+void sfs_binval(struct sfs_fs *sfs, daddr_t block);
+int sfs_bsync(struct sfs_fs *sfs);
+void sfs_bdetach(struct sfs_fs *sfs);
+
 /* Functions in sfs_bmap.c */
 int sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, bool doalloc,
 		daddr_t *diskblock);
@@ -58,6 +118,7 @@ int sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 int sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino,
 		int *slot);
 int sfs_dir_unlink(struct sfs_vnode *sv, int slot);
+void sfs_dir_dropindex(struct sfs_vnode *sv);
 int sfs_lookonce(struct sfs_vnode *sv, const char *name,
 		struct sfs_vnode **ret,
 		int *slot);
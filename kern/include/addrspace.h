@@ -35,21 +35,43 @@
  */
 
 
+#include <array.h>
 #include <vm.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct pagetable;
+struct vmobject;
 
 
-/* Page table entry */
-struct pagetable_entry {
-        vaddr_t vaddr;
-        paddr_t paddr;
-        uint32_t t_perm;
-        uint32_t p_perm;
-        uint32_t chunksize;
+#if !OPT_DUMBVM
+/*
+ * A region of the user address space: one per ELF segment, plus the
+ * stack, plus one per mmap. Defining a region does not allocate any
+ * memory; each page is backed by a physical frame only when it is
+ * first touched (see vm_fault). The first rg_filesz bytes of a file
+ * mapping come from the file's page cache (see vmobject.h); all other
+ * pages start out zeroed.
+ */
+struct region {
+        vaddr_t rg_vbase;               /* page-aligned start address */
+        size_t rg_npages;               /* length in pages */
+        int rg_perm;                    /* VM_R | VM_W | VM_X */
+        struct vmobject *rg_obj;        /* file mapped, or NULL */
+        off_t rg_offset;                /* file offset of rg_vbase */
+        size_t rg_filesz;               /* bytes backed by the file */
+        bool rg_shared;                 /* MAP_SHARED (else private) */
+        bool rg_mmap;                   /* made by mmap (may munmap) */
 };
 
+#ifndef ADDRSPACEINLINE
+#define ADDRSPACEINLINE INLINE
+#endif
+
+DECLARRAY(region, ADDRSPACEINLINE);
+DEFARRAY(region, ADDRSPACEINLINE);
+#endif
+
 
 /*
  * Address space - data structure associated with the virtual memory
@@ -68,11 +90,11 @@ struct addrspace {
         size_t as_npages2;
         paddr_t as_stackpbase;
 #else
-        /* Put stuff here for your VM system */
-        paddr_t as_stackpbase;
-        struct pagetable_entry *page_table;
-        size_t nsegs;
-        
+        struct regionarray as_regions;  /* segments and stack */
+        struct region as_heap;          /* sbrk heap, just past the data */
+        vaddr_t as_heapend;             /* current break */
+        struct pagetable *as_pt;        /* per-page translations */
+        bool as_loading;                /* between prepare/complete_load */
 #endif
 };
 
@@ -103,6 +125,12 @@ struct addrspace {
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
+ *    as_define_filesegment - like as_define_region, but the first
+ *                FILESZ bytes at VADDR are paged in from VN, starting
+ *                at file offset OFFSET, as they are touched. VADDR and
+ *                OFFSET must be at the same offset within a page.
+ *                Pages are shared with other processes until written.
+ *
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
@@ -128,10 +156,56 @@ int               as_define_region(struct addrspace *as,
                                    int readable,
                                    int writeable,
                                    int executable);
+int               as_define_filesegment(struct addrspace *as,
+                                        vaddr_t vaddr, size_t memsz,
+                                        struct vnode *vn, off_t offset,
+                                        size_t filesz,
+                                        int readable,
+                                        int writeable,
+                                        int executable);
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
-int               as_init_pagetable(struct addrspace *as, uint32_t nsegs);
+
+
+#if !OPT_DUMBVM
+/*
+ *    as_findregion - return the region containing VADDR, or NULL if
+ *                the address is not part of the address space.
+ */
+struct region    *as_findregion(struct addrspace *as, vaddr_t vaddr);
+
+/*
+ *    as_sbrk   - move the heap's break by AMOUNT bytes (which may be
+ *                negative) and hand back the old break. Growing only
+ *                extends the heap region; pages are zero-filled on
+ *                first touch. Shrinking releases the pages given up.
+ */
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+
+/*
+ *    as_mmap   - map NPAGES pages of the file cached in OBJ, from file
+ *                offset OFFSET (page-aligned), somewhere free between
+ *                the heap and the stack. Consumes the caller's
+ *                reference to OBJ on success. Hands back the address.
+ *
+ *    as_munmap - remove any mmap mappings in the NPAGES pages at VADDR,
+ *                writing back dirty pages of shared mappings. Fails
+ *                if the range includes something that wasn't mmapped.
+ *
+ *    as_msync  - write back the dirty pages of the shared mappings in
+ *                the NPAGES pages at VADDR. Fails with ENOMEM if part
+ *                of the range is not mapped.
+ */
+int               as_mmap(struct addrspace *as, size_t npages, int perm,
+                          struct vmobject *obj, off_t offset, bool shared,
+                          vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr,
+                            size_t npages);
+int               as_msync(struct addrspace *as, vaddr_t vaddr,
+                           size_t npages);
+#endif
 
 
 /*
@@ -1,24 +1,44 @@
 #ifndef _COREMAP_H_
 #define _COREMAP_H_
 
+struct pagetable;
+struct vmobject;
+
 /* Coremap related data structures */
 enum coremap_state {
-        FREE,
+        FREE,           /* Free, contents undefined (in the buddy lists) */
+        ZEROED,         /* Free and already zero-filled (in the zero pool) */
         ALLOCATED,
         FIXED
 };
 
+/* Number of buddy allocator block sizes (1 to 2^(COREMAP_NORDERS-1) frames) */
+#define COREMAP_NORDERS 12
+
 struct coremap_entry {
         enum coremap_state state;
         unsigned long chunksize;
+        unsigned refcount;     /* Number of page table entries sharing it */
+        int order;             /* Order of the free block starting here, or -1 */
+        int next, prev;        /* Free list links (frame numbers), or -1 */
+        struct pagetable *pt;  /* Page table mapping it, if it may be evicted */
+        vaddr_t vaddr;         /* User address it is mapped at (if pt) */
+        struct vmobject *obj;  /* Page cache holding it, or NULL */
+        unsigned objidx;       /* Its page number there (if obj) */
+        bool busy;             /* Being paged out */
+        bool referenced;       /* Used since the clock hand last went by */
 };
 
 uint32_t num_total_frames; /* Total number of physical frames */
 uint32_t num_free_frames;  /* Total number of free frames */
+uint32_t num_zeroed_frames; /* Free frames that are already zeroed */
 uint32_t first_index;      /* First free index */
 
 struct coremap_entry *coremap; /* Tracks the status of each physical frame */
 
+/* Protects the coremap (defined in vm.c) */
+extern struct spinlock coremap_lock;
+
 /* Coremap initialization function */
 void coremap_bootstrap(void);
 
@@ -28,4 +48,29 @@ paddr_t coremap_getpages(unsigned long npages);
 /* Frees pages using coremap */
 void coremap_freepages(vaddr_t vaddr);
 
+/* Takes a page from, or adds a page to, the pool of zeroed free pages */
+paddr_t coremap_getzeroedpage(void);
+void coremap_addzeroedpage(paddr_t paddr);
+
+/* Reference counting of shared (copy-on-write) frames */
+void coremap_incref(paddr_t paddr);
+unsigned coremap_decref(paddr_t paddr);
+unsigned coremap_refcount(paddr_t paddr);
+
+/*
+ * Page replacement. A user frame mapped by exactly one page table is
+ * registered with coremap_setowner and becomes a candidate for
+ * eviction; coremap_findvictim runs the clock over those, marks the
+ * one it picks busy and returns it (or 0 if there is nothing to
+ * evict). coremap_unbusy clears the busy mark again.
+ *
+ * A frame in a file's page cache is registered with coremap_setobj
+ * instead, and is a candidate whenever nothing but the cache refers
+ * to it. ANON and FILE say which kinds of frame findvictim may pick.
+ */
+void coremap_setowner(paddr_t paddr, struct pagetable *pt, vaddr_t vaddr);
+void coremap_setobj(paddr_t paddr, struct vmobject *obj, unsigned idx);
+paddr_t coremap_findvictim(bool anon, bool file);
+void coremap_unbusy(paddr_t paddr);
+
 #endif /* _COREMAP_H_ */
@@ -46,6 +46,11 @@
  * a pointer with a fixed address and a per-cpu mapping in the MMU.
  */
 
+/* Size of the per-cpu free page cache */
+#define CPU_PAGECACHE_MAX  32
+
+struct pagetable;
+
 struct cpu {
 	/*
 	 * Fixed after allocation.
@@ -62,6 +67,48 @@ struct cpu {
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
 
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * Cache of free single pages in front of the coremap (see vm.c).
+	 */
+	paddr_t c_pagecache[CPU_PAGECACHE_MAX];
+	unsigned c_pagecache_count;	/* Number of pages in the cache */
+	unsigned c_pagecache_hits;	/* Allocations served from the cache */
+	unsigned c_pagecache_misses;	/* Allocations that had to refill */
+	unsigned c_pagecache_frees;	/* Frees absorbed by the cache */
+	unsigned c_pagecache_drains;	/* Frees that had to drain it */
+	volatile unsigned c_pagecache_flushes; /* Emptied for another cpu */
+
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * TLB state (see vm.c). c_tlb_owner is the page table whose
+	 * translations are in the TLB; it is only compared, never
+	 * dereferenced, as it may since have been destroyed.
+	 */
+	const struct pagetable *c_tlb_owner;
+	unsigned c_tlb_next;		/* Slots below this may be in use */
+	unsigned c_tlb_refills;		/* Faults handled by the fast path */
+	unsigned c_tlb_faults;		/* Faults that took the slow path */
+	unsigned c_tlb_flushes;		/* Whole-TLB invalidations */
+	unsigned c_tlb_keeps;		/* Context switches that kept the TLB */
+
+	/*
+	 * Accessed only by this cpu.
+	 * Work stealing statistics (see thread_steal).
+	 */
+	unsigned c_steal_tries;		/* Looked for a thread to steal */
+	unsigned c_steal_busy;		/* Victim's runqueue lock was held */
+	unsigned c_steal_hot;		/* Only cache-hot threads to take */
+	unsigned c_steals;		/* Threads stolen */
+
+#if OPT_SPLKSTATS
+	/*
+	 * Accessed only by this cpu, with interrupts off.
+	 * Spinlock profile (see spinlock.c); read racily to print it.
+	 */
+	struct splkstat c_splkstats[SPLKSTAT_SITES + 1];
+#endif
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
@@ -69,6 +116,7 @@ struct cpu {
 	bool c_isidle;			/* True if this cpu is idle */
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
+	unsigned c_stolen;		/* Threads stolen from this cpu */
 
 	/*
 	 * Accessed by other cpus.
@@ -87,6 +135,8 @@ struct cpu {
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	unsigned c_shootdown_sent;	/* Shootdowns requested so far */
+	unsigned c_shootdown_done;	/* Shootdowns processed so far */
 	struct spinlock c_ipi_lock;
 };
 
@@ -110,6 +160,13 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Access to the list of all cpus, e.g. for collecting statistics.
+ * cpu_getcpu takes a software cpu number (c_number).
+ */
+unsigned cpu_numcpus(void);
+struct cpu *cpu_getcpu(unsigned num);
+
 /*
  * Produce a string describing the CPU type.
  */
@@ -153,6 +210,8 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * It returns a ticket that can be passed to ipi_tlbshootdown_wait
+ * to wait until the target has actually done the invalidation.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -163,10 +222,13 @@ void cpu_halt(void);
 #define IPI_OFFLINE		1	/* CPU is requested to go offline */
 #define IPI_UNIDLE		2	/* Runnable threads are available */
 #define IPI_TLBSHOOTDOWN	3	/* MMU mapping(s) need invalidation */
+#define IPI_PAGECACHE		4	/* Free pages are short; drain cache */
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
-void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown(struct cpu *target,
+			  const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket);
 
 void interprocessor_interrupt(void);
 
@@ -36,6 +36,7 @@
 
 
 struct uio;  /* in <uio.h> */
+struct devreq;
 
 /*
  * Filesystem-namespace-accessible device.
@@ -56,11 +57,14 @@ struct device {
  *      devop_eachopen - called on each open call to allow denying the open
  *      devop_io - for both reads and writes (the uio indicates the direction)
  *      devop_ioctl - miscellaneous control operations
+ *      devop_strategy - queue an asynchronous block transfer (see below);
+ *                       NULL if the device doesn't support it
  */
 struct device_ops {
 	int (*devop_eachopen)(struct device *, int flags_from_open);
 	int (*devop_io)(struct device *, struct uio *);
 	int (*devop_ioctl)(struct device *, int op, userptr_t data);
+	int (*devop_strategy)(struct device *, struct devreq *);
 };
 
 /*
@@ -69,6 +73,35 @@ struct device_ops {
 #define DEVOP_EACHOPEN(d, f)	((d)->d_ops->devop_eachopen(d, f))
 #define DEVOP_IO(d, u)		((d)->d_ops->devop_io(d, u))
 #define DEVOP_IOCTL(d, op, p)	((d)->d_ops->devop_ioctl(d, op, p))
+#define DEVOP_STRATEGY(d, r)	((d)->d_ops->devop_strategy(d, r))
+
+/*
+ * An asynchronous transfer of DR_NBLOCKS blocks starting at block
+ * DR_BLOCK, to or from the kernel buffer DR_DATA. The caller fills in
+ * the first six fields and hands it to DEVOP_STRATEGY, which fails
+ * only if the request is invalid. Otherwise DR_DONE is called when
+ * the transfer has finished, with the result, from the device's
+ * interrupt handler; it must not sleep. The request belongs to the
+ * driver until then.
+ *
+ * Requests may be reordered, so a caller must not have two requests
+ * for the same blocks outstanding at once if the order matters.
+ */
+struct devreq {
+	uint32_t dr_block;		/* first block */
+	uint32_t dr_nblocks;		/* number of blocks */
+	void *dr_data;			/* kernel buffer */
+	bool dr_write;			/* write, rather than read */
+	void (*dr_done)(struct devreq *, int result);
+	void *dr_arg;			/* for use by dr_done */
+
+	/* Owned by the driver */
+	struct devreq *dr_next;		/* queue link */
+	struct devreq *dr_merged;	/* contiguous requests merged in */
+	struct devreq *dr_last;		/* last of those */
+	uint32_t dr_runlen;		/* total blocks, with those */
+	int dr_result;			/* result, once done */
+};
 
 
 /* Create vnode for a vfs-level device. */
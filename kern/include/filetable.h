@@ -36,6 +36,7 @@
 
 #include <limits.h> /* for OPEN_MAX */
 
+struct rwlock;
 
 /*
  * The file table is an array of open files.
@@ -48,15 +49,15 @@
  * or even to make it dynamic with the limit being user-settable. (See
  * setrlimit(2) on a Unix machine.)
  *
- * Because we only have single-threaded processes, the file table is
- * never shared and so it doesn't require synchronization. On fork,
- * the table is copied. Another exercise: what would you need to do to
- * make this code safe for multithreaded processes? What happens if
- * one thread calls close() while another one is in the middle of e.g.
- * read() using the same file handle?
+ * On fork, the table is copied. The table is protected by ft_lock,
+ * which lookups take for reading and changes take for writing, so
+ * lookups do not serialize. A looked-up file carries its own
+ * reference until it is put back, so it stays valid if someone closes
+ * the file handle meanwhile.
  */
 struct filetable {
 	struct openfile *ft_openfiles[OPEN_MAX];
+	struct rwlock *ft_lock;
 };
 
 /*
@@ -68,7 +69,8 @@ struct filetable {
  * okfd -    Check if a file handle is in range.
  * get/put - Retrieve a fd for use and put it back when done. (Checks
  *           okfd and also fails on files not open; returned openfile
- *           is not NULL.) Call put with the file returned from get.
+ *           is not NULL, and holds a reference that put drops.) Call
+ *           put with the file returned from get.
  * place -   Insert a file and return the fd.
  * placeat - Insert a file at a specific slot and return the file
  *           previously there.
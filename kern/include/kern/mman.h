@@ -0,0 +1,23 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Constants for mmap(), munmap() and msync().
+ */
+
+/* Protections (mmap prot argument) */
+#define PROT_NONE       0x0     /* Pages may not be accessed */
+#define PROT_READ       0x1     /* Pages may be read */
+#define PROT_WRITE      0x2     /* Pages may be written */
+#define PROT_EXEC       0x4     /* Pages may be executed */
+
+/* Mapping types (mmap flags argument); exactly one must be given */
+#define MAP_SHARED      0x1     /* Changes go to the file, seen by all */
+#define MAP_PRIVATE     0x2     /* Changes are private copy-on-write */
+
+/* msync flags */
+#define MS_ASYNC        0x1     /* Schedule writes (same as MS_SYNC here) */
+#define MS_SYNC         0x2     /* Write back before returning */
+#define MS_INVALIDATE   0x4     /* Accepted and ignored */
+
+#endif /* _KERN_MMAN_H_ */
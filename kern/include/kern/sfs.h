@@ -41,9 +41,10 @@
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
 #define SFS_NINDIRECT     1             /* # of indirect blocks in inode */
-#define SFS_NDINDIRECT    0             /* # of 2x indirect blocks in inode */
-#define SFS_NTINDIRECT    0             /* # of 3x indirect blocks in inode */
+#define SFS_NDINDIRECT    1             /* # of 2x indirect blocks in inode */
+#define SFS_NTINDIRECT    1             /* # of 3x indirect blocks in inode */
 #define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
+#define SFS_NDIRHASH      32            /* # of dir index map blocks */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SUPER_BLOCK   0             /* block the superblock lives in */
 #define SFS_FREEMAP_START 2             /* 1st block of the freemap */
@@ -74,7 +75,9 @@ struct sfs_superblock {
 	uint32_t sb_magic;		/* Magic number; should be SFS_MAGIC */
 	uint32_t sb_nblocks;			/* Number of blocks in fs */
 	char sb_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];			/* unused, set to 0 */
+	uint32_t sb_dhgen;			/* Generation of dir indexes */
+	uint32_t sb_dirty;			/* In use; not unmounted */
+	uint32_t reserved[116];			/* unused, set to 0 */
 };
 
 /*
@@ -86,7 +89,14 @@ struct sfs_dinode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dirhash;			/* # of dir index buckets, or 0 */
+	uint32_t sfi_dhused;			/* # of buckets in use */
+	uint32_t sfi_dhdeleted;			/* # of deleted buckets */
+	uint32_t sfi_dirhashblocks[SFS_NDIRHASH]; /* Dir index maps */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_dhgen;			/* sb_dhgen when indexed */
+	uint32_t sfi_waste[128-9-SFS_NDIRECT-SFS_NDIRHASH]; /* unused, 0 */
 };
 
 /*
@@ -97,5 +107,57 @@ struct sfs_direntry {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/*
+ * Directory index.
+ *
+ * A directory whose sfi_dirhash is nonzero also has a hash table of
+ * its entries, with sfi_dirhash buckets (a power of 2), stored
+ * SFS_DHPERBLOCK to a block. The index blocks are listed, in order,
+ * SFS_DBPERIDB to a block in the map blocks listed in
+ * sfi_dirhashblocks, like the data blocks in an indirect block. A
+ * block number of 0, in either, stands for empty buckets. The entries
+ * themselves stay in the directory's ordinary slots, so a directory
+ * with an index can still be read as one without; but whatever changes
+ * the entries must update the index too, or clear sfi_dirhash and
+ * free the index and map blocks. The other index fields are then 0 as
+ * well, as they are for files.
+ *
+ * A crash can leave an index out of step with the entries. So sb_dirty
+ * is set on disk before a mount first writes to the volume, and
+ * cleared when it is unmounted; a mount that finds it set increments
+ * sb_dhgen. An index is stamped in sfi_dhgen with the sb_dhgen it was
+ * made under, and one with a different stamp is rebuilt before use.
+ * sfsck checks every index and clears sb_dirty. Something that doesn't
+ * know about the index (an older kernel, say) can change the entries
+ * and leave it wrong without setting sb_dirty; run sfsck afterwards.
+ *
+ * The table uses linear probing: a name whose hash is H is in the
+ * first bucket from H mod sfi_dirhash onwards that refers to it, and
+ * is not in the directory if an empty bucket comes first. Deleting an
+ * entry leaves its bucket marked deleted, so later names stay
+ * reachable. sfi_dhused counts the buckets that refer to an entry and
+ * sfi_dhdeleted the ones marked deleted.
+ *
+ * The hash is 32-bit FNV-1a over the bytes of the name: starting with
+ * SFS_DH_FNVBASIS, for each byte, XOR it in and multiply by
+ * SFS_DH_FNVPRIME.
+ */
+struct sfs_dirhashent {
+	uint32_t sdh_hash;			/* Hash of the name */
+	uint32_t sdh_slot;			/* Slot+1, or SFS_DH_* */
+};
+
+#define SFS_DH_EMPTY      0             /* sdh_slot of an empty bucket */
+#define SFS_DH_DELETED    0xffffffff    /* sdh_slot of a deleted bucket */
+#define SFS_DH_FNVBASIS   2166136261U   /* hash of the empty name */
+#define SFS_DH_FNVPRIME   16777619U     /* multiplier */
+
+/* Number of buckets in an index block */
+#define SFS_DHPERBLOCK    (SFS_BLOCKSIZE / sizeof(struct sfs_dirhashent))
+
+/* Smallest index made, and largest index possible */
+#define SFS_DIRHASH_MIN   128
+#define SFS_DIRHASH_MAX   (SFS_NDIRHASH * SFS_DBPERIDB * SFS_DHPERBLOCK)
+
 
 #endif /* _KERN_SFS_H_ */
@@ -47,6 +47,9 @@
  * Open files are reference-counted because they get shared via fork
  * and dup2 calls. And they need locking because that sharing can be
  * among multiple concurrent processes.
+ *
+ * We also remember where the last read ended, to spot files being
+ * read in order; see openfile_readahead.
  */
 struct openfile {
 	struct vnode *of_vnode;
@@ -55,6 +58,11 @@ struct openfile {
 	struct lock *of_offsetlock;	/* lock for of_offset */
 	off_t of_offset;
 
+	/* Also protected by of_offsetlock */
+	off_t of_nextread;		/* where the last read ended */
+	off_t of_raend;			/* end of what's been read ahead */
+	off_t of_rawindow;		/* last read-ahead size, or 0 */
+
 	struct spinlock of_reflock;	/* lock for of_refcount */
 	int of_refcount;
 };
@@ -63,6 +71,9 @@ struct openfile {
 int openfile_open(char *filename, int openflags, mode_t mode,
 		  struct openfile **ret);
 
+/* note a read of [POS, END) and read ahead if it looks sequential */
+void openfile_readahead(struct openfile *file, off_t pos, off_t end);
+
 /* adjust the refcount on an openfile */
 void openfile_incref(struct openfile *);
 void openfile_decref(struct openfile *);
@@ -0,0 +1,103 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Per-process two-level page table.
+ *
+ * A user virtual address is split into a 10-bit directory index, a
+ * 10-bit table index and the 12-bit page offset. The directory is
+ * allocated along with the page table; each second-level table is one
+ * page of PTEs and is only allocated when a page it covers is first
+ * touched, so a sparse address space stays cheap.
+ *
+ * A page that has been evicted keeps its swap slot number in the
+ * frame bits of its PTE, marked PTE_SWAPPED. While a page is on its
+ * way out to swap its PTE is marked PTE_BUSY instead of PTE_VALID,
+ * and anyone who wants it waits on pt_wchan.
+ *
+ * A PTE_SHARED entry maps a frame of a shared file mapping straight
+ * from the file's page cache (see vmobject.h). It is never
+ * copy-on-write; PTE_WRITE on it means this mapping has been written
+ * to, and is counted as one of the page's writers.
+ *
+ * Locking: the PTEs are protected by pt_lock, because the pageout
+ * code changes them from outside the owning process. The directory
+ * itself is only ever changed by the process that owns the page
+ * table. pt_lock is acquired before the coremap lock, never after.
+ * pt_cpu is also protected by pt_lock; see vm_tlbactivate.
+ */
+
+#include <spinlock.h>
+#include <vm.h>
+
+struct wchan;
+struct cpu;
+
+typedef uint32_t pte_t;
+
+/* Fields in a page table entry */
+#define PTE_FRAME   0xfffff000  /* physical frame (if PTE_VALID) */
+#define PTE_VALID   0x00000001  /* page is resident in memory */
+#define PTE_COW     0x00000002  /* frame is shared; copy before writing */
+#define PTE_SWAPPED 0x00000004  /* page is in the swap slot PTE_SLOT */
+#define PTE_BUSY    0x00000008  /* page is being written out to swap */
+#define PTE_WRITE   0x00000010  /* region allows writes (if PTE_VALID) */
+#define PTE_SHARED  0x00000020  /* frame is in a shared file mapping */
+
+/* Swap slot of a PTE_SWAPPED entry, and the reverse */
+#define PTE_SLOT(pte)     ((pte) >> 12)
+#define PTE_MKSLOT(slot)  ((pte_t)(slot) << 12)
+
+/* Splitting up a virtual address */
+#define PT_L1_SIZE      1024
+#define PT_L2_SIZE      1024
+#define PT_L1_INDEX(va) (((va) >> 22) & (PT_L1_SIZE - 1))
+#define PT_L2_INDEX(va) (((va) >> 12) & (PT_L2_SIZE - 1))
+
+struct pagetable {
+        pte_t *pt_dir[PT_L1_SIZE];      /* second-level tables, or NULL */
+        struct spinlock pt_lock;        /* protects the PTEs */
+        struct wchan *pt_wchan;         /* for PTE_BUSY entries */
+        struct cpu *pt_cpu;             /* cpu last activated on, or NULL */
+};
+
+/*
+ * Functions in pagetable.c:
+ *
+ *    pt_create  - allocate an empty page table. Returns NULL on
+ *                 out-of-memory.
+ *
+ *    pt_destroy - release every page, resident or swapped, and every
+ *                 table.
+ *
+ *    pt_lookup  - return a pointer to the PTE for VADDR. If the
+ *                 second-level table does not exist it is allocated
+ *                 when CREATE is true; otherwise (or if that
+ *                 allocation fails) NULL is returned.
+ *
+ *    pt_unmap   - release the NPAGES pages starting at VADDR, resident
+ *                 or swapped. The caller must flush them from the
+ *                 TLB.
+ *
+ *    pt_unwrite - take away write access to the shared file pages in
+ *                 the NPAGES pages starting at VADDR. The caller must
+ *                 flush them from the TLB.
+ *
+ *    pt_copy    - make NEW share every page of OLD copy-on-write;
+ *                 resident pages share the frame and swapped pages
+ *                 share the swap slot. Both sides' PTEs are marked PTE_COW,
+ *                 so the caller must flush OLD's writeable TLB
+ *                 entries. Shared file pages are simply mapped in both.
+ *                 On failure NEW may be partially filled in and should
+ *                 be destroyed by the caller.
+ */
+struct pagetable *pt_create(void);
+void              pt_destroy(struct pagetable *pt);
+pte_t            *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+void              pt_unmap(struct pagetable *pt, vaddr_t vaddr,
+                           size_t npages);
+void              pt_unwrite(struct pagetable *pt, vaddr_t vaddr,
+                             size_t npages);
+int               pt_copy(struct pagetable *old, struct pagetable *new);
+
+#endif /* _PAGETABLE_H_ */
@@ -69,6 +69,7 @@ struct proc {
         /* Child management */
         struct proclistnode p_listnode;        /* process as a proclist node */
         struct proclist p_child;               /* children list */
+        struct rwlock *p_childlock;            /* lock for p_child */
         struct cv *p_wait_cv;                  /* wait on this proc */
         struct lock *p_wait_lock;              /* lock for wait cv */
         int wait_count;                        /* no of proc waiting */
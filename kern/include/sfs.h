@@ -48,27 +48,64 @@
  */
 #include <kern/sfs.h>
 
+struct lock;
+
+/* Levels of indirect blocks */
+#define SFS_ILEVELS 3
+
 /*
  * In-memory inode
+ *
+ * sv_lock protects sv_i, sv_dirty, and the contents of the file or
+ * directory. sv_ino never changes.
  */
 struct sfs_vnode {
 	struct vnode sv_absvn;          /* abstract vnode structure */
 	struct sfs_dinode sv_i;		/* copy of on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	daddr_t sv_resvstart;           /* blocks reserved for the file */
+	unsigned sv_resvcount;          /* (see sfs_balloc_file) */
+	int sv_dirfree;                 /* no free dir slots below this */
+	unsigned sv_dhbig;              /* live entries if too many to index */
+	daddr_t sv_ipblock[SFS_ILEVELS]; /* last indirect path used */
+	uint32_t sv_ipstart[SFS_ILEVELS]; /* (see sfs_bmap) */
+	struct lock *sv_lock;           /* protects the above */
+	struct sfs_vnode *sv_hashnext;  /* sfs_vnodes chain (sfs_vnlock) */
+	bool sv_busy;                   /* being loaded or reclaimed (ditto) */
 };
 
+/* Buckets in the table of loaded vnodes; a power of 2 */
+#define SFS_VNHASH 64
+
 /*
  * In-memory info for a whole fs volume
+ *
+ * Only sb_dirty in the superblock changes after mount; sfs_sblock
+ * protects it. sfs_vnlock protects the table of loaded vnodes;
+ * sfs_freemaplock protects the freemap and sfs_superdirty.
+ *
+ * sfs_vnlock is never held across disk I/O. A vnode whose inode is
+ * being read in, or synced and freed by reclaim, sits in the table
+ * marked sv_busy; lookups of that inode wait on sfs_vncv for it.
+ *
+ * Lock order: a directory's sv_lock, then the sv_lock of a file in
+ * it, then sfs_vnlock, then buffer locks, then sfs_freemaplock, then
+ * sfs_sblock.
  */
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_superblock sfs_sb;	/* copy of on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
+	struct lock *sfs_sblock;        /* protects sb_dirty */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnode *sfs_vnodes[SFS_VNHASH]; /* loaded, by inode */
+	unsigned sfs_nvnodes;           /* number loaded */
+	struct lock *sfs_vnlock;        /* protects sfs_vnodes */
+	struct cv *sfs_vncv;            /* for busy vnodes (sfs_vnlock) */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
 	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct lock *sfs_freemaplock;   /* protects sfs_freemap */
 };
 
 /*
@@ -76,5 +113,10 @@ struct sfs_fs {
  */
 int sfs_mount(const char *device);
 
+/*
+ * Print statistics (for the kernel menu)
+ */
+void sfs_printstats(void);
+
 
 #endif /* _SFS_H_ */
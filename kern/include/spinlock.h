@@ -36,6 +36,7 @@
  */
 
 #include <cdefs.h>
+#include "opt-splkstats.h"
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -48,6 +49,11 @@
 /*
  * Basic spinlock.
  *
+ * This is a ticket lock: each cpu that wants the lock takes the next
+ * number from splk_next and waits until splk_owner reaches it, so the
+ * lock is handed out in the order it was asked for, and waiters only
+ * read the lock while they spin.
+ *
  * Note that spinlocks are held by CPUs, not by threads.
  *
  * This structure is made public so spinlocks do not have to be
@@ -55,14 +61,50 @@
  * the structure directly but always use the spinlock API functions.
  */
 struct spinlock {
-	volatile spinlock_data_t splk_lock; /* Memory word where we spin. */
-	struct cpu *splk_holder;	    /* CPU holding this lock. */
+	volatile spinlock_data_t splk_next;  /* Next ticket to hand out. */
+	volatile spinlock_data_t splk_owner; /* Ticket now holding the lock. */
+	struct cpu *splk_holder;	     /* CPU holding this lock. */
+
+#if OPT_SPLKSTATS
+	/* Profiling; set by the holder (see struct splkstat). */
+	const void *splk_site;		/* Where it was acquired */
+	unsigned splk_spins;		/* Times we looped waiting for it */
+	unsigned splk_stamp;		/* Cycle count when acquired */
+#endif
 };
 
 /*
  * Initializer for cases where a spinlock needs to be static or global.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#if OPT_SPLKSTATS
+#define SPINLOCK_INITIALIZER	\
+	{ SPINLOCK_DATA_INITIALIZER, SPINLOCK_DATA_INITIALIZER, NULL, \
+	  NULL, 0, 0 }
+#else
+#define SPINLOCK_INITIALIZER	\
+	{ SPINLOCK_DATA_INITIALIZER, SPINLOCK_DATA_INITIALIZER, NULL }
+#endif
+
+/*
+ * Spinlock profile. Each cpu counts, for every place spinlocks are
+ * acquired from, how often that happened, how often it had to wait
+ * and for how long, and the longest it held the lock. The tables are
+ * in struct cpu and only touched by their cpu with interrupts off, so
+ * they need no lock. Sites that don't fit go in the last entry.
+ *
+ * Keeping the profile costs something on every acquire and release,
+ * so it is only compiled in with "options splkstats".
+ */
+#define SPLKSTAT_SITES  64		/* a power of 2 */
+
+struct splkstat {
+	const void *ss_site;		/* Caller of spinlock_acquire */
+	const struct spinlock *ss_lock;	/* Last lock acquired there */
+	unsigned ss_acquires;		/* Times acquired */
+	unsigned ss_contended;		/* Times it had to wait */
+	unsigned ss_spins;		/* Loops spent waiting */
+	unsigned ss_maxhold;		/* Longest held, in cycles */
+};
 
 /*
  * Spinlock functions.
@@ -71,18 +113,28 @@ struct spinlock {
  * cleanup	Opposite of init. Lock must be unlocked.
  *
  * acquire	Get the lock, spinning as necessary. Also disables interrupts.
+ * tryacquire	Get the lock only if nobody holds it; return true if we
+ *		got it. Never spins.
  * release	Release the lock. May re-enable interrupts.
  *
  * do_i_hold	Check if the current CPU holds the lock.
+ *
+ * printstats	Print the profile of all cpus, busiest call sites first.
+ *		Call sites are code addresses; look them up with nm or
+ *		addr2line on the kernel. Without "options splkstats"
+ *		there is no profile and this just says so.
  */
 
 void spinlock_init(struct spinlock *lk);
 void spinlock_cleanup(struct spinlock *lk);
 
 void spinlock_acquire(struct spinlock *lk);
+bool spinlock_tryacquire(struct spinlock *lk);
 void spinlock_release(struct spinlock *lk);
 
 bool spinlock_do_i_hold(struct spinlock *lk);
 
+void spinlock_printstats(void);
+
 
 #endif /* _SPINLOCK_H_ */
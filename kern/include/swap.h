@@ -0,0 +1,53 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Backing store for user pages.
+ *
+ * Swap space lives on a raw disk device (SWAP_DEVICE) and is divided
+ * into page-sized slots. A bitmap records which slots are in use; a
+ * slot shared copy-on-write by several address spaces after fork also
+ * has a reference count, and is released when the last of them drops
+ * it. If the device cannot be opened at boot the system simply runs
+ * without swap.
+ */
+
+#include <vm.h>
+
+#define SWAP_DEVICE "lhd0raw:"
+
+/*
+ * Functions in swap.c:
+ *
+ *    swap_bootstrap - open the swap device and set up the slot bitmap.
+ *                     Called from vm_bootstrap.
+ *
+ *    swap_enabled   - true if there is a swap device.
+ *
+ *    swap_alloc     - reserve a free slot. Returns ENOSPC if the swap
+ *                     device is full (or missing).
+ *
+ *    swap_share     - take another reference to a slot.
+ *
+ *    swap_free      - drop a reference to a slot, freeing it when the
+ *                     last one goes away.
+ *
+ *    swap_pagein    - read a slot into the physical page PADDR.
+ *
+ *    swap_pageout   - write the physical page PADDR to a slot.
+ *
+ *    swap_printstats - print slot usage and page-in/page-out counts.
+ *
+ * The I/O functions sleep, so they must not be called with spinlocks
+ * held.
+ */
+void swap_bootstrap(void);
+bool swap_enabled(void);
+int swap_alloc(unsigned *slot);
+void swap_share(unsigned slot);
+void swap_free(unsigned slot);
+int swap_pagein(unsigned slot, paddr_t paddr);
+int swap_pageout(unsigned slot, paddr_t paddr);
+void swap_printstats(void);
+
+#endif /* _SWAP_H_ */
@@ -36,6 +36,7 @@
 
 
 #include <spinlock.h>
+#include <kern/time.h>
 
 /*
  * Dijkstra-style semaphore.
@@ -71,14 +72,26 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * Locks are adaptive: a thread that finds the lock held spins while
+ * the holder is running on another CPU, and sleeps otherwise. The
+ * statistics are protected by lk_lock, and are summed over all locks
+ * of the same name by lock_printstats.
  */
 struct lock {
         char *lk_name;
         struct spinlock lk_lock;
-        struct thread *lk_holder;
+        struct thread *volatile lk_holder;
         struct wchan *lk_wchan;
         volatile bool lk_available;
-	
+
+        struct lockstat *lk_stat;       /* statistics for this name */
+        struct lock *lk_statnext;       /* other live locks of the name */
+        struct lock *lk_statprev;
+        unsigned lk_acquires;           /* times acquired */
+        unsigned lk_contended;          /* ... when already held */
+        unsigned lk_blocks;             /* times a thread slept on it */
+        struct timespec lk_spintime;    /* time spent spinning on it */
 };
 
 struct lock *lock_create(const char *name);
@@ -99,6 +112,9 @@ void lock_acquire(struct lock *);
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 
+/* Print contention statistics for all locks, by name. */
+void lock_printstats(void);
+
 
 /*
  * Condition variable.
@@ -141,4 +157,47 @@ void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
 
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers may hold it at once, or one writer. Writers
+ * are preferred: while one is waiting, new readers wait too, so a
+ * steady stream of readers cannot starve it. Waiters sleep.
+ *
+ * Because of that, a thread holding it for reading must not acquire
+ * it for reading again: if a writer arrives in between, neither can
+ * proceed.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+struct rwlock {
+        char *rwlock_name;
+        struct spinlock rw_lock;
+        struct wchan *rw_readwchan;     /* readers wait here */
+        struct wchan *rw_writewchan;    /* writers wait here */
+        unsigned rw_readers;            /* readers holding it */
+        unsigned rw_writerswaiting;     /* writers waiting for it */
+        struct thread *rw_writer;       /* writer holding it, or NULL */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read  - Get the lock for reading.
+ *    rwlock_release_read  - Free the lock after reading.
+ *    rwlock_acquire_write - Get the lock for writing.
+ *    rwlock_release_write - Free the lock after writing.
+ *    rwlock_do_i_hold_write - Return true if the current thread holds
+ *                   the lock for writing.
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
+
 #endif /* _SYNCH_H_ */
@@ -78,4 +78,10 @@ int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
 __DEAD void sys__exit(int exit_code);
 int sys_execv(const char *program, char **args);
 
+int sys_sbrk(intptr_t amount, int *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+             off_t offset, int *retval);
+int sys_munmap(userptr_t addr, size_t len);
+int sys_msync(userptr_t addr, size_t len, int flags);
+
 #endif /* _SYSCALL_H_ */
@@ -57,6 +57,7 @@ int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
 int cvtest2(int, char **);
+int rwtest(int, char **);
 
 /* filesystem tests */
 int fstest(int, char **);
@@ -49,6 +49,9 @@ struct cpu;
 /* Size of kernel stacks; must be power of 2 */
 #define STACK_SIZE 4096
 
+/* Number of scheduler queue levels */
+#define SCHED_NLEVELS 4
+
 /* Mask for extracting the stack base address of a kernel stack pointer */
 #define STACK_MASK  (~(vaddr_t)(STACK_SIZE-1))
 
@@ -83,6 +86,16 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	unsigned t_allindex;		/* Index in allthreads[] */
+
+	/*
+	 * Scheduler state. See schedule() in thread.c.
+	 */
+	unsigned t_priority;		/* Queue level; 0 is the highest */
+	unsigned t_ticks;		/* Hardclocks used at this level */
+	unsigned t_readyclock;		/* c_hardclocks when made runnable */
+	unsigned t_ageclock;		/* Ditto, or when last aged up */
+	unsigned t_ranclock;		/* c_hardclocks when it last ran */
 
 	/*
 	 * Interrupt state fields.
@@ -105,6 +118,13 @@ struct thread {
 	 * Public fields
 	 */
 
+	/* Scheduler statistics, in hardclocks where they are times */
+	unsigned t_runticks;		/* Time spent running */
+	unsigned t_nruns;		/* Times switched to */
+	unsigned t_nsleeps;		/* Times blocked */
+	unsigned t_waitticks;		/* Time spent on run queues */
+	unsigned t_maxwait;		/* Longest single wait to run */
+
 	/* add more here as needed */
 };
 
@@ -157,16 +177,27 @@ __DEAD void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Charge the current thread for one hardclock. Returns true if it
+ * should yield: it has used up its time slice, or a thread at a better
+ * level is waiting. Called from the timer interrupt.
+ */
+bool thread_tick(void);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * If the current CPU has nothing queued, take a ready thread from the
+ * busiest other CPU. Returns true if it got one. Called from the idle
+ * loop and the timer interrupt.
  */
-void thread_consider_migration(void);
+bool thread_steal(void);
+
+/* Print every thread's scheduling level and statistics. */
+void thread_printstats(void);
 
 
 #endif /* _THREAD_H_ */
@@ -81,6 +81,29 @@ int vfs_lookup(char *path, struct vnode **result);
 int vfs_lookparent(char *path, struct vnode **result,
 		   char *buf, size_t buflen);
 
+/*
+ * Name lookup cache (vfscache.c), used by vfs_lookup.
+ *
+ *    vfs_dcache_lookup - look for NAME in directory DIR. Returns false
+ *                     if the cache doesn't know, with a generation
+ *                     number to pass to vfs_dcache_enter. Otherwise
+ *                     hands back the vnode, referenced, or NULL if
+ *                     there is no such file.
+ *    vfs_dcache_enter - remember what VOP_LOOKUP found for NAME in
+ *                     DIR (NULL if nothing), unless something has been
+ *                     invalidated since vfs_dcache_lookup returned GEN.
+ *    vfs_dcache_purge - forget the entries for directories of FS; only
+ *                     the ones for names that didn't exist if NEGONLY
+ *                     is set. Called after any change to the names in
+ *                     FS, and before unmounting it.
+ */
+
+bool vfs_dcache_lookup(struct vnode *dir, const char *name,
+		       struct vnode **ret, unsigned *gen);
+void vfs_dcache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+		      unsigned gen);
+void vfs_dcache_purge(struct fs *fs, bool negonly);
+
 /*
  * VFS layer high-level operations on pathnames
  * Because lookup may destroy pathnames, these all may too.
@@ -120,6 +143,9 @@ int vfs_getcwd(struct uio *buf);
  *    vfs_bootstrap - Call during system initialization to allocate
  *                    structures.
  *
+ *    vfs_syncer_bootstrap - Start the thread that calls vfs_sync every
+ *                    few seconds. Call once threads can be forked.
+ *
  *    vfs_setbootfs - Set the filesystem that paths beginning with a
  *                    slash are sent to. If not set, these paths fail
  *                    with ENOENT. The argument should be the device
@@ -160,6 +186,7 @@ int vfs_getcwd(struct uio *buf);
  */
 
 void vfs_bootstrap(void);
+void vfs_syncer_bootstrap(void);
 
 int vfs_setbootfs(const char *fsname);
 void vfs_clearbootfs(void);
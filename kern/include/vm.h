@@ -39,6 +39,8 @@
 
 #include <machine/vm.h>
 
+struct pagetable;
+
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
 #define VM_FAULT_WRITE       1    /* A write was attempted */
@@ -49,6 +51,12 @@
 #define VM_W 0x2
 #define VM_X 0x1
 
+/*
+ * Size of the user stack region. Stack pages are only backed by memory
+ * once touched, so this can be generous.
+ */
+#define VM_STACKPAGES 1024
+
 /* Initialization function */
 void vm_bootstrap(void);
 
@@ -59,11 +67,31 @@ int vm_fault(int faulttype, vaddr_t faultaddress);
 vaddr_t alloc_kpages(unsigned npages);
 void free_kpages(vaddr_t addr);
 
+/* Empty this cpu's page cache; called from interprocessor_interrupt */
+void vm_pagecache_flush(void);
+
+/* Zero a free page in advance; called by idle cpus (thread.c) */
+void vm_idlezero(void);
+
+/* Print VM statistics (kernel menu) */
+void vm_printstats(void);
+
+/* Flush this cpu's TLB; switch it to a page table (flushing if needed) */
+void vm_tlbflush(void);
+void vm_tlbactivate(struct pagetable *pt);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
 paddr_t getppages(unsigned long npages);
 
+/* Allocate/free a single zero-filled page of user memory */
+paddr_t alloc_upage(void);
+void free_upage(paddr_t paddr);
+
+/* Take another reference to a user page shared copy-on-write */
+void share_upage(paddr_t paddr);
+
 
 #endif /* _VM_H_ */
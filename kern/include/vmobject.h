@@ -0,0 +1,139 @@
+#ifndef _VMOBJECT_H_
+#define _VMOBJECT_H_
+
+/*
+ * Page cache for memory-mapped files.
+ *
+ * A vnode that is mapped with mmap gets one vmobject, shared by every
+ * mapping of that file in every process. It caches the file's pages
+ * by page number. A cached frame holds one coremap reference for the
+ * cache, plus one for each PTE mapping it. Frames mapped by any PTE
+ * are pinned. A frame only the cache still refers to can be evicted,
+ * after it has been written back if it is dirty.
+ *
+ * Shared mappings map the cached frame directly. A PTE allows writes
+ * only once the process has actually written to the page (the first
+ * write faults), and counts as one of the page's vp_writers until it
+ * is unmapped or write-protected again by msync. So a page that has
+ * been written back can only be marked clean if no writers remain.
+ * Private mappings map the cached frame copy-on-write. Because of the
+ * cache's own reference, the first write always makes a private
+ * anonymous copy.
+ *
+ * The pages are found through a hash table keyed by page number, so
+ * the cache takes memory for the pages it holds and not for how far
+ * into the file they are. Entries only exist for pages that are
+ * cached or busy.
+ *
+ * Pages being read in or written back are marked busy; anyone else
+ * who wants them waits on mo_wchan, and then looks them up again.
+ * mo_lock is acquired after a page table's lock and before the
+ * coremap lock.
+ *
+ * Reads and writes through the file descriptor do not go through the
+ * cache, but the file system keeps them coherent with it (see
+ * vmobject_flush and vmobject_update below). Truncating the file
+ * drops or zeroes the cached pages past the new end (vmobject_truncate),
+ * so stale data can't come back when the file grows again.
+ */
+
+#include <spinlock.h>
+#include <vm.h>
+
+struct vnode;
+struct wchan;
+
+struct vmpage {
+        unsigned vp_idx;                /* page of the file */
+        struct vmpage *vp_next;         /* hash chain */
+        paddr_t vp_paddr;               /* frame, or 0 if not cached */
+        bool vp_busy;                   /* being read in or written back */
+        bool vp_dirty;                  /* changed since written back */
+        unsigned vp_writers;            /* PTEs that allow writes */
+};
+
+struct vmobject {
+        struct vnode *mo_vnode;         /* the file (we hold a reference) */
+        unsigned mo_refcount;           /* regions using it */
+        struct vmpage **mo_hash;        /* pages, by page of the file */
+        unsigned mo_hashsize;           /* buckets; a power of 2 */
+        unsigned mo_count;              /* entries in mo_hash */
+        struct spinlock mo_lock;        /* protects mo_hash and pages */
+        struct wchan *mo_wchan;         /* for busy pages */
+};
+
+/*
+ * Functions in vmobject.c:
+ *
+ *    vmobject_bootstrap - called once from vm_bootstrap.
+ *
+ *    vmobject_get      - return VN's page cache, creating it if it has
+ *                        none, with a new reference.
+ *
+ *    vmobject_incref   - take another reference.
+ *
+ *    vmobject_decref   - drop a reference. When the last one goes,
+ *                        every dirty page is written back and the
+ *                        cache is freed.
+ *
+ *    vmobject_fault    - return the frame for page IDX, reading it in
+ *                        if needed, with a new coremap reference for
+ *                        the caller's PTE. If WRITE is set, the PTE
+ *                        will allow writes (see vmobject_addwriter).
+ *
+ *    vmobject_addwriter - note that a PTE mapping the cached frame
+ *                        PADDR now allows writes. The page becomes
+ *                        dirty.
+ *
+ *    vmobject_unwrite  - note that such a PTE no longer allows writes
+ *                        (or is going away).
+ *
+ *    vmobject_sync     - write back the dirty pages among the NPAGES
+ *                        starting at IDX.
+ *
+ *    vmobject_evict    - called by the pageout code to take the frame
+ *                        PADDR (cached as page IDX, referred to by
+ *                        nothing but the cache) out of the cache.
+ *                        Writes it back first if needed. Fails with
+ *                        EAGAIN if the page is no longer in that
+ *                        state.
+ *
+ *    vmobject_flush    - called by a file system before read() reads
+ *                        LEN bytes at POS of VN: write back the dirty
+ *                        cached pages there, so the read sees what
+ *                        mappings of the file have stored.
+ *
+ *    vmobject_update   - called by a file system after write() has
+ *                        written DATA (LEN bytes at POS of VN), not
+ *                        holding any of its own locks: copy it into
+ *                        the cached pages, so mappings see it and a
+ *                        later writeback doesn't undo it. Returns
+ *                        true if the file system must write DATA
+ *                        again, because a cache that was going away
+ *                        may have written older pages over it.
+ *
+ *    vmobject_truncate - called by a file system after truncating VN
+ *                        to LEN bytes, not holding any of its own
+ *                        locks: drop the cached pages past the end,
+ *                        or zero them (and the tail of the last page)
+ *                        where some mapping still has them.
+ *
+ * The functions that do I/O sleep, so they must not be called with
+ * spinlocks held.
+ */
+void vmobject_bootstrap(void);
+int vmobject_get(struct vnode *vn, struct vmobject **ret);
+void vmobject_incref(struct vmobject *obj);
+void vmobject_decref(struct vmobject *obj);
+int vmobject_fault(struct vmobject *obj, unsigned idx, bool write,
+                   paddr_t *ret);
+void vmobject_addwriter(paddr_t paddr);
+void vmobject_unwrite(paddr_t paddr);
+int vmobject_sync(struct vmobject *obj, unsigned idx, unsigned npages);
+int vmobject_evict(struct vmobject *obj, unsigned idx, paddr_t paddr);
+int vmobject_flush(struct vnode *vn, off_t pos, size_t len);
+bool vmobject_update(struct vnode *vn, off_t pos, const void *data,
+                     size_t len);
+void vmobject_truncate(struct vnode *vn, off_t len);
+
+#endif /* _VMOBJECT_H_ */
@@ -33,6 +33,7 @@
 #include <spinlock.h>
 struct uio;
 struct stat;
+struct vmobject;
 
 
 /*
@@ -57,6 +58,8 @@ struct vnode {
 	void *vn_data;                  /* Filesystem-specific data */
 
 	const struct vnode_ops *vn_ops; /* Functions on this vnode */
+
+	struct vmobject *vn_mobj;       /* Page cache if mapped, or NULL */
 };
 
 /*
@@ -120,9 +123,10 @@ struct vnode {
  *    vop_fsync       - Force any dirty buffers associated with this file
  *                      to stable storage.
  *
- *    vop_mmap        - Map file into memory. If you implement this
- *                      feature, you're responsible for choosing the
- *                      arguments for this operation.
+ *    vop_mmap        - Check whether the file may be mapped into
+ *                      memory. Returns 0 if so. The pages themselves
+ *                      are moved with vop_read and vop_write at
+ *                      page-aligned offsets (see vmobject.h).
  *
  *    vop_truncate    - Forcibly set size of file to the length passed
  *                      in, discarding any excess blocks.
@@ -132,6 +136,11 @@ struct vnode {
  *                      uio. Need not work on objects that are not
  *                      directories.
  *
+ *    vop_readahead   - Hint that the LEN bytes of the file at POS are
+ *                      likely to be read soon. The filesystem may
+ *                      start reading them in without waiting for the
+ *                      I/O, or do nothing. Errors are not reported.
+ *
  *****************************************
  *
  *    vop_creat       - Create a regular file named NAME in the passed
@@ -196,6 +205,7 @@ struct vnode_ops {
 	int (*vop_mmap)(struct vnode *file /* add stuff */);
 	int (*vop_truncate)(struct vnode *file, off_t len);
 	int (*vop_namefile)(struct vnode *file, struct uio *uio);
+	int (*vop_readahead)(struct vnode *file, off_t pos, off_t len);
 
 
 	int (*vop_creat)(struct vnode *dir,
@@ -240,6 +250,7 @@ struct vnode_ops {
 #define VOP_MMAP(vn /*add stuff */)     (__VOP(vn, mmap)(vn /*add stuff */))
 #define VOP_TRUNCATE(vn, pos)           (__VOP(vn, truncate)(vn, pos))
 #define VOP_NAMEFILE(vn, uio)           (__VOP(vn, namefile)(vn, uio))
+#define VOP_READAHEAD(vn, pos, len)     (__VOP(vn, readahead)(vn, pos, len))
 
 #define VOP_CREAT(vn,nm,excl,mode,res)  (__VOP(vn, creat)(vn,nm,excl,mode,res))
 #define VOP_SYMLINK(vn, name, content)  (__VOP(vn, symlink)(vn, name, content))
@@ -290,6 +301,7 @@ int vopfail_mmap_isdir(struct vnode *vn /* add stuff */);
 int vopfail_mmap_perm(struct vnode *vn /* add stuff */);
 int vopfail_mmap_nosys(struct vnode *vn /* add stuff */);
 int vopfail_truncate_isdir(struct vnode *vn, off_t pos);
+int vopnull_readahead(struct vnode *vn, off_t pos, off_t len);
 int vopfail_creat_notdir(struct vnode *vn, const char *name, bool excl,
 			 mode_t mode, struct vnode **result);
 int vopfail_symlink_notdir(struct vnode *vn, const char *contents,
@@ -95,29 +95,93 @@ bitmap_getdata(struct bitmap *b)
         return b->v;
 }
 
-int
-bitmap_alloc(struct bitmap *b, unsigned *index)
+/*
+ * Find the first clear bit in [START, END), or return END if there is
+ * none. Full bytes, and then aligned 32-bit chunks of full bytes, are
+ * skipped without looking at the bits. (Checking a chunk for all ones
+ * doesn't depend on byte order.)
+ */
+static
+unsigned
+bitmap_findzero(struct bitmap *b, unsigned start, unsigned end)
 {
-        unsigned ix;
-        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-        unsigned offset;
+        unsigned ix, offset;
+        WORD_TYPE mask;
+        uint32_t chunk;
 
-        for (ix=0; ix<maxix; ix++) {
-                if (b->v[ix]!=WORD_ALLBITS) {
-                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
-                                WORD_TYPE mask = ((WORD_TYPE)1) << offset;
+        /* Bit by bit up to a word boundary */
+        for (; start < end && start % BITS_PER_WORD != 0; start++) {
+                mask = ((WORD_TYPE)1) << (start % BITS_PER_WORD);
+                if ((b->v[start / BITS_PER_WORD] & mask) == 0) {
+                        return start;
+                }
+        }
+        if (start >= end) {
+                return end;
+        }
 
-                                if ((b->v[ix] & mask)==0) {
-                                        b->v[ix] |= mask;
-                                        *index = (ix*BITS_PER_WORD)+offset;
-                                        KASSERT(*index < b->nbits);
-                                        return 0;
+        ix = start / BITS_PER_WORD;
+        while (ix * BITS_PER_WORD < end) {
+                if (ix % sizeof(chunk) == 0 &&
+                    (ix + sizeof(chunk)) * BITS_PER_WORD <= end) {
+                        /* memcpy, as v is only byte-aligned */
+                        memcpy(&chunk, &b->v[ix], sizeof(chunk));
+                        if (chunk == 0xffffffff) {
+                                ix += sizeof(chunk);
+                                continue;
+                        }
+                }
+                if (b->v[ix] != WORD_ALLBITS) {
+                        for (offset = 0; offset < BITS_PER_WORD; offset++) {
+                                mask = ((WORD_TYPE)1) << offset;
+                                if ((b->v[ix] & mask) == 0) {
+                                        break;
                                 }
                         }
-                        KASSERT(0);
+                        start = ix * BITS_PER_WORD + offset;
+                        return start < end ? start : end;
                 }
+                ix++;
         }
-        return ENOSPC;
+        return end;
+}
+
+int
+bitmap_alloc(struct bitmap *b, unsigned *index)
+{
+        unsigned count;
+
+        return bitmap_alloc_run(b, 0, 1, index, &count);
+}
+
+int
+bitmap_alloc_run(struct bitmap *b, unsigned goal, unsigned maxrun,
+                 unsigned *index, unsigned *count)
+{
+        unsigned bit, n;
+
+        KASSERT(maxrun > 0);
+
+        if (goal >= b->nbits) {
+                goal = 0;
+        }
+        bit = bitmap_findzero(b, goal, b->nbits);
+        if (bit == b->nbits) {
+                bit = bitmap_findzero(b, 0, goal);
+                if (bit == goal) {
+                        return ENOSPC;
+                }
+        }
+
+        for (n = 0; n < maxrun && bit + n < b->nbits &&
+                     !bitmap_isset(b, bit + n); n++) {
+                bitmap_mark(b, bit + n);
+        }
+        KASSERT(n > 0);
+
+        *index = bit;
+        *count = n;
+        return 0;
 }
 
 static
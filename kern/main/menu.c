@@ -43,6 +43,7 @@
 #include <syscall.h>
 #include <test.h>
 #include <synch.h>
+#include <vm.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
@@ -126,9 +127,9 @@ common_prog(int nargs, char **args)
 	}
 
         struct proc *cproc = curproc;
-        spinlock_acquire(&cproc->p_lock);
+        rwlock_acquire_write(cproc->p_childlock);
         proclist_addhead(&cproc->p_child, proc);
-        spinlock_release(&cproc->p_lock);
+        rwlock_release_write(cproc->p_childlock);
         
         /* Assign a ppid to child proc */
         //proc->ppid = cproc->pid;
@@ -139,9 +140,9 @@ common_prog(int nargs, char **args)
 			args /* thread arg */, nargs /* thread arg */);
 	if (result) {
 		kprintf("thread_fork failed: %s\n", strerror(result));
-                spinlock_acquire(&cproc->p_lock);
+                rwlock_acquire_write(cproc->p_childlock);
                 proclist_remove(&cproc->p_child, proc);
-                spinlock_release(&cproc->p_lock);
+                rwlock_release_write(cproc->p_childlock);
 		proc_destroy(proc);
 		return result;
 	}
@@ -149,9 +150,9 @@ common_prog(int nargs, char **args)
         sys_waitpid(proc->pid, NULL, 0, NULL);
 
         // Remove proc from child list
-        spinlock_acquire(&cproc->p_lock);
+        rwlock_acquire_write(cproc->p_childlock);
         proclist_remove(&cproc->p_child, proc);
-        spinlock_release(&cproc->p_lock);
+        rwlock_release_write(cproc->p_childlock);
         proc_destroy(proc);
 
 	/*
@@ -411,6 +412,68 @@ cmd_kheapgeneration(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_vmstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_schedstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_lockstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	lock_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_spinlockstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	spinlock_printstats();
+
+	return 0;
+}
+
+#if OPT_SFS
+static
+int
+cmd_sfsstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	sfs_printstats();
+
+	return 0;
+}
+#endif
+
 static
 int
 cmd_kheapdump(int nargs, char **args)
@@ -501,6 +564,7 @@ static const char *testmenu[] = {
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
 	"[sy4] CV test #2            (1)     ",
+	"[sy5] RW lock test          (1)     ",
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress                ",
 	"[fs3] FS write stress               ",
@@ -535,6 +599,13 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[vm] VM stats                       ",
+	"[sched] Scheduler stats             ",
+	"[locks] Lock contention stats       ",
+	"[spinlocks] Spinlock profile        ",
+#if OPT_SFS
+	"[sfsstats] SFS stats                ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -590,6 +661,13 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "vm",         cmd_vmstats },
+	{ "sched",      cmd_schedstats },
+	{ "locks",      cmd_lockstats },
+	{ "spinlocks",  cmd_spinlockstats },
+#if OPT_SFS
+	{ "sfsstats",   cmd_sfsstats },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -611,6 +689,7 @@ static struct {
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
 	{ "sy4",	cvtest2 },
+	{ "sy5",	rwtest },
 
 	/* file system assignment tests */
 	{ "fs1",	fstest },
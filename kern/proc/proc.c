@@ -78,23 +78,14 @@ proc_create(const char *name)
                 return NULL;
         }
 
-	proc->p_name = kstrdup(name);
-	if (proc->p_name == NULL) {
-                proc_destroy(proc);
-		return NULL;
-	}
-
-        proc->p_wait_cv = cv_create("proc_cv");
-        if (proc->p_wait_cv == NULL) {
-                proc_destroy(proc);
-                return NULL;
-        }
-
-        proc->p_wait_lock = lock_create("proc_wait_lock");
-        if (proc->p_wait_lock == NULL) {
-                proc_destroy(proc);
-                return NULL;
-        }
+        /*
+         * Set up everything that can't fail first, so proc_destroy
+         * can clean up after a failure below.
+         */
+        proc->p_name = NULL;
+        proc->p_wait_cv = NULL;
+        proc->p_wait_lock = NULL;
+        proc->p_childlock = NULL;
 
         proc->ppid = -1;
         proc->wait_count = 0;
@@ -118,6 +109,30 @@ proc_create(const char *name)
 	proc->p_cwd = NULL;
 	proc->p_filetable = NULL;
 
+	proc->p_name = kstrdup(name);
+	if (proc->p_name == NULL) {
+                proc_destroy(proc);
+		return NULL;
+	}
+
+        proc->p_wait_cv = cv_create("proc_cv");
+        if (proc->p_wait_cv == NULL) {
+                proc_destroy(proc);
+                return NULL;
+        }
+
+        proc->p_wait_lock = lock_create("proc_wait_lock");
+        if (proc->p_wait_lock == NULL) {
+                proc_destroy(proc);
+                return NULL;
+        }
+
+        proc->p_childlock = rwlock_create("proc_childlock");
+        if (proc->p_childlock == NULL) {
+                proc_destroy(proc);
+                return NULL;
+        }
+
 	return proc;
 }
 
@@ -210,8 +225,15 @@ proc_destroy(struct proc *proc)
         
         proclistnode_cleanup(&proc->p_listnode);
         proclist_cleanup(&proc->p_child);
-        cv_destroy(proc->p_wait_cv);
-        lock_destroy(proc->p_wait_lock);
+        if (proc->p_wait_cv != NULL) {
+                cv_destroy(proc->p_wait_cv);
+        }
+        if (proc->p_wait_lock != NULL) {
+                lock_destroy(proc->p_wait_lock);
+        }
+        if (proc->p_childlock != NULL) {
+                rwlock_destroy(proc->p_childlock);
+        }
 
         pid_reclaim(proc->pid);
 
@@ -154,6 +154,11 @@ sys_readwrite(int fd, userptr_t buf, size_t size, enum uio_rw rw,
 	}
 
 	if (locked) {
+		/* keep the reads coming if it's being read in order */
+		if (rw == UIO_READ && useruio.uio_offset > pos) {
+			openfile_readahead(file, pos, useruio.uio_offset);
+		}
+
 		/* set the offset to the updated offset in the uio */
 		file->of_offset = useruio.uio_offset;
 		lock_release(file->of_offsetlock);
@@ -42,8 +42,12 @@
  * circumstances, as_prepare_load and as_complete_load probably don't
  * need to do anything.
  *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * Segments whose file offset and address line up within a page are
+ * not read in here at all: they are defined with as_define_filesegment
+ * and paged in from the executable's page cache as they are touched,
+ * so unchanged pages (the text, mostly) are shared between every
+ * process running the program. Anything else is read in by
+ * load_segment as before.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -52,6 +56,7 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/stat.h>
 #include <lib.h>
 #include <uio.h>
 #include <proc.h>
@@ -59,6 +64,21 @@
 #include <addrspace.h>
 #include <vnode.h>
 #include <elf.h>
+#include "opt-dumbvm.h"
+
+#if !OPT_DUMBVM
+/*
+ * Check whether a segment can be paged in on demand (see above).
+ */
+static
+bool
+segment_ondemand(struct vnode *v, const Elf_Phdr *ph)
+{
+	return ph->p_offset % PAGE_SIZE == ph->p_vaddr % PAGE_SIZE &&
+		ph->p_filesz <= ph->p_memsz &&
+		VOP_MMAP(v) == 0;
+}
+#endif
 
 /*
  * Load a segment at virtual address VADDR. The segment in memory
@@ -159,6 +179,7 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 	struct iovec iov;
 	struct uio ku;
 	struct addrspace *as;
+	struct stat st;
 
 	as = proc_getas();
 
@@ -202,11 +223,10 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 		return ENOEXEC;
 	}
 
-        /* Setup page table in addresspace */
-        result = as_init_pagetable(as, eh.e_phnum);
-        if (result) {
-                return result;
-        }
+	result = VOP_STAT(v, &st);
+	if (result) {
+		return result;
+	}
 
 	/*
 	 * Go through the list of segments and set up the address space.
@@ -249,6 +269,28 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if !OPT_DUMBVM
+		if (segment_ondemand(v, &ph)) {
+			if ((off_t)ph.p_offset + ph.p_filesz > st.st_size) {
+				/* Not left for the first fault to find */
+				kprintf("ELF: segment past end of file - "
+					"file truncated?\n");
+				return ENOEXEC;
+			}
+			result = as_define_filesegment(as,
+						       ph.p_vaddr, ph.p_memsz,
+						       v, ph.p_offset,
+						       ph.p_filesz,
+						       ph.p_flags & PF_R,
+						       ph.p_flags & PF_W,
+						       ph.p_flags & PF_X);
+			if (result) {
+				return result;
+			}
+			continue;
+		}
+#endif
+
 		result = as_define_region(as,
 					  ph.p_vaddr, ph.p_memsz,
 					  ph.p_flags & PF_R,
@@ -294,6 +336,13 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if !OPT_DUMBVM
+		if (segment_ondemand(v, &ph)) {
+			/* Left to vm_fault */
+			continue;
+		}
+#endif
+
 		result = load_segment(as, v, ph.p_offset, ph.p_vaddr,
 				      ph.p_memsz, ph.p_filesz,
 				      ph.p_flags & PF_X);
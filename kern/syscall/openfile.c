@@ -37,8 +37,16 @@
 #include <lib.h>
 #include <synch.h>
 #include <vfs.h>
+#include <vnode.h>
 #include <openfile.h>
 
+/*
+ * Read-ahead window limits, in bytes. The window starts small and
+ * doubles each time the reader catches up with it.
+ */
+#define OF_RAMIN  (8 * 1024)
+#define OF_RAMAX  (64 * 1024)
+
 /*
  * Constructor for struct openfile.
  */
@@ -69,6 +77,9 @@ openfile_create(struct vnode *vn, int accmode)
 	file->of_vnode = vn;
 	file->of_accmode = accmode;
 	file->of_offset = 0;
+	file->of_nextread = 0;
+	file->of_raend = 0;
+	file->of_rawindow = 0;
 	file->of_refcount = 1;
 
 	return file;
@@ -116,6 +127,43 @@ openfile_open(char *filename, int openflags, mode_t mode,
 	return 0;
 }
 
+/*
+ * Called with the offset lock held after a read of [POS, END). If it
+ * picked up where the last one left off, the file is being read in
+ * order, so once the reader is into the second half of what has been
+ * read ahead, ask for the next window's worth. A read anywhere else
+ * starts over.
+ */
+void
+openfile_readahead(struct openfile *file, off_t pos, off_t end)
+{
+	KASSERT(lock_do_i_hold(file->of_offsetlock));
+
+	if (pos != file->of_nextread) {
+		file->of_nextread = end;
+		file->of_raend = end;
+		file->of_rawindow = 0;
+		return;
+	}
+	file->of_nextread = end;
+
+	if (file->of_raend < end) {
+		file->of_raend = end;
+	}
+	if (file->of_raend - end > file->of_rawindow / 2) {
+		return;
+	}
+
+	if (file->of_rawindow == 0) {
+		file->of_rawindow = OF_RAMIN;
+	}
+	else if (file->of_rawindow < OF_RAMAX) {
+		file->of_rawindow *= 2;
+	}
+	VOP_READAHEAD(file->of_vnode, file->of_raend, file->of_rawindow);
+	file->of_raend += file->of_rawindow;
+}
+
 /*
  * Increment the reference count on an openfile.
  */
@@ -77,9 +77,9 @@ sys_fork(struct trapframe *proc_tf, int *retval)
                 }
 
                 /* Adding the child proc in parent childrens list */
-                spinlock_acquire(&proc->p_lock);
+                rwlock_acquire_write(proc->p_childlock);
                 proclist_addhead(&proc->p_child, *child_proc);        
-                spinlock_release(&proc->p_lock);
+                rwlock_release_write(proc->p_childlock);
                 
                 /* Assign a ppid to child proc */
                 (*child_proc)->ppid = proc->pid;
@@ -89,9 +89,9 @@ sys_fork(struct trapframe *proc_tf, int *retval)
                 struct addrspace **child_addrspace = 
                         kmalloc(sizeof(struct addrspace*)); 
                 if (child_addrspace == NULL) {
-                        spinlock_acquire(&proc->p_lock);
+                        rwlock_acquire_write(proc->p_childlock);
                         proclist_remove(&proc->p_child, *child_proc);
-                        spinlock_release(&proc->p_lock);
+                        rwlock_release_write(proc->p_childlock);
 
                         proc_destroy(*child_proc);
                         kfree(child_proc);
@@ -100,9 +100,9 @@ sys_fork(struct trapframe *proc_tf, int *retval)
                 }
                 err = as_copy(proc_addrspace, child_addrspace);
                 if (err) {
-                        spinlock_acquire(&proc->p_lock);
+                        rwlock_acquire_write(proc->p_childlock);
                         proclist_remove(&proc->p_child, *child_proc);
-                        spinlock_release(&proc->p_lock);
+                        rwlock_release_write(proc->p_childlock);
 
                         proc_destroy(*child_proc);
                         kfree(child_proc);
@@ -116,9 +116,9 @@ sys_fork(struct trapframe *proc_tf, int *retval)
                                   enter_forked_process,
                                   child_tf, 0);
                 if (err) {
-                        spinlock_acquire(&proc->p_lock);
+                        rwlock_acquire_write(proc->p_childlock);
                         proclist_remove(&proc->p_child, *child_proc);
-                        spinlock_release(&proc->p_lock);
+                        rwlock_release_write(proc->p_childlock);
 
                         kfree(child_addrspace);
                         proc_destroy(*child_proc);
@@ -156,7 +156,7 @@ sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval)
 
         // Check if pid among child processes 
         // A process can wait only on child processses
-        spinlock_acquire(&proc->p_lock);
+        rwlock_acquire_read(proc->p_childlock);
         bool found = false;
         struct proc *child = NULL;
         PROCLIST_FORALL(child, proc->p_child) {
@@ -165,7 +165,7 @@ sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval)
                         break;
                 }
         }        
-        spinlock_release(&proc->p_lock);
+        rwlock_release_read(proc->p_childlock);
 
         if (!found) {
                 return ESRCH;
@@ -223,7 +223,7 @@ sys__exit(int exit_code)
         // Detach all proc in our own child list if any
         if (!proclist_isempty(&proc->p_child)) {
                 struct proc *itervar;
-                spinlock_acquire(&proc->p_lock);
+                rwlock_acquire_write(proc->p_childlock);
                 // Iterate over all children and remove them from list
                 while ((itervar = (proclist_remhead(&proc->p_child))) != NULL) {
                         spinlock_acquire(&itervar->p_lock);
@@ -241,7 +241,7 @@ sys__exit(int exit_code)
                                 spinlock_release(&itervar->p_lock);
                         }
                 }
-                spinlock_release(&proc->p_lock);
+                rwlock_release_write(proc->p_childlock);
         }
         
         // Singal all processes waiting for this process
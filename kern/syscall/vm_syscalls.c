@@ -0,0 +1,188 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <lib.h>
+#include <addrspace.h>
+#include <proc.h>
+#include <current.h>
+#include <vnode.h>
+#include <openfile.h>
+#include <filetable.h>
+#include <vmobject.h>
+#include <syscall.h>
+
+/*
+ * Move the end of the heap. Returns the old break.
+ */
+int
+sys_sbrk(intptr_t amount, int *retval)
+{
+        struct addrspace *as;
+        vaddr_t oldbreak;
+        int result;
+
+        as = proc_getas();
+        if (as == NULL) {
+                return ENOMEM;
+        }
+
+        result = as_sbrk(as, amount, &oldbreak);
+        if (result) {
+                return result;
+        }
+
+        *retval = (int)oldbreak;
+        return 0;
+}
+
+/*
+ * Map part of an open file. ADDR is only a hint, which we ignore. The
+ * file must be open for reading, and for writing as well if changes
+ * are to be written back to it.
+ */
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+         off_t offset, int *retval)
+{
+        struct addrspace *as;
+        struct openfile *file;
+        struct vmobject *obj;
+        vaddr_t vaddr;
+        size_t npages;
+        bool shared;
+        int perm, result;
+
+        (void)addr;
+
+        if (len == 0 || len > USERSPACETOP) {
+                return EINVAL;
+        }
+        npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+
+        /* Page numbers in the page cache are 32 bits */
+        if (offset < 0 || offset % PAGE_SIZE != 0 ||
+            offset / PAGE_SIZE + npages > (off_t)(uint32_t)-1) {
+                return EINVAL;
+        }
+        if (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) {
+                return EINVAL;
+        }
+        if (flags != MAP_SHARED && flags != MAP_PRIVATE) {
+                return EINVAL;
+        }
+        shared = flags == MAP_SHARED;
+
+        perm = 0;
+        if (prot & PROT_READ) {
+                perm |= VM_R;
+        }
+        if (prot & PROT_WRITE) {
+                perm |= VM_W;
+        }
+        if (prot & PROT_EXEC) {
+                perm |= VM_X;
+        }
+
+        as = proc_getas();
+        if (as == NULL) {
+                return ENOMEM;
+        }
+
+        result = filetable_get(curproc->p_filetable, fd, &file);
+        if (result) {
+                return result;
+        }
+        if (file->of_accmode == O_WRONLY ||
+            (shared && (prot & PROT_WRITE) && file->of_accmode != O_RDWR)) {
+                filetable_put(curproc->p_filetable, fd, file);
+                return EACCES;
+        }
+        result = VOP_MMAP(file->of_vnode);
+        if (result == 0) {
+                result = vmobject_get(file->of_vnode, &obj);
+        }
+        filetable_put(curproc->p_filetable, fd, file);
+        if (result) {
+                return result;
+        }
+
+        result = as_mmap(as, npages, perm, obj, offset, shared, &vaddr);
+        if (result) {
+                vmobject_decref(obj);
+                return result;
+        }
+
+        *retval = (int)vaddr;
+        return 0;
+}
+
+/*
+ * Check the page-aligned range of a munmap or msync and count its
+ * pages.
+ */
+static
+int
+vm_checkrange(userptr_t addr, size_t len, size_t *npages)
+{
+        vaddr_t vaddr = (vaddr_t)addr;
+
+        if (vaddr % PAGE_SIZE != 0 || len == 0 ||
+            vaddr >= USERSPACETOP || len > USERSPACETOP - vaddr) {
+                return EINVAL;
+        }
+        *npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+        return 0;
+}
+
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+        struct addrspace *as;
+        size_t npages;
+        int result;
+
+        result = vm_checkrange(addr, len, &npages);
+        if (result) {
+                return result;
+        }
+
+        as = proc_getas();
+        if (as == NULL) {
+                return EINVAL;
+        }
+
+        return as_munmap(as, (vaddr_t)addr, npages);
+}
+
+/*
+ * Write back mapped pages. Writeback is always synchronous, so
+ * MS_ASYNC is the same as MS_SYNC. MS_INVALIDATE has nothing to do,
+ * as every mapping of a file shares its one page cache.
+ */
+int
+sys_msync(userptr_t addr, size_t len, int flags)
+{
+        struct addrspace *as;
+        size_t npages;
+        int result;
+
+        if (flags & ~(MS_ASYNC | MS_SYNC | MS_INVALIDATE)) {
+                return EINVAL;
+        }
+        if ((flags & MS_ASYNC) && (flags & MS_SYNC)) {
+                return EINVAL;
+        }
+
+        result = vm_checkrange(addr, len, &npages);
+        if (result) {
+                return result;
+        }
+
+        as = proc_getas();
+        if (as == NULL) {
+                return ENOMEM;
+        }
+
+        return as_msync(as, (vaddr_t)addr, npages);
+}
@@ -28,6 +28,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <bitmap.h>
 #include <test.h>
@@ -39,7 +40,7 @@ bitmaptest(int nargs, char **args)
 {
 	struct bitmap *b;
 	char data[TESTSIZE];
-	uint32_t x;
+	uint32_t x, n;
 	int i;
 
 	(void)nargs;
@@ -101,6 +102,18 @@ bitmaptest(int nargs, char **args)
 		KASSERT(data[i]==0);
 	}
 
+	/* Everything is set now; free a stretch and allocate runs in it */
+	for (i=100; i<110; i++) {
+		bitmap_unmark(b, i);
+	}
+	KASSERT(bitmap_alloc_run(b, 105, 3, &x, &n)==0);
+	KASSERT(x==105 && n==3);
+	KASSERT(bitmap_alloc_run(b, 200, 8, &x, &n)==0);
+	KASSERT(x==100 && n==5);
+	KASSERT(bitmap_alloc_run(b, 0, 8, &x, &n)==0);
+	KASSERT(x==108 && n==2);
+	KASSERT(bitmap_alloc_run(b, 50, 1, &x, &n)==ENOSPC);
+
 	kprintf("Bitmap test complete\n");
 	return 0;
 }
@@ -41,6 +41,7 @@
 #define NSEMLOOPS     63
 #define NLOCKLOOPS    120
 #define NCVLOOPS      5
+#define NRWLOOPS      120
 #define NTHREADS      32
 
 static volatile unsigned long testval1;
@@ -399,3 +400,106 @@ cvtest2(int nargs, char **args)
 	kprintf("cvtest2 done\n");
 	return 0;
 }
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Reader-writer lock test. Every fourth pass a thread writes; the
+ * rest of the time it reads. Writers must see nobody else inside, and
+ * readers must see no writer and consistent values.
+ */
+
+static struct rwlock *testrw;
+static struct spinlock rwcountlock = SPINLOCK_INITIALIZER;
+static unsigned rwreaders, rwwriters;
+static volatile bool rwfailed;
+
+static
+void
+rwcount(unsigned *count, int delta, unsigned *readers, unsigned *writers)
+{
+	spinlock_acquire(&rwcountlock);
+	*count += delta;
+	*readers = rwreaders;
+	*writers = rwwriters;
+	spinlock_release(&rwcountlock);
+}
+
+static
+void
+rwtestthread(void *junk, unsigned long num)
+{
+	unsigned readers, writers;
+	int i;
+	(void)junk;
+
+	for (i=0; i<NRWLOOPS; i++) {
+		if ((i + num) % 4 == 0) {
+			rwlock_acquire_write(testrw);
+			rwcount(&rwwriters, 1, &readers, &writers);
+			if (readers != 0 || writers != 1) {
+				kprintf("thread %lu: writer not alone\n", num);
+				rwfailed = true;
+			}
+			testval1 = num;
+			thread_yield();
+			testval2 = num*num;
+			testval3 = num%3;
+			rwcount(&rwwriters, -1, &readers, &writers);
+			rwlock_release_write(testrw);
+		}
+		else {
+			rwlock_acquire_read(testrw);
+			rwcount(&rwreaders, 1, &readers, &writers);
+			if (writers != 0) {
+				kprintf("thread %lu: reader with writer\n", num);
+				rwfailed = true;
+			}
+			if (testval2 != testval1*testval1 ||
+			    testval3 != testval1%3) {
+				kprintf("thread %lu: values mismatch\n", num);
+				rwfailed = true;
+			}
+			thread_yield();
+			rwcount(&rwreaders, -1, &readers, &writers);
+			rwlock_release_read(testrw);
+		}
+	}
+	V(donesem);
+}
+
+int
+rwtest(int nargs, char **args)
+{
+	int i, result;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	testrw = rwlock_create("testrw");
+	if (testrw == NULL) {
+		panic("rwtest: rwlock_create failed\n");
+	}
+	testval1 = testval2 = testval3 = 0;
+	rwfailed = false;
+
+	kprintf("Starting rwlock test...\n");
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("rwtest", NULL, rwtestthread, NULL, i);
+		if (result) {
+			panic("rwtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	rwlock_destroy(testrw);
+	testrw = NULL;
+
+	kprintf("%s\n", rwfailed ? "Test failed" : "Rwlock test done.");
+	return 0;
+}
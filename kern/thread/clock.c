@@ -51,7 +51,7 @@
  * the scheduler.
  */
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define MIGRATE_HARDCLOCKS	16	/* Steal work every 16 hardclocks. */
 
 /*
  * Once a second, everything waiting on lbolt is awakened by CPU 0.
@@ -98,12 +98,14 @@ hardclock(void)
 
 	curcpu->c_hardclocks++;
 	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
+		thread_steal();
 	}
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	thread_yield();
+	if (thread_tick()) {
+		thread_yield();
+	}
 }
 
 /*
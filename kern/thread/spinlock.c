@@ -44,14 +44,47 @@
  */
 
 
+#if OPT_SPLKSTATS
+/*
+ * Find this cpu's profile entry for call site SITE, claiming a free
+ * one if it has none yet. Interrupts must be off.
+ */
+static
+struct splkstat *
+spinlock_getstat(struct cpu *mycpu, const void *site)
+{
+	struct splkstat *ss;
+	unsigned h, i;
+
+	h = (uintptr_t)site >> 2;
+	for (i=0; i<SPLKSTAT_SITES; i++) {
+		ss = &mycpu->c_splkstats[(h + i) & (SPLKSTAT_SITES - 1)];
+		if (ss->ss_site == site) {
+			return ss;
+		}
+		if (ss->ss_site == NULL) {
+			ss->ss_site = site;
+			return ss;
+		}
+	}
+	return &mycpu->c_splkstats[SPLKSTAT_SITES];
+}
+#endif /* OPT_SPLKSTATS */
+
 /*
  * Initialize spinlock.
  */
 void
 spinlock_init(struct spinlock *splk)
 {
-	spinlock_data_set(&splk->splk_lock, 0);
+	spinlock_data_set(&splk->splk_next, 0);
+	spinlock_data_set(&splk->splk_owner, 0);
 	splk->splk_holder = NULL;
+#if OPT_SPLKSTATS
+	splk->splk_site = NULL;
+	splk->splk_spins = 0;
+	splk->splk_stamp = 0;
+#endif
 }
 
 /*
@@ -61,20 +94,25 @@ void
 spinlock_cleanup(struct spinlock *splk)
 {
 	KASSERT(splk->splk_holder == NULL);
-	KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+	KASSERT(spinlock_data_get(&splk->splk_next) ==
+		spinlock_data_get(&splk->splk_owner));
 }
 
 /*
  * Get the lock.
  *
  * First disable interrupts (otherwise, if we get a timer interrupt we
- * might come back to this lock and deadlock), then use a machine-level
- * atomic operation to wait for the lock to be free.
+ * might come back to this lock and deadlock), then take a ticket and
+ * wait for our turn.
  */
 void
 spinlock_acquire(struct spinlock *splk)
 {
 	struct cpu *mycpu;
+	spinlock_data_t ticket;
+#if OPT_SPLKSTATS
+	unsigned spins;
+#endif
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -90,36 +128,87 @@ spinlock_acquire(struct spinlock *splk)
 		mycpu = NULL;
 	}
 
-	while (1) {
-		/*
-		 * Do test-test-and-set, that is, read first before
-		 * doing test-and-set, to reduce bus contention.
-		 *
-		 * Test-and-set is a machine-level atomic operation
-		 * that writes 1 into the lock word and returns the
-		 * previous value. If that value was 0, the lock was
-		 * previously unheld and we now own it. If it was 1,
-		 * we don't.
-		 */
-		if (spinlock_data_get(&splk->splk_lock) != 0) {
-			continue;
-		}
-		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
-			continue;
-		}
-		break;
+	/*
+	 * Fetch-and-increment is a machine-level atomic operation;
+	 * everyone gets a different ticket. Then just watch the owner
+	 * word, which only the holder writes.
+	 */
+	ticket = spinlock_data_fetchinc(&splk->splk_next);
+#if OPT_SPLKSTATS
+	spins = 0;
+	while (spinlock_data_get(&splk->splk_owner) != ticket) {
+		spins++;
+	}
+#else
+	while (spinlock_data_get(&splk->splk_owner) != ticket) {
+		/* spin */
 	}
+#endif
 
 	membar_store_any();
 	splk->splk_holder = mycpu;
+#if OPT_SPLKSTATS
+	if (mycpu != NULL) {
+		splk->splk_site = __builtin_return_address(0);
+		splk->splk_spins = spins;
+		splk->splk_stamp = spinlock_cycles();
+	}
+#endif
+}
+
+/*
+ * Get the lock if it is free, without spinning. Like acquire, this
+ * leaves interrupts disabled if it succeeds.
+ *
+ * The lock is free if nobody has a ticket that hasn't been served.
+ * Then take the next ticket only if nobody else has taken it since.
+ */
+bool
+spinlock_tryacquire(struct spinlock *splk)
+{
+	spinlock_data_t ticket;
+
+	KASSERT(CURCPU_EXISTS());
+	KASSERT(splk->splk_holder != curcpu->c_self);
+
+	ticket = spinlock_data_get(&splk->splk_owner);
+	if (spinlock_data_get(&splk->splk_next) != ticket) {
+		return false;
+	}
+
+	splraise(IPL_NONE, IPL_HIGH);
+	if (!spinlock_data_cas(&splk->splk_next, ticket, ticket + 1)) {
+		spllower(IPL_HIGH, IPL_NONE);
+		return false;
+	}
+	curcpu->c_spinlocks++;
+
+	membar_store_any();
+	splk->splk_holder = curcpu->c_self;
+#if OPT_SPLKSTATS
+	splk->splk_site = __builtin_return_address(0);
+	splk->splk_spins = 0;
+	splk->splk_stamp = spinlock_cycles();
+#endif
+	return true;
 }
 
 /*
  * Release the lock.
+ *
+ * The profile, if any, is updated after handing the lock on, from
+ * copies of what the holder recorded, but before interrupts come back
+ * on.
  */
 void
 spinlock_release(struct spinlock *splk)
 {
+#if OPT_SPLKSTATS
+	struct splkstat *ss;
+	const void *site;
+	unsigned spins, hold;
+#endif
+
 	/* this must work before curcpu initialization */
 	if (CURCPU_EXISTS()) {
 		KASSERT(splk->splk_holder == curcpu->c_self);
@@ -127,9 +216,32 @@ spinlock_release(struct spinlock *splk)
 		curcpu->c_spinlocks--;
 	}
 
+#if OPT_SPLKSTATS
+	site = splk->splk_site;
+	spins = splk->splk_spins;
+	hold = spinlock_cycles() - splk->splk_stamp;
+	splk->splk_site = NULL;
+#endif
+
 	splk->splk_holder = NULL;
 	membar_any_store();
-	spinlock_data_set(&splk->splk_lock, 0);
+	spinlock_data_set(&splk->splk_owner,
+			  spinlock_data_get(&splk->splk_owner) + 1);
+
+#if OPT_SPLKSTATS
+	if (site != NULL && CURCPU_EXISTS()) {
+		ss = spinlock_getstat(curcpu->c_self, site);
+		ss->ss_lock = splk;
+		ss->ss_acquires++;
+		if (spins > 0) {
+			ss->ss_contended++;
+			ss->ss_spins += spins;
+		}
+		if (hold > ss->ss_maxhold) {
+			ss->ss_maxhold = hold;
+		}
+	}
+#endif
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -146,3 +258,96 @@ spinlock_do_i_hold(struct spinlock *splk)
 	/* Assume we can read splk_holder atomically enough for this to work */
 	return (splk->splk_holder == curcpu->c_self);
 }
+
+/*
+ * Print the spinlock profile. The per-cpu tables are merged by call
+ * site; they are read without stopping the other cpus, so the numbers
+ * may be a little stale.
+ */
+#if OPT_SPLKSTATS
+void
+spinlock_printstats(void)
+{
+	struct splkstat *stats, *ss, *ms, *other, tmp;
+	struct cpu *c;
+	unsigned num, i, j, k;
+
+	stats = kmalloc((SPLKSTAT_SITES + 1) * sizeof(*stats));
+	if (stats == NULL) {
+		kprintf("spinlock_printstats: Out of memory\n");
+		return;
+	}
+	bzero(stats, (SPLKSTAT_SITES + 1) * sizeof(*stats));
+
+	/* The last entry collects sites that don't fit, as on each cpu */
+	other = &stats[SPLKSTAT_SITES];
+	num = 0;
+	for (i=0; i<cpu_numcpus(); i++) {
+		c = cpu_getcpu(i);
+		for (j=0; j<=SPLKSTAT_SITES; j++) {
+			ss = &c->c_splkstats[j];
+			if (ss->ss_acquires == 0) {
+				continue;
+			}
+			ms = other;
+			if (j < SPLKSTAT_SITES) {
+				for (k=0; k<num; k++) {
+					if (stats[k].ss_site == ss->ss_site) {
+						break;
+					}
+				}
+				if (k < num) {
+					ms = &stats[k];
+				}
+				else if (num < SPLKSTAT_SITES) {
+					ms = &stats[num++];
+					ms->ss_site = ss->ss_site;
+				}
+			}
+			if (ms != other) {
+				ms->ss_lock = ss->ss_lock;
+			}
+			ms->ss_acquires += ss->ss_acquires;
+			ms->ss_contended += ss->ss_contended;
+			ms->ss_spins += ss->ss_spins;
+			if (ss->ss_maxhold > ms->ss_maxhold) {
+				ms->ss_maxhold = ss->ss_maxhold;
+			}
+		}
+	}
+	if (other->ss_acquires > 0) {
+		stats[num++] = *other;
+	}
+
+	/* Insertion sort; there aren't many */
+	for (i=1; i<num; i++) {
+		tmp = stats[i];
+		for (j=i; j>0 && stats[j-1].ss_spins < tmp.ss_spins; j--) {
+			stats[j] = stats[j-1];
+		}
+		stats[j] = tmp;
+	}
+
+	kprintf("%-10s %-10s %10s %10s %10s %10s\n", "site", "lock",
+		"acquires", "contended", "spins", "max cycles");
+	for (i=0; i<num; i++) {
+		ss = &stats[i];
+		if (ss->ss_site == NULL) {
+			kprintf("%-21s %10u %10u %10u %10u\n", "(other)",
+				ss->ss_acquires, ss->ss_contended,
+				ss->ss_spins, ss->ss_maxhold);
+			continue;
+		}
+		kprintf("%-10p %-10p %10u %10u %10u %10u\n", ss->ss_site,
+			ss->ss_lock, ss->ss_acquires, ss->ss_contended,
+			ss->ss_spins, ss->ss_maxhold);
+	}
+	kfree(stats);
+}
+#else
+void
+spinlock_printstats(void)
+{
+	kprintf("No spinlock profile; rebuild with options splkstats\n");
+}
+#endif /* OPT_SPLKSTATS */
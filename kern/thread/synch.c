@@ -34,8 +34,10 @@
 
 #include <types.h>
 #include <lib.h>
+#include <clock.h>
 #include <spinlock.h>
 #include <wchan.h>
+#include <cpu.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
@@ -138,10 +140,66 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/* Most times to check on a running holder before sleeping anyway */
+#define LOCK_SPIN_MAX           2000
+
+/*
+ * Lock statistics, one entry per lock name, found by hashing the name
+ * with linear probing. An entry holds the totals of the destroyed
+ * locks with that name and a list of the live ones. Names that don't
+ * fit share lockstat_other. Protected by lockstat_lock.
+ */
+#define LOCKSTAT_MAX            64      /* a power of 2 */
+#define LOCKSTAT_NAMELEN        24
+
+struct lockstat {
+        char ls_name[LOCKSTAT_NAMELEN]; /* empty if unused */
+        struct lock *ls_live;           /* live locks with this name */
+        unsigned ls_acquires;
+        unsigned ls_contended;
+        unsigned ls_blocks;
+        struct timespec ls_spintime;
+};
+
+static struct spinlock lockstat_lock = SPINLOCK_INITIALIZER;
+static struct lockstat lockstats[LOCKSTAT_MAX];
+static struct lockstat lockstat_other;
+
+static
+struct lockstat *
+lockstat_get(const char *name)
+{
+        struct lockstat *ls;
+        const char *s;
+        unsigned h, i;
+
+        KASSERT(spinlock_do_i_hold(&lockstat_lock));
+
+        if (*name == 0) {
+                return &lockstat_other;
+        }
+        h = 0;
+        for (s = name; *s != 0; s++) {
+                h = h * 33 + (unsigned char)*s;
+        }
+        for (i=0; i<LOCKSTAT_MAX; i++) {
+                ls = &lockstats[(h + i) & (LOCKSTAT_MAX - 1)];
+                if (ls->ls_name[0] == 0) {
+                        strcpy(ls->ls_name, name);
+                        return ls;
+                }
+                if (!strcmp(ls->ls_name, name)) {
+                        return ls;
+                }
+        }
+        return &lockstat_other;
+}
+
 struct lock *
 lock_create(const char *name)
 {
         struct lock *lock;
+        char statname[LOCKSTAT_NAMELEN];
 
         lock = kmalloc(sizeof(struct lock));
         if (lock == NULL) {
@@ -166,18 +224,56 @@ lock_create(const char *name)
         lock->lk_available = true;
         lock->lk_holder = NULL;
 
+        lock->lk_acquires = 0;
+        lock->lk_contended = 0;
+        lock->lk_blocks = 0;
+        lock->lk_spintime.tv_sec = 0;
+        lock->lk_spintime.tv_nsec = 0;
+
+        /* Long names are truncated for the statistics */
+        snprintf(statname, sizeof(statname), "%s", name);
+        spinlock_acquire(&lockstat_lock);
+        lock->lk_stat = lockstat_get(statname);
+        lock->lk_statprev = NULL;
+        lock->lk_statnext = lock->lk_stat->ls_live;
+        if (lock->lk_statnext != NULL) {
+                lock->lk_statnext->lk_statprev = lock;
+        }
+        lock->lk_stat->ls_live = lock;
+        spinlock_release(&lockstat_lock);
+
         return lock;
 }
 
 void
 lock_destroy(struct lock *lock)
 {
+        struct lockstat *ls;
+
         KASSERT(lock != NULL);
 
         /* No thread should be holding it before destroying */
         KASSERT(lock->lk_available == true);
         KASSERT(lock->lk_holder == NULL);
 
+        /* Fold its statistics into the totals for its name */
+        ls = lock->lk_stat;
+        spinlock_acquire(&lockstat_lock);
+        if (lock->lk_statprev != NULL) {
+                lock->lk_statprev->lk_statnext = lock->lk_statnext;
+        }
+        else {
+                ls->ls_live = lock->lk_statnext;
+        }
+        if (lock->lk_statnext != NULL) {
+                lock->lk_statnext->lk_statprev = lock->lk_statprev;
+        }
+        ls->ls_acquires += lock->lk_acquires;
+        ls->ls_contended += lock->lk_contended;
+        ls->ls_blocks += lock->lk_blocks;
+        timespec_add(&ls->ls_spintime, &lock->lk_spintime, &ls->ls_spintime);
+        spinlock_release(&lockstat_lock);
+
 	spinlock_cleanup(&lock->lk_lock); // Remove the spinlock created
         wchan_destroy(lock->lk_wchan);
         kfree(lock->lk_holder);
@@ -185,16 +281,64 @@ lock_destroy(struct lock *lock)
         kfree(lock);
 }
 
+/*
+ * Check if HOLDER still holds LOCK and is running on another CPU.
+ * This is done without lk_lock, so HOLDER may have let go of the lock
+ * and even exited; but then lk_holder has changed, and at worst a
+ * stale t_state costs one more time around.
+ */
+static
+bool
+lock_holder_oncpu(struct lock *lock, struct thread *holder)
+{
+        return lock->lk_holder == holder && holder != NULL &&
+                ((volatile struct thread *)holder)->t_state == S_RUN &&
+                holder->t_cpu != curcpu->c_self;
+}
+
 void
 lock_acquire(struct lock *lock)
 {
+        struct thread *holder;
+        struct timespec before, after, spun;
+        unsigned i;
+        bool gaveup;
+
         KASSERT(lock != NULL); 
 
         spinlock_acquire(&lock->lk_lock);
+        lock->lk_acquires++;
+        if (!lock->lk_available) {
+                lock->lk_contended++;
+        }
 
-        /* Sleep if the lock is not available */
+        /*
+         * While the lock is held, spin if the holder is running on
+         * another CPU, as it will likely let go soon, and sleep if
+         * it isn't, or has kept running for too long.
+         */
+        gaveup = false;
         while (!lock->lk_available) {
-               wchan_sleep(lock->lk_wchan, &lock->lk_lock);
+                holder = lock->lk_holder;
+                if (gaveup || !lock_holder_oncpu(lock, holder)) {
+                        lock->lk_blocks++;
+                        wchan_sleep(lock->lk_wchan, &lock->lk_lock);
+                        gaveup = false;
+                        continue;
+                }
+
+                spinlock_release(&lock->lk_lock);
+                gettime(&before);
+                for (i=0; i<LOCK_SPIN_MAX; i++) {
+                        if (!lock_holder_oncpu(lock, holder)) {
+                                break;
+                        }
+                }
+                gettime(&after);
+                gaveup = (i == LOCK_SPIN_MAX);
+                timespec_sub(&after, &before, &spun);
+                spinlock_acquire(&lock->lk_lock);
+                timespec_add(&lock->lk_spintime, &spun, &lock->lk_spintime);
         }
 
         lock->lk_available = false;
@@ -228,6 +372,73 @@ lock_do_i_hold(struct lock *lock)
         return (lock->lk_holder == curthread);
 }
 
+/*
+ * Print lock statistics by name, most contended first. Copy them out
+ * under lockstat_lock, then print them without it.
+ */
+void
+lock_printstats(void)
+{
+        struct lockstat *stats, *ls, tmp;
+        struct lock *lock;
+        unsigned num, i, j;
+
+        stats = kmalloc((LOCKSTAT_MAX + 1) * sizeof(*stats));
+        if (stats == NULL) {
+                kprintf("lock_printstats: Out of memory\n");
+                return;
+        }
+
+        num = 0;
+        spinlock_acquire(&lockstat_lock);
+        for (i=0; i<=LOCKSTAT_MAX; i++) {
+                ls = i < LOCKSTAT_MAX ? &lockstats[i] : &lockstat_other;
+                if (ls->ls_name[0] == 0 && ls->ls_live == NULL &&
+                    ls->ls_acquires == 0) {
+                        continue;
+                }
+                stats[num] = *ls;
+                if (ls == &lockstat_other) {
+                        strcpy(stats[num].ls_name, "(other)");
+                }
+                for (lock = ls->ls_live; lock != NULL;
+                     lock = lock->lk_statnext) {
+                        stats[num].ls_acquires += lock->lk_acquires;
+                        stats[num].ls_contended += lock->lk_contended;
+                        stats[num].ls_blocks += lock->lk_blocks;
+                        timespec_add(&stats[num].ls_spintime,
+                                     &lock->lk_spintime,
+                                     &stats[num].ls_spintime);
+                }
+                num++;
+        }
+        spinlock_release(&lockstat_lock);
+
+        /* Insertion sort; there aren't many */
+        for (i=1; i<num; i++) {
+                tmp = stats[i];
+                for (j=i; j>0 && stats[j-1].ls_contended < tmp.ls_contended;
+                     j--) {
+                        stats[j] = stats[j-1];
+                }
+                stats[j] = tmp;
+        }
+
+        kprintf("%-23s %10s %10s %10s %s\n", "lock", "acquires",
+                "contended", "slept", "spin seconds");
+        for (i=0; i<num; i++) {
+                ls = &stats[i];
+                if (ls->ls_acquires == 0) {
+                        continue;
+                }
+                kprintf("%-23s %10u %10u %10u %llu.%09lu\n", ls->ls_name,
+                        ls->ls_acquires, ls->ls_contended, ls->ls_blocks,
+                        (unsigned long long) ls->ls_spintime.tv_sec,
+                        (unsigned long) ls->ls_spintime.tv_nsec);
+        }
+        kfree(stats);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // CV
@@ -321,3 +532,133 @@ cv_broadcast(struct cv *cv, struct lock *lock)
         
         spinlock_release(&cv->cv_lock);
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+        struct rwlock *rw;
+
+        rw = kmalloc(sizeof(struct rwlock));
+        if (rw == NULL) {
+                return NULL;
+        }
+
+        rw->rwlock_name = kstrdup(name);
+        if (rw->rwlock_name == NULL) {
+                kfree(rw);
+                return NULL;
+        }
+
+        rw->rw_readwchan = wchan_create(rw->rwlock_name);
+        if (rw->rw_readwchan == NULL) {
+                kfree(rw->rwlock_name);
+                kfree(rw);
+                return NULL;
+        }
+        rw->rw_writewchan = wchan_create(rw->rwlock_name);
+        if (rw->rw_writewchan == NULL) {
+                wchan_destroy(rw->rw_readwchan);
+                kfree(rw->rwlock_name);
+                kfree(rw);
+                return NULL;
+        }
+
+        spinlock_init(&rw->rw_lock);
+        rw->rw_readers = 0;
+        rw->rw_writerswaiting = 0;
+        rw->rw_writer = NULL;
+
+        return rw;
+}
+
+void
+rwlock_destroy(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+
+        /* Nobody should hold it or be waiting for it */
+        KASSERT(rw->rw_readers == 0);
+        KASSERT(rw->rw_writer == NULL);
+        KASSERT(rw->rw_writerswaiting == 0);
+
+        spinlock_cleanup(&rw->rw_lock);
+        wchan_destroy(rw->rw_writewchan);
+        wchan_destroy(rw->rw_readwchan);
+        kfree(rw->rwlock_name);
+        kfree(rw);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+        KASSERT(rw->rw_writer != curthread);
+
+        spinlock_acquire(&rw->rw_lock);
+        /* Let waiting writers go first */
+        while (rw->rw_writer != NULL || rw->rw_writerswaiting > 0) {
+                wchan_sleep(rw->rw_readwchan, &rw->rw_lock);
+        }
+        rw->rw_readers++;
+        spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+
+        spinlock_acquire(&rw->rw_lock);
+        KASSERT(rw->rw_readers > 0);
+        rw->rw_readers--;
+        if (rw->rw_readers == 0 && rw->rw_writerswaiting > 0) {
+                wchan_wakeone(rw->rw_writewchan, &rw->rw_lock);
+        }
+        spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+        KASSERT(rw->rw_writer != curthread);
+
+        spinlock_acquire(&rw->rw_lock);
+        rw->rw_writerswaiting++;
+        while (rw->rw_writer != NULL || rw->rw_readers > 0) {
+                wchan_sleep(rw->rw_writewchan, &rw->rw_lock);
+        }
+        rw->rw_writerswaiting--;
+        rw->rw_writer = curthread;
+        spinlock_release(&rw->rw_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+
+        spinlock_acquire(&rw->rw_lock);
+        KASSERT(rw->rw_writer == curthread);
+        rw->rw_writer = NULL;
+        /* Hand it to the next writer if any; otherwise to all readers */
+        if (rw->rw_writerswaiting > 0) {
+                wchan_wakeone(rw->rw_writewchan, &rw->rw_lock);
+        }
+        else {
+                wchan_wakeall(rw->rw_readwchan, &rw->rw_lock);
+        }
+        spinlock_release(&rw->rw_lock);
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rw)
+{
+        KASSERT(rw != NULL);
+
+        return (rw->rw_writer == curthread);
+}
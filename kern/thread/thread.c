@@ -38,6 +38,7 @@
 #include <lib.h>
 #include <array.h>
 #include <cpu.h>
+#include <clock.h>
 #include <spl.h>
 #include <spinlock.h>
 #include <wchan.h>
@@ -57,6 +58,12 @@
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/* Scheduler time slice at each level, in hardclocks: 2, 4, 8, 16 */
+#define SCHED_QUANTUM(level)	(2U << (level))
+
+/* Age waiting threads up a level every half second */
+#define SCHED_AGE_HARDCLOCKS	(HZ / 2)
+
 /* Wait channel. A wchan is protected by an associated, passed-in spinlock. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -75,6 +82,10 @@ DEFARRAY(wchan, static __UNUSED inline);
 static struct spinlock allwchans_lock;
 static struct wchanarray allwchans;
 
+/* Array of all threads (for statistics) */
+static struct spinlock allthreads_lock;
+static struct threadarray allthreads;
+
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
@@ -126,6 +137,7 @@ struct thread *
 thread_create(const char *name)
 {
 	struct thread *thread;
+	int result;
 
 	DEBUGASSERT(name != NULL);
 
@@ -150,16 +162,60 @@ thread_create(const char *name)
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
 
+	/* Scheduler fields; new threads start at the top */
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_readyclock = 0;
+	thread->t_ageclock = 0;
+	thread->t_ranclock = 0;
+
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+	/* Scheduler statistics */
+	thread->t_runticks = 0;
+	thread->t_nruns = 0;
+	thread->t_nsleeps = 0;
+	thread->t_waitticks = 0;
+	thread->t_maxwait = 0;
+
 	/* If you add to struct thread, be sure to initialize here */
 
+	spinlock_acquire(&allthreads_lock);
+	result = threadarray_add(&allthreads, thread, &thread->t_allindex);
+	spinlock_release(&allthreads_lock);
+	if (result) {
+		kfree(thread->t_name);
+		kfree(thread);
+		return NULL;
+	}
+
 	return thread;
 }
 
+/*
+ * Take a thread out of allthreads[], moving the last one into its
+ * slot.
+ */
+static
+void
+thread_unregister(struct thread *thread)
+{
+	struct thread *last;
+	unsigned num;
+
+	spinlock_acquire(&allthreads_lock);
+	num = threadarray_num(&allthreads);
+	KASSERT(threadarray_get(&allthreads, thread->t_allindex) == thread);
+	last = threadarray_get(&allthreads, num - 1);
+	threadarray_set(&allthreads, thread->t_allindex, last);
+	last->t_allindex = thread->t_allindex;
+	threadarray_setsize(&allthreads, num - 1);
+	spinlock_release(&allthreads_lock);
+}
+
 /*
  * Create a CPU structure. This is used for the bootup CPU and
  * also for secondary CPUs.
@@ -188,12 +244,37 @@ cpu_create(unsigned hardware_number)
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
 
+	c->c_pagecache_count = 0;
+	c->c_pagecache_hits = 0;
+	c->c_pagecache_misses = 0;
+	c->c_pagecache_frees = 0;
+	c->c_pagecache_drains = 0;
+	c->c_pagecache_flushes = 0;
+	c->c_tlb_owner = NULL;
+	c->c_tlb_next = 0;
+	c->c_tlb_refills = 0;
+	c->c_tlb_faults = 0;
+	c->c_tlb_flushes = 0;
+	c->c_tlb_keeps = 0;
+
+	c->c_steal_tries = 0;
+	c->c_steal_busy = 0;
+	c->c_steal_hot = 0;
+	c->c_steals = 0;
+
+#if OPT_SPLKSTATS
+	bzero(c->c_splkstats, sizeof(c->c_splkstats));
+#endif
+
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
+	c->c_stolen = 0;
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_sent = 0;
+	c->c_shootdown_done = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -234,6 +315,21 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Number of cpus, and a cpu by number.
+ */
+unsigned
+cpu_numcpus(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+struct cpu *
+cpu_getcpu(unsigned num)
+{
+	return cpuarray_get(&allcpus, num);
+}
+
 /*
  * Destroy a thread.
  *
@@ -256,6 +352,7 @@ thread_destroy(struct thread *thread)
 
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
+	thread_unregister(thread);
 	if (thread->t_stack != NULL) {
 		kfree(thread->t_stack);
 	}
@@ -357,6 +454,8 @@ thread_bootstrap(void)
 	struct thread *bootthread;
 
 	cpuarray_init(&allcpus);
+	spinlock_init(&allthreads_lock);
+	threadarray_init(&allthreads);
 
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
@@ -442,6 +541,30 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Put a thread on a cpu's run queue, which must be locked. The queue
+ * is kept in order of level, and FIFO within a level, so it is the
+ * concatenation of one queue per level and remhead picks the oldest
+ * thread at the best level. Threads usually go in at or near the
+ * tail, so look from there.
+ */
+static
+void
+thread_enqueue(struct cpu *c, struct thread *t)
+{
+	struct thread *prev;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	THREADLIST_FORALL_REV(prev, c->c_runqueue) {
+		if (prev->t_priority <= t->t_priority) {
+			threadlist_insertafter(&c->c_runqueue, prev, t);
+			return;
+		}
+	}
+	threadlist_addhead(&c->c_runqueue, t);
+}
+
 /*
  * Make a thread runnable.
  *
@@ -466,7 +589,9 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	target->t_readyclock = targetcpu->c_hardclocks;
+	target->t_ageclock = target->t_readyclock;
+	thread_enqueue(targetcpu, target);
 
 	if (targetcpu->c_isidle) {
 		/*
@@ -565,6 +690,7 @@ void
 thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 {
 	struct thread *cur, *next;
+	unsigned wait;
 	int spl;
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
@@ -597,6 +723,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		return;
 	}
 
+	/* Note when it stopped running, for thread_steal. */
+	cur->t_ranclock = curcpu->c_hardclocks;
+
 	/* Put the thread in the right place. */
 	switch (newstate) {
 	    case S_RUN:
@@ -606,6 +735,17 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		break;
 	    case S_SLEEP:
 		cur->t_wchan_name = wc->wc_name;
+		cur->t_nsleeps++;
+		/*
+		 * A thread that blocks before using half its time
+		 * slice is waiting for I/O or other threads rather
+		 * than computing; move it up a level.
+		 */
+		if (cur->t_priority > 0 &&
+		    cur->t_ticks < SCHED_QUANTUM(cur->t_priority) / 2) {
+			cur->t_priority--;
+			cur->t_ticks = 0;
+		}
 		/*
 		 * Add the thread to the list in the wait channel, and
 		 * unlock same. To avoid a race with someone else
@@ -628,7 +768,10 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	 * Get the next thread. While there isn't one, call md_idle().
 	 * curcpu->c_isidle must be true when md_idle is
 	 * called. Unlock the runqueue while idling too, to make sure
-	 * things can be added to it.
+	 * things can be added to it. Before idling, try to steal a
+	 * thread from another cpu instead, and failing that zero one
+	 * page in the background. Only one: we are at splhigh here,
+	 * so zeroing more would hold off interrupts.
 	 *
 	 * Note that we don't need to unlock the runqueue atomically
 	 * with idling; becoming unidle requires receiving an
@@ -647,12 +790,23 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			if (!thread_steal()) {
+				vm_idlezero();
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
 
+	/* Account for the time it spent waiting. */
+	wait = curcpu->c_hardclocks - next->t_readyclock;
+	next->t_waitticks += wait;
+	if (wait > next->t_maxwait) {
+		next->t_maxwait = wait;
+	}
+	next->t_nruns++;
+
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
 	 * curthread and it may not be, depending on how curthread and
@@ -829,139 +983,285 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multilevel feedback queue. Each thread has a level,
+ * t_priority, from 0 (best) to SCHED_NLEVELS-1, and the run queue is
+ * kept sorted by level (see thread_enqueue). New threads start at the
+ * top. Each hardclock is charged to the thread running; a thread that
+ * uses up the time slice for its level moves down one, and lower
+ * levels get longer slices. A thread that blocks early moves up one
+ * (see thread_switch). A thread that has waited SCHED_AGE_HARDCLOCKS
+ * on the run queue also moves up one, so nothing starves.
  */
 
+/*
+ * Charge curthread for a hardclock. Called from hardclock().
+ */
+bool
+thread_tick(void)
+{
+	struct thread *cur, *first;
+	bool preempt;
+
+	/* Don't charge the thread we went idle in. */
+	if (curcpu->c_isidle) {
+		return false;
+	}
+
+	cur = curthread;
+	cur->t_runticks++;
+	cur->t_ticks++;
+	if (cur->t_ticks >= SCHED_QUANTUM(cur->t_priority)) {
+		if (cur->t_priority < SCHED_NLEVELS - 1) {
+			cur->t_priority++;
+		}
+		cur->t_ticks = 0;
+		return true;
+	}
+
+	/* Slice not used up; only give way to a better level. */
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	first = curcpu->c_runqueue.tl_head.tln_next->tln_self;
+	preempt = first != NULL && first->t_priority < cur->t_priority;
+	spinlock_release(&curcpu->c_runqueue_lock);
+	return preempt;
+}
+
+/*
+ * This is called periodically from hardclock(). It ages threads that
+ * have waited too long on the current CPU's run queue, and re-sorts
+ * the queue if any moved.
+ */
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct threadlist levels[SCHED_NLEVELS];
+	struct thread *t;
+	unsigned now, i;
+	bool moved;
+
+	moved = false;
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	now = curcpu->c_hardclocks;
+	THREADLIST_FORALL(t, curcpu->c_runqueue) {
+		if (t->t_priority > 0 &&
+		    now - t->t_ageclock >= SCHED_AGE_HARDCLOCKS) {
+			t->t_priority--;
+			t->t_ticks = 0;
+			t->t_ageclock = now;
+			moved = true;
+		}
+	}
+
+	if (moved) {
+		/* Stable bucket sort by level */
+		for (i=0; i<SCHED_NLEVELS; i++) {
+			threadlist_init(&levels[i]);
+		}
+		while ((t = threadlist_remhead(&curcpu->c_runqueue)) != NULL) {
+			threadlist_addtail(&levels[t->t_priority], t);
+		}
+		for (i=0; i<SCHED_NLEVELS; i++) {
+			while ((t = threadlist_remhead(&levels[i])) != NULL) {
+				threadlist_addtail(&curcpu->c_runqueue, t);
+			}
+			threadlist_cleanup(&levels[i]);
+		}
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
 }
 
 /*
- * Thread migration.
+ * Work stealing.
  *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * A cpu with nothing on its run queue takes a thread from the tail of
+ * the busiest other run queue. Idle cpus try this each time they come
+ * out of cpu_idle (so at least every hardclock), and busy cpus whose
+ * queues are empty every MIGRATE_HARDCLOCKS. Load thus moves toward
+ * cpus that have room for it, and a cpu with work queued never
+ * touches another cpu's queue.
  *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
+ * Queue lengths are read without locking, as hints. The victim's lock
+ * is only tried, never waited for: if someone holds it we look again
+ * next time rather than pile up behind them.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * A thread that stopped running less than STEAL_HOT_HARDCLOCKS ago
+ * probably still has its working set in the victim's cache, so it is
+ * left alone unless the victim has at least STEAL_FORCE_QUEUE threads
+ * queued, when the imbalance costs more than the cache misses.
  */
-void
-thread_consider_migration(void)
+#define STEAL_HOT_HARDCLOCKS	2
+#define STEAL_FORCE_QUEUE	4
+#define STEAL_SCAN		4	/* threads to look at, from the tail */
+
+bool
+thread_steal(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
+	struct cpu *c, *victim;
+	struct thread *t, *chosen;
+	unsigned i, n, numcpus, most, then, now;
+	bool hot;
 
-	my_count = total_count = 0;
+	if (!threadlist_isempty(&curcpu->c_runqueue)) {
+		return false;
+	}
+
+	victim = NULL;
+	most = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+		if (c != curcpu->c_self && c->c_runqueue.tl_count > most) {
+			most = c->c_runqueue.tl_count;
+			victim = c;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
-
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
+	if (victim == NULL) {
+		return false;
 	}
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	curcpu->c_steal_tries++;
+	if (!spinlock_tryacquire(&victim->c_runqueue_lock)) {
+		curcpu->c_steal_busy++;
+		return false;
 	}
-	spinlock_release(&curcpu->c_runqueue_lock);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
+	then = victim->c_hardclocks;
+	chosen = NULL;
+	hot = false;
+	n = 0;
+	THREADLIST_FORALL_REV(t, victim->c_runqueue) {
+		if (n++ == STEAL_SCAN) {
+			break;
+		}
+		/*
+		 * An idle cpu's curthread can be on its run queue if
+		 * it was woken up before the cpu got out of the idle
+		 * loop. Moving it would be a disaster.
+		 */
+		if (t == victim->c_curthread) {
 			continue;
 		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+		if (then - t->t_ranclock < STEAL_HOT_HARDCLOCKS &&
+		    victim->c_runqueue.tl_count < STEAL_FORCE_QUEUE) {
+			hot = true;
+			continue;
 		}
-		spinlock_release(&c->c_runqueue_lock);
+		chosen = t;
+		break;
 	}
+	if (chosen == NULL) {
+		spinlock_release(&victim->c_runqueue_lock);
+		if (hot) {
+			curcpu->c_steal_hot++;
+		}
+		return false;
+	}
+	threadlist_remove(&victim->c_runqueue, chosen);
+	victim->c_stolen++;
+	spinlock_release(&victim->c_runqueue_lock);
 
 	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
+	 * Nobody else touches a ready thread that is on no run queue,
+	 * so it's safe in between.
 	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
-		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	/* Keep its clock stamps relative to its new cpu. */
+	now = curcpu->c_hardclocks;
+	chosen->t_readyclock = now - (then - chosen->t_readyclock);
+	chosen->t_ageclock = now - (then - chosen->t_ageclock);
+	chosen->t_ranclock = now - (then - chosen->t_ranclock);
+	chosen->t_cpu = curcpu->c_self;
+	thread_enqueue(curcpu, chosen);
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	curcpu->c_steals++;
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u\n",
+	      chosen->t_name, victim->c_number, curcpu->c_number);
+	return true;
+}
+
+/*
+ * Scheduler statistics. Copy them out under allthreads_lock, then
+ * print them without it.
+ */
+struct threadstat {
+	char ts_name[16];
+	int ts_cpu;
+	threadstate_t ts_state;
+	unsigned ts_priority;
+	unsigned ts_runticks;
+	unsigned ts_nruns;
+	unsigned ts_nsleeps;
+	unsigned ts_waitticks;
+	unsigned ts_maxwait;
+};
+
+/* Hardclocks to milliseconds */
+#define TICKS_MS(t)	((t) * (1000 / HZ))
+
+void
+thread_printstats(void)
+{
+	static const char *const statenames[] = {
+		"run", "ready", "sleep", "zombie",
+	};
+	struct threadstat *stats, *ts;
+	struct thread *t;
+	struct cpu *c;
+	unsigned num, max, i;
+
+	spinlock_acquire(&allthreads_lock);
+	max = threadarray_num(&allthreads) + 8;
+	spinlock_release(&allthreads_lock);
+
+	stats = kmalloc(max * sizeof(*stats));
+	if (stats == NULL) {
+		kprintf("thread_printstats: Out of memory\n");
+		return;
+	}
+
+	spinlock_acquire(&allthreads_lock);
+	num = threadarray_num(&allthreads);
+	if (num > max) {
+		num = max;
+	}
+	for (i=0; i<num; i++) {
+		t = threadarray_get(&allthreads, i);
+		ts = &stats[i];
+		snprintf(ts->ts_name, sizeof(ts->ts_name), "%s", t->t_name);
+		ts->ts_cpu = t->t_cpu != NULL ? (int)t->t_cpu->c_number : -1;
+		ts->ts_state = t->t_state;
+		ts->ts_priority = t->t_priority;
+		ts->ts_runticks = t->t_runticks;
+		ts->ts_nruns = t->t_nruns;
+		ts->ts_nsleeps = t->t_nsleeps;
+		ts->ts_waitticks = t->t_waitticks;
+		ts->ts_maxwait = t->t_maxwait;
 	}
+	spinlock_release(&allthreads_lock);
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		kprintf("cpu%u: steals: %u tries, %u contended, %u cache-hot, "
+			"%u stolen; %u stolen from it\n", c->c_number,
+			c->c_steal_tries, c->c_steal_busy, c->c_steal_hot,
+			c->c_steals, c->c_stolen);
+	}
+
+	kprintf("%-15s %-6s %3s %4s %8s %7s %7s %8s %8s\n",
+		"thread", "state", "cpu", "prio", "run ms", "runs",
+		"sleeps", "avgwait", "maxwait");
+	for (i=0; i<num; i++) {
+		ts = &stats[i];
+		kprintf("%-15s %-6s %3d %4u %8u %7u %7u %8u %8u\n",
+			ts->ts_name, statenames[ts->ts_state], ts->ts_cpu,
+			ts->ts_priority, TICKS_MS(ts->ts_runticks),
+			ts->ts_nruns, ts->ts_nsleeps,
+			ts->ts_nruns > 0 ?
+			TICKS_MS(ts->ts_waitticks) / ts->ts_nruns : 0,
+			TICKS_MS(ts->ts_maxwait));
+	}
+	kfree(stats);
 }
 
 ////////////////////////////////////////////////////////////
@@ -1166,13 +1466,16 @@ ipi_broadcast(int code)
 	}
 }
 
-void
+unsigned
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
+	unsigned ticket;
 	int n;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
+	ticket = ++target->c_shootdown_sent;
+
 	n = target->c_numshootdown;
 	if (n == TLBSHOOTDOWN_MAX) {
 		target->c_numshootdown = TLBSHOOTDOWN_ALL;
@@ -1186,6 +1489,28 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	mainbus_send_ipi(target);
 
 	spinlock_release(&target->c_ipi_lock);
+
+	return ticket;
+}
+
+/*
+ * Wait until TARGET has processed the shootdown that
+ * ipi_tlbshootdown handed back TICKET for. This spins (with
+ * interrupts on, so we keep answering other cpus' IPIs meanwhile);
+ * shootdowns are handled at interrupt time and do not take long.
+ */
+void
+ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket)
+{
+	bool done;
+
+	KASSERT(curcpu->c_spinlocks == 0);
+
+	do {
+		spinlock_acquire(&target->c_ipi_lock);
+		done = (int)(target->c_shootdown_done - ticket) >= 0;
+		spinlock_release(&target->c_ipi_lock);
+	} while (!done);
 }
 
 void
@@ -1230,8 +1555,14 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_done = curcpu->c_shootdown_sent;
 	}
 
 	curcpu->c_ipi_pending = 0;
 	spinlock_release(&curcpu->c_ipi_lock);
+
+	/* This takes the coremap lock, so not with the IPI lock held */
+	if (bits & (1U << IPI_PAGECACHE)) {
+		vm_pagecache_flush();
+	}
 }
@@ -237,15 +237,16 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. Mapped pages are read and written with VOP_READ and
+ * VOP_WRITE at page-aligned offsets, which makes no sense for most
+ * devices, so none can be mapped for now.
  */
 static
 int
 dev_mmap(struct vnode *v  /* add stuff as needed */)
 {
 	(void)v;
-	return ENOSYS;
+	return ENODEV;
 }
 
 /*
@@ -339,6 +340,7 @@ static const struct vnode_ops dev_vnode_ops = {
 	.vop_mmap = dev_mmap,
 	.vop_truncate = dev_truncate,
 	.vop_namefile = dev_namefile,
+	.vop_readahead = vopnull_readahead,
 	.vop_creat = vopfail_creat_notdir,
 	.vop_symlink = vopfail_symlink_notdir,
 	.vop_mkdir = vopfail_mkdir_notdir,
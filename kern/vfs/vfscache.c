@@ -0,0 +1,252 @@
+/*
+ * Name lookup cache.
+ *
+ * vfs_lookup remembers what VOP_LOOKUP returned for a (directory,
+ * path) pair: the vnode, or that there was no such file. A path
+ * looked up again is then answered without going to the filesystem,
+ * and so without reading any directory blocks. Each entry holds a
+ * reference to both vnodes, so neither can be reclaimed and have its
+ * address reused while the entry exists.
+ *
+ * The path is whatever VOP_LOOKUP was given, which may have several
+ * components (emufs resolves a whole path at once), so a change to
+ * one directory can make entries for other directories wrong. The
+ * VFS calls only know the directory and last name that changed, so
+ * invalidation is per filesystem: creating a name throws away that
+ * filesystem's negative entries, and removing or renaming one throws
+ * away all of its entries. Changes are much rarer than lookups.
+ *
+ * A lookup that misses notes vfs_dcache_gen, and its result is only
+ * entered if nothing was invalidated in the meantime; otherwise a
+ * lookup racing with a create could leave a stale negative entry.
+ *
+ * Everything is protected by vfs_dcache_lock. Vnode references are
+ * only dropped after letting go of it, since that may reclaim.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <limits.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vfs.h>
+#include <vnode.h>
+
+#define VFS_DCACHE_MAX  256             /* entries */
+#define VFS_DCACHE_HASH 64              /* hash buckets; a power of 2 */
+
+struct dcentry {
+        struct vnode *dc_dir;           /* directory looked in */
+        char *dc_name;                  /* path looked up */
+        struct vnode *dc_vn;            /* what it was, or NULL if none */
+        struct dcentry *dc_hashnext;    /* hash chain */
+        struct dcentry *dc_lrunext;     /* LRU list, oldest first */
+        struct dcentry *dc_lruprev;
+};
+
+static struct spinlock vfs_dcache_lock = SPINLOCK_INITIALIZER;
+static struct dcentry *vfs_dcache_hash[VFS_DCACHE_HASH];
+static struct dcentry *vfs_dcache_lru_head, *vfs_dcache_lru_tail;
+static unsigned vfs_dcache_num;
+static unsigned vfs_dcache_gen;
+
+static
+unsigned
+vfs_dcache_hashfn(struct vnode *dir, const char *name)
+{
+        unsigned h;
+
+        h = (uintptr_t)dir >> 4;
+        for (; *name != 0; name++) {
+                h = h * 33 + (unsigned char)*name;
+        }
+        return h & (VFS_DCACHE_HASH - 1);
+}
+
+static
+void
+vfs_dcache_lru_remove(struct dcentry *dc)
+{
+        if (dc->dc_lruprev != NULL) {
+                dc->dc_lruprev->dc_lrunext = dc->dc_lrunext;
+        }
+        else {
+                vfs_dcache_lru_head = dc->dc_lrunext;
+        }
+        if (dc->dc_lrunext != NULL) {
+                dc->dc_lrunext->dc_lruprev = dc->dc_lruprev;
+        }
+        else {
+                vfs_dcache_lru_tail = dc->dc_lruprev;
+        }
+}
+
+static
+void
+vfs_dcache_lru_append(struct dcentry *dc)
+{
+        dc->dc_lrunext = NULL;
+        dc->dc_lruprev = vfs_dcache_lru_tail;
+        if (vfs_dcache_lru_tail != NULL) {
+                vfs_dcache_lru_tail->dc_lrunext = dc;
+        }
+        else {
+                vfs_dcache_lru_head = dc;
+        }
+        vfs_dcache_lru_tail = dc;
+}
+
+/*
+ * Take an entry out of the cache. The caller destroys it once the
+ * lock is released.
+ */
+static
+void
+vfs_dcache_unlink(struct dcentry *dc)
+{
+        struct dcentry **p;
+
+        KASSERT(spinlock_do_i_hold(&vfs_dcache_lock));
+
+        p = &vfs_dcache_hash[vfs_dcache_hashfn(dc->dc_dir, dc->dc_name)];
+        while (*p != dc) {
+                KASSERT(*p != NULL);
+                p = &(*p)->dc_hashnext;
+        }
+        *p = dc->dc_hashnext;
+        vfs_dcache_lru_remove(dc);
+        vfs_dcache_num--;
+}
+
+static
+void
+vfs_dcache_destroy(struct dcentry *dc)
+{
+        VOP_DECREF(dc->dc_dir);
+        if (dc->dc_vn != NULL) {
+                VOP_DECREF(dc->dc_vn);
+        }
+        kfree(dc->dc_name);
+        kfree(dc);
+}
+
+static
+struct dcentry *
+vfs_dcache_find(struct vnode *dir, const char *name)
+{
+        struct dcentry *dc;
+
+        KASSERT(spinlock_do_i_hold(&vfs_dcache_lock));
+
+        for (dc = vfs_dcache_hash[vfs_dcache_hashfn(dir, name)]; dc != NULL;
+             dc = dc->dc_hashnext) {
+                if (dc->dc_dir == dir && !strcmp(dc->dc_name, name)) {
+                        return dc;
+                }
+        }
+        return NULL;
+}
+
+bool
+vfs_dcache_lookup(struct vnode *dir, const char *name, struct vnode **ret,
+                  unsigned *gen)
+{
+        struct dcentry *dc;
+
+        spinlock_acquire(&vfs_dcache_lock);
+        dc = vfs_dcache_find(dir, name);
+        if (dc == NULL) {
+                *gen = vfs_dcache_gen;
+                spinlock_release(&vfs_dcache_lock);
+                return false;
+        }
+
+        /* Move it to the young end */
+        vfs_dcache_lru_remove(dc);
+        vfs_dcache_lru_append(dc);
+
+        if (dc->dc_vn != NULL) {
+                VOP_INCREF(dc->dc_vn);
+        }
+        *ret = dc->dc_vn;
+        spinlock_release(&vfs_dcache_lock);
+        return true;
+}
+
+void
+vfs_dcache_enter(struct vnode *dir, const char *name, struct vnode *vn,
+                 unsigned gen)
+{
+        struct dcentry *dc, *old;
+        unsigned h;
+
+        if (dir->vn_fs == NULL || strlen(name) > NAME_MAX) {
+                return;
+        }
+
+        dc = kmalloc(sizeof(*dc));
+        if (dc == NULL) {
+                return;
+        }
+        dc->dc_name = kstrdup(name);
+        if (dc->dc_name == NULL) {
+                kfree(dc);
+                return;
+        }
+        VOP_INCREF(dir);
+        dc->dc_dir = dir;
+        if (vn != NULL) {
+                VOP_INCREF(vn);
+        }
+        dc->dc_vn = vn;
+
+        old = NULL;
+        spinlock_acquire(&vfs_dcache_lock);
+        if (gen != vfs_dcache_gen || vfs_dcache_find(dir, name) != NULL) {
+                /* Invalidated since, or entered by someone else */
+                spinlock_release(&vfs_dcache_lock);
+                vfs_dcache_destroy(dc);
+                return;
+        }
+        h = vfs_dcache_hashfn(dir, name);
+        dc->dc_hashnext = vfs_dcache_hash[h];
+        vfs_dcache_hash[h] = dc;
+        vfs_dcache_lru_append(dc);
+        vfs_dcache_num++;
+
+        if (vfs_dcache_num > VFS_DCACHE_MAX) {
+                old = vfs_dcache_lru_head;
+                vfs_dcache_unlink(old);
+        }
+        spinlock_release(&vfs_dcache_lock);
+
+        if (old != NULL) {
+                vfs_dcache_destroy(old);
+        }
+}
+
+void
+vfs_dcache_purge(struct fs *fs, bool negonly)
+{
+        struct dcentry *dc, *next, *victims;
+
+        /* Collect them on a private list, chained through dc_hashnext */
+        victims = NULL;
+        spinlock_acquire(&vfs_dcache_lock);
+        vfs_dcache_gen++;
+        for (dc = vfs_dcache_lru_head; dc != NULL; dc = next) {
+                next = dc->dc_lrunext;
+                if (dc->dc_dir->vn_fs != fs ||
+                    (negonly && dc->dc_vn != NULL)) {
+                        continue;
+                }
+                vfs_dcache_unlink(dc);
+                dc->dc_hashnext = victims;
+                victims = dc;
+        }
+        spinlock_release(&vfs_dcache_lock);
+
+        for (dc = victims; dc != NULL; dc = next) {
+                next = dc->dc_hashnext;
+                vfs_dcache_destroy(dc);
+        }
+}
@@ -114,6 +114,18 @@ vopfail_truncate_isdir(struct vnode *vn, off_t pos)
 	return EISDIR;
 }
 
+////////////////////////////////////////////////////////////
+// readahead (only a hint, so by default it is ignored)
+
+int
+vopnull_readahead(struct vnode *vn, off_t pos, off_t len)
+{
+	(void)vn;
+	(void)pos;
+	(void)len;
+	return 0;
+}
+
 ////////////////////////////////////////////////////////////
 // creat
 
@@ -39,6 +39,8 @@
 #include <lib.h>
 #include <array.h>
 #include <synch.h>
+#include <clock.h>
+#include <thread.h>
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
@@ -87,6 +89,22 @@ DEFARRAY(knowndev, static __UNUSED inline);
 
 static struct knowndevarray *knowndevs;
 
+/*
+ * Lock for knowndevs and the devices in it. Looking up a device takes
+ * it for reading, so lookups on different CPUs run in parallel;
+ * adding, mounting, and unmounting take it for writing. It comes
+ * before vfs_biglock.
+ */
+static struct rwlock *knowndevs_lock;
+
+/*
+ * Held by vfs_sync while it syncs filesystems it found in knowndevs
+ * without holding knowndevs_lock; unmounting takes it first so that
+ * those filesystems don't go away underneath it. It comes before
+ * knowndevs_lock.
+ */
+static struct lock *vfs_synclock;
+
 /* The big lock for all FS ops. Remove for filesystem assignment. */
 static struct lock *vfs_biglock;
 static unsigned vfs_biglock_depth;
@@ -103,6 +121,16 @@ vfs_bootstrap(void)
 		panic("vfs: Could not create knowndevs array\n");
 	}
 
+	knowndevs_lock = rwlock_create("knowndevs");
+	if (knowndevs_lock==NULL) {
+		panic("vfs: Could not create knowndevs lock\n");
+	}
+
+	vfs_synclock = lock_create("vfs_synclock");
+	if (vfs_synclock==NULL) {
+		panic("vfs: Could not create sync lock\n");
+	}
+
 	vfs_biglock = lock_create("vfs_biglock");
 	if (vfs_biglock==NULL) {
 		panic("vfs: Could not create vfs big lock\n");
@@ -148,40 +176,100 @@ vfs_biglock_do_i_hold(void)
 
 /*
  * Global sync function - call FSOP_SYNC on all devices.
+ *
+ * The mounted filesystems are collected under knowndevs_lock, which
+ * is then let go so that lookups and mounts don't wait for the disk.
  */
 int
 vfs_sync(void)
 {
 	struct knowndev *dev;
-	unsigned i, num;
+	struct fs **fses;
+	unsigned i, num, nfs;
 
-	vfs_biglock_acquire();
+	lock_acquire(vfs_synclock);
 
+	rwlock_acquire_read(knowndevs_lock);
 	num = knowndevarray_num(knowndevs);
+	fses = kmalloc((num + 1) * sizeof(*fses));	/* never size 0 */
+	if (fses == NULL) {
+		/* Do it the slow way */
+		vfs_biglock_acquire();
+		for (i=0; i<num; i++) {
+			dev = knowndevarray_get(knowndevs, i);
+			if (dev->kd_fs != NULL) {
+				/*result =*/ FSOP_SYNC(dev->kd_fs);
+			}
+		}
+		vfs_biglock_release();
+		rwlock_release_read(knowndevs_lock);
+		lock_release(vfs_synclock);
+		return 0;
+	}
+	nfs = 0;
 	for (i=0; i<num; i++) {
 		dev = knowndevarray_get(knowndevs, i);
 		if (dev->kd_fs != NULL) {
-			/*result =*/ FSOP_SYNC(dev->kd_fs);
+			fses[nfs++] = dev->kd_fs;
 		}
 	}
+	rwlock_release_read(knowndevs_lock);
 
+	vfs_biglock_acquire();
+	for (i=0; i<nfs; i++) {
+		/*result =*/ FSOP_SYNC(fses[i]);
+	}
 	vfs_biglock_release();
 
+	lock_release(vfs_synclock);
+	kfree(fses);
+
 	return 0;
 }
 
+/*
+ * The sync thread. Filesystems hold on to their writes (see
+ * sfs_buf.c), so this writes back whatever has piled up every
+ * VFS_SYNCINTERVAL seconds. clocksleep is woken from timerclock.
+ */
+#define VFS_SYNCINTERVAL 5
+
+static
+void
+vfs_syncer(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		clocksleep(VFS_SYNCINTERVAL);
+		vfs_sync();
+	}
+}
+
+void
+vfs_syncer_bootstrap(void)
+{
+	int result;
+
+	result = thread_fork("syncer", NULL, vfs_syncer, NULL, 0);
+	if (result) {
+		panic("vfs: Could not start sync thread: %s\n",
+		      strerror(result));
+	}
+}
+
 /*
  * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
  * back an appropriate vnode.
  */
+static
 int
-vfs_getroot(const char *devname, struct vnode **ret)
+vfs_dogetroot(const char *devname, struct vnode **ret)
 {
 	struct knowndev *kd;
 	unsigned i, num;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		kd = knowndevarray_get(knowndevs, i);
@@ -250,6 +338,17 @@ vfs_getroot(const char *devname, struct vnode **ret)
 	return ENODEV;
 }
 
+int
+vfs_getroot(const char *devname, struct vnode **ret)
+{
+	int result;
+
+	rwlock_acquire_read(knowndevs_lock);
+	result = vfs_dogetroot(devname, ret);
+	rwlock_release_read(knowndevs_lock);
+	return result;
+}
+
 /*
  * Given a filesystem, hand back the name of the device it's mounted on.
  */
@@ -257,12 +356,13 @@ const char *
 vfs_getdevname(struct fs *fs)
 {
 	struct knowndev *kd;
+	const char *name;
 	unsigned i, num;
 
 	KASSERT(fs != NULL);
 
-	KASSERT(vfs_biglock_do_i_hold());
-
+	name = NULL;
+	rwlock_acquire_read(knowndevs_lock);
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
 		kd = knowndevarray_get(knowndevs, i);
@@ -274,11 +374,13 @@ vfs_getdevname(struct fs *fs)
 			 * the fs cannot go away, and the device can't
 			 * go away until the fs goes away.
 			 */
-			return kd->kd_name;
+			name = kd->kd_name;
+			break;
 		}
 	}
+	rwlock_release_read(knowndevs_lock);
 
-	return NULL;
+	return name;
 }
 
 /*
@@ -338,7 +440,7 @@ badnames(const char *n1, const char *n2, const char *n3)
 	unsigned i, num;
 	struct knowndev *kd;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(rwlock_do_i_hold_write(knowndevs_lock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; i<num; i++) {
@@ -378,7 +480,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	unsigned index;
 	int result;
 
-	vfs_biglock_acquire();
+	rwlock_acquire_write(knowndevs_lock);
 
 	name = kstrdup(dname);
 	if (name==NULL) {
@@ -412,7 +514,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	}
 
 	if (badnames(name, rawname, volname)) {
-		vfs_biglock_release();
+		rwlock_release_write(knowndevs_lock);
 		return EEXIST;
 	}
 
@@ -423,7 +525,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		dev->d_devnumber = index+1;
 	}
 
-	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return result;
 
  nomem:
@@ -441,7 +543,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 		kfree(kd);
 	}
 
-	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return ENOMEM;
 }
 
@@ -480,7 +582,7 @@ findmount(const char *devname, struct knowndev **result)
 	unsigned i, num;
 	bool found = false;
 
-	KASSERT(vfs_biglock_do_i_hold());
+	KASSERT(rwlock_do_i_hold_write(knowndevs_lock));
 
 	num = knowndevarray_num(knowndevs);
 	for (i=0; !found && i<num; i++) {
@@ -514,16 +616,19 @@ vfs_mount(const char *devname, void *data,
 	struct fs *fs;
 	int result;
 
+	rwlock_acquire_write(knowndevs_lock);
 	vfs_biglock_acquire();
 
 	result = findmount(devname, &kd);
 	if (result) {
 		vfs_biglock_release();
+		rwlock_release_write(knowndevs_lock);
 		return result;
 	}
 
 	if (kd->kd_fs != NULL) {
 		vfs_biglock_release();
+		rwlock_release_write(knowndevs_lock);
 		return EBUSY;
 	}
 	KASSERT(kd->kd_rawname != NULL);
@@ -532,6 +637,7 @@ vfs_mount(const char *devname, void *data,
 	result = mountfunc(data, kd->kd_device, &fs);
 	if (result) {
 		vfs_biglock_release();
+		rwlock_release_write(knowndevs_lock);
 		return result;
 	}
 
@@ -544,6 +650,7 @@ vfs_mount(const char *devname, void *data,
 		volname ? volname : kd->kd_name, kd->kd_name);
 
 	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
 	return 0;
 }
 
@@ -557,6 +664,8 @@ vfs_unmount(const char *devname)
 	struct knowndev *kd;
 	int result;
 
+	lock_acquire(vfs_synclock);
+	rwlock_acquire_write(knowndevs_lock);
 	vfs_biglock_acquire();
 
 	result = findmount(devname, &kd);
@@ -571,6 +680,9 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/* the name cache holds vnodes of it */
+	vfs_dcache_purge(kd->kd_fs, false);
+
 	/* sync the fs */
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
@@ -591,6 +703,8 @@ vfs_unmount(const char *devname)
 
  fail:
 	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
+	lock_release(vfs_synclock);
 	return result;
 }
 
@@ -604,6 +718,8 @@ vfs_unmountall(void)
 	unsigned i, num;
 	int result;
 
+	lock_acquire(vfs_synclock);
+	rwlock_acquire_write(knowndevs_lock);
 	vfs_biglock_acquire();
 
 	num = knowndevarray_num(knowndevs);
@@ -620,6 +736,8 @@ vfs_unmountall(void)
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
+		vfs_dcache_purge(dev->kd_fs, false);
+
 		result = FSOP_SYNC(dev->kd_fs);
 		if (result) {
 			kprintf("vfs: Warning: sync failed for %s: %s, trying "
@@ -656,6 +774,8 @@ vfs_unmountall(void)
 	}
 
 	vfs_biglock_release();
+	rwlock_release_write(knowndevs_lock);
+	lock_release(vfs_synclock);
 
 	return 0;
 }
@@ -35,12 +35,13 @@
 #include <kern/errno.h>
 #include <limits.h>
 #include <lib.h>
-#include <synch.h>
+#include <spinlock.h>
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
 
 static struct vnode *bootfs_vnode = NULL;
+static struct spinlock bootfs_lock = SPINLOCK_INITIALIZER;
 
 /*
  * Helper function for actually changing bootfs_vnode.
@@ -51,8 +52,10 @@ change_bootfs(struct vnode *newvn)
 {
 	struct vnode *oldvn;
 
+	spinlock_acquire(&bootfs_lock);
 	oldvn = bootfs_vnode;
 	bootfs_vnode = newvn;
+	spinlock_release(&bootfs_lock);
 
 	if (oldvn != NULL) {
 		VOP_DECREF(oldvn);
@@ -75,14 +78,11 @@ vfs_setbootfs(const char *fsname)
 	int result;
 	struct vnode *newguy;
 
-	vfs_biglock_acquire();
-
 	snprintf(tmp, sizeof(tmp)-1, "%s", fsname);
 	s = strchr(tmp, ':');
 	if (s) {
 		/* If there's a colon, it must be at the end */
 		if (strlen(s)>0) {
-			vfs_biglock_release();
 			return EINVAL;
 		}
 	}
@@ -92,19 +92,16 @@ vfs_setbootfs(const char *fsname)
 
 	result = vfs_chdir(tmp);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	result = vfs_getcurdir(&newguy);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	change_bootfs(newguy);
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -114,15 +111,16 @@ vfs_setbootfs(const char *fsname)
 void
 vfs_clearbootfs(void)
 {
-	vfs_biglock_acquire();
 	change_bootfs(NULL);
-	vfs_biglock_release();
 }
 
 
 /*
  * Common code to pull the device name, if any, off the front of a
  * path and choose the vnode to begin the name lookup relative to.
+ *
+ * This needs no big lock: vfs_getroot locks the device table for
+ * reading, and the filesystems lock themselves.
  */
 
 static
@@ -133,8 +131,6 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	struct vnode *vn;
 	int result;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	/*
 	 * Locate the first colon or slash.
 	 */
@@ -188,11 +184,14 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 	KASSERT(colon==0 || slash==0);
 
 	if (path[0]=='/') {
+		spinlock_acquire(&bootfs_lock);
 		if (bootfs_vnode==NULL) {
+			spinlock_release(&bootfs_lock);
 			return ENOENT;
 		}
 		VOP_INCREF(bootfs_vnode);
 		*startvn = bootfs_vnode;
+		spinlock_release(&bootfs_lock);
 	}
 	else {
 		KASSERT(path[0]==':');
@@ -239,11 +238,8 @@ vfs_lookparent(char *path, struct vnode **retval,
 	struct vnode *startvn;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -261,7 +257,6 @@ vfs_lookparent(char *path, struct vnode **retval,
 
 	VOP_DECREF(startvn);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -269,25 +264,37 @@ int
 vfs_lookup(char *path, struct vnode **retval)
 {
 	struct vnode *startvn;
+	char *name;
+	unsigned gen;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = getdevice(path, &path, &startvn);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (strlen(path)==0) {
 		*retval = startvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
+	if (vfs_dcache_lookup(startvn, path, retval, &gen)) {
+		result = *retval == NULL ? ENOENT : 0;
+		VOP_DECREF(startvn);
+		return result;
+	}
+
+	/* VOP_LOOKUP may destroy the path, so save it for the cache */
+	name = kstrdup(path);
+
 	result = VOP_LOOKUP(startvn, path, retval);
 
+	if (name != NULL && (result == 0 || result == ENOENT)) {
+		vfs_dcache_enter(startvn, name,
+				 result == 0 ? *retval : NULL, gen);
+	}
+	kfree(name);
+
 	VOP_DECREF(startvn);
-	vfs_biglock_release();
 	return result;
 }
@@ -52,6 +52,7 @@ vnode_init(struct vnode *vn, const struct vnode_ops *ops,
 	spinlock_init(&vn->vn_countlock);
 	vn->vn_fs = fs;
 	vn->vn_data = fsdata;
+	vn->vn_mobj = NULL;
 	return 0;
 }
 
@@ -62,6 +63,7 @@ void
 vnode_cleanup(struct vnode *vn)
 {
 	KASSERT(vn->vn_refcount == 1);
+	KASSERT(vn->vn_mobj == NULL);
 
 	spinlock_cleanup(&vn->vn_countlock);
 
@@ -129,8 +131,6 @@ vnode_decref(struct vnode *vn)
 void
 vnode_check(struct vnode *v, const char *opstr)
 {
-	vfs_biglock_acquire();
-
 	if (v == NULL) {
 		panic("vnode_check: vop_%s: null vnode\n", opstr);
 	}
@@ -173,5 +173,4 @@ vnode_check(struct vnode *v, const char *opstr)
 	}
 
 	spinlock_release(&v->vn_countlock);
-	vfs_biglock_release();
 }
@@ -27,6 +27,8 @@
  * SUCH DAMAGE.
  */
 
+#define ADDRSPACEINLINE
+
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
@@ -37,9 +39,8 @@
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
-#include <coremap.h>
-
-#define DUMBVM_STACKPAGES    18
+#include <pagetable.h>
+#include <vmobject.h>
 
 struct addrspace *
 as_create(void)
@@ -49,19 +50,17 @@ as_create(void)
 		return NULL;
 	}
 
-        /*
-	as->as_vbase1 = 0;
-	as->as_pbase1 = 0;
-	as->as_npages1 = 0;
-        as->as_perm1 = 0;
-        as->as_tmp_perm1 = 0;
-	as->as_vbase2 = 0;
-	as->as_pbase2 = 0;
-	as->as_npages2 = 0;
-        as->as_perm2 = 0;
-        as->as_tmp_perm2 = 0;
-        */
-	as->as_stackpbase = 0;
+        as->as_pt = pt_create();
+        if (as->as_pt == NULL) {
+                kfree(as);
+                return NULL;
+        }
+        regionarray_init(&as->as_regions);
+        as->as_heap.rg_vbase = 0;
+        as->as_heap.rg_npages = 0;
+        as->as_heap.rg_perm = VM_R | VM_W;
+        as->as_heapend = 0;
+        as->as_loading = false;
 
 	return as;
 }
@@ -69,20 +68,29 @@ as_create(void)
 void
 as_destroy(struct addrspace *as)
 {
-        //free_kpages(PADDR_TO_KVADDR(as->as_pbase1));
-        //free_kpages(PADDR_TO_KVADDR(as->as_pbase2));
-        int len = (int) as->nsegs;
-        for (int i = 0; i < len; i++) {
-                free_kpages(PADDR_TO_KVADDR(as->page_table[i].paddr));
+        struct region *rg;
+        unsigned i, num;
+
+        /* Unmap the pages before letting go of the files behind them */
+        pt_destroy(as->as_pt);
+
+        num = regionarray_num(&as->as_regions);
+        for (i = 0; i < num; i++) {
+                rg = regionarray_get(&as->as_regions, i);
+                if (rg->rg_obj != NULL) {
+                        vmobject_decref(rg->rg_obj);
+                }
+                kfree(rg);
         }
-        free_kpages(PADDR_TO_KVADDR(as->as_stackpbase));
+        regionarray_setsize(&as->as_regions, 0);
+        regionarray_cleanup(&as->as_regions);
+
 	kfree(as);
 }
 
 void
 as_activate(void)
 {
-	int i, spl;
 	struct addrspace *as;
 
 	as = proc_getas();
@@ -90,14 +98,8 @@ as_activate(void)
 		return;
 	}
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-
-	splx(spl);
+	/* Flushes the TLB, unless it still holds only our translations */
+	vm_tlbactivate(as->as_pt);
 }
 
 void
@@ -106,6 +108,71 @@ as_deactivate(void)
 	/* nothing */
 }
 
+/*
+ * Add an anonymous region to the address space. No memory is
+ * allocated for it here; pages are filled in on demand by vm_fault.
+ * The new region is handed back in RET, if that isn't NULL, for the
+ * caller to fill in further.
+ */
+static
+int
+as_addregion(struct addrspace *as, vaddr_t vaddr, size_t npages, int perm,
+             struct region **ret)
+{
+        struct region *rg;
+        int result;
+
+        rg = kmalloc(sizeof(struct region));
+        if (rg == NULL) {
+                return ENOMEM;
+        }
+        rg->rg_vbase = vaddr;
+        rg->rg_npages = npages;
+        rg->rg_perm = perm;
+        rg->rg_obj = NULL;
+        rg->rg_offset = 0;
+        rg->rg_filesz = 0;
+        rg->rg_shared = false;
+        rg->rg_mmap = false;
+
+        result = regionarray_add(&as->as_regions, rg, NULL);
+        if (result) {
+                kfree(rg);
+                return result;
+        }
+
+        if (ret != NULL) {
+                *ret = rg;
+        }
+        return 0;
+}
+
+/*
+ * Check whether any page in the NPAGES pages at VADDR is part of some
+ * region (or the heap).
+ */
+static
+bool
+as_overlaps(struct addrspace *as, vaddr_t vaddr, size_t npages)
+{
+        struct region *rg;
+        vaddr_t end = vaddr + npages * PAGE_SIZE;
+        unsigned i, num;
+
+        num = regionarray_num(&as->as_regions);
+        for (i = 0; i < num; i++) {
+                rg = regionarray_get(&as->as_regions, i);
+                if (vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE &&
+                    rg->rg_vbase < end) {
+                        return true;
+                }
+        }
+
+        rg = &as->as_heap;
+        return vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE &&
+                rg->rg_vbase < end;
+}
+
 int
 as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 		 int readable, int writeable, int executable)
@@ -121,90 +188,69 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 
 	npages = sz / PAGE_SIZE;
 
-	/* We don't use these - all pages are read-write */
-        /*
-
-	if (as->as_vbase1 == 0) {
-		as->as_vbase1 = vaddr;
-		as->as_npages1 = npages;
-                as->as_tmp_perm1 = readable | writeable | executable;
-		return 0;
-	}
-
-	if (as->as_vbase2 == 0) {
-		as->as_vbase2 = vaddr;
-		as->as_npages2 = npages;
-                as->as_tmp_perm2 = readable | writeable | executable;
-		return 0;
-	}
-        */
-        as->page_table[as->nsegs].vaddr = vaddr;
-        as->page_table[as->nsegs].t_perm = 
-                readable | writeable | executable;
-        as->page_table[as->nsegs].chunksize = npages;
-
-        as->nsegs++;
-
-	/*
-	 * Support for more than two regions is not available.
-	 */
-	//kprintf("dumbvm: Warning: too many regions\n");
-	return 0;
-}
+        /* Refuse regions that run into kernel space */
+        if (vaddr + sz > USERSPACETOP || vaddr + sz < vaddr) {
+                return EFAULT;
+        }
 
-static
-void
-as_zero_region(paddr_t paddr, unsigned npages)
-{
-	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
+        return as_addregion(as, vaddr, npages,
+                            readable | writeable | executable, NULL);
 }
 
 int
-as_prepare_load(struct addrspace *as)
+as_define_filesegment(struct addrspace *as, vaddr_t vaddr, size_t memsz,
+                      struct vnode *vn, off_t offset, size_t filesz,
+                      int readable, int writeable, int executable)
 {
-        /*
-	KASSERT(as->as_pbase1 == 0);
-	KASSERT(as->as_pbase2 == 0);
-	KASSERT(as->as_stackpbase == 0);
-
-        
-	as->as_pbase1 = getppages(as->as_npages1);
-	if (as->as_pbase1 == 0) {
-		return ENOMEM;
-	}
+        struct vmobject *obj;
+        struct region *rg;
+        size_t lead, npages;
+        int result;
+
+        lead = vaddr & ~(vaddr_t)PAGE_FRAME;
+        KASSERT(offset % PAGE_SIZE == (off_t)lead);
+        KASSERT(filesz <= memsz);
+
+        npages = (lead + memsz + PAGE_SIZE - 1) / PAGE_SIZE;
+        vaddr -= lead;
+        if (vaddr + npages * PAGE_SIZE > USERSPACETOP ||
+            vaddr + npages * PAGE_SIZE < vaddr) {
+                return EFAULT;
+        }
 
-	as->as_pbase2 = getppages(as->as_npages2);
-	if (as->as_pbase2 == 0) {
-		return ENOMEM;
-	}
+        result = vmobject_get(vn, &obj);
+        if (result) {
+                return result;
+        }
 
-	as->as_stackpbase = getppages(DUMBVM_STACKPAGES);
-	if (as->as_stackpbase == 0) {
-		return ENOMEM;
-	}
+        result = as_addregion(as, vaddr, npages,
+                              readable | writeable | executable, &rg);
+        if (result) {
+                vmobject_decref(obj);
+                return result;
+        }
 
-	as_zero_region(as->as_pbase1, as->as_npages1);
-	as_zero_region(as->as_pbase2, as->as_npages2);
-	as_zero_region(as->as_stackpbase, DUMBVM_STACKPAGES);
-        */
+        /*
+         * Private, so that writes (to data, or by the debugger) make
+         * copies. The bytes of the first page before the segment come
+         * from the file too, like everything else in the page.
+         */
+        rg->rg_obj = obj;
+        rg->rg_offset = offset - lead;
+        rg->rg_filesz = lead + filesz;
 
-        int len = (int) as->nsegs;
-        for(int i = 0; i < len; i++) {
-                as->page_table[i].paddr = 
-                        getppages(as->page_table[i].chunksize);
-                if (as->page_table[i].paddr == 0) {
-                        return ENOMEM;
-                }
-                as_zero_region(as->page_table[i].paddr,
-                               as->page_table[i].chunksize);
-        }
-        
+        return 0;
+}
 
-	as->as_stackpbase = getppages(DUMBVM_STACKPAGES);
-	if (as->as_stackpbase == 0) {
-		return ENOMEM;
-	}
-	as_zero_region(as->as_stackpbase, DUMBVM_STACKPAGES);
+int
+as_prepare_load(struct addrspace *as)
+{
+        /*
+         * Nothing to allocate: every page is filled in on first
+         * touch. Just let the loader write to read-only segments
+         * until as_complete_load.
+         */
+        as->as_loading = true;
 
 	return 0;
 }
@@ -212,22 +258,45 @@ as_prepare_load(struct addrspace *as)
 int
 as_complete_load(struct addrspace *as)
 {
-        /*
-	as->as_perm1 = as->as_tmp_perm1;
-        as->as_perm2 = as->as_tmp_perm2;
-        */
-        /* Set the permissions of a segments pages */
-        int len = (int) as->nsegs;
-        for (int i = 0; i < len; i++) {
-                as->page_table[i].p_perm = as->page_table[i].t_perm;
+        struct region *rg;
+        vaddr_t end;
+        unsigned i, num;
+
+        as->as_loading = false;
+
+        /* The heap starts out empty, just past the highest segment */
+        end = 0;
+        num = regionarray_num(&as->as_regions);
+        for (i = 0; i < num; i++) {
+                rg = regionarray_get(&as->as_regions, i);
+                if (rg->rg_vbase + rg->rg_npages * PAGE_SIZE > end) {
+                        end = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+                }
         }
+        as->as_heap.rg_vbase = end;
+        as->as_heap.rg_npages = 0;
+        as->as_heapend = end;
+
+        /*
+         * Text pages were mapped writeable while they were loaded;
+         * flush them so the next access picks up the real
+         * permissions.
+         */
+        vm_tlbflush();
+
 	return 0;
 }
 
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	KASSERT(as->as_stackpbase != 0);
+        int result;
+
+        result = as_addregion(as, USERSTACK - VM_STACKPAGES * PAGE_SIZE,
+                              VM_STACKPAGES, VM_R | VM_W, NULL);
+        if (result) {
+                return result;
+        }
 
 	*stackptr = USERSTACK;
 	return 0;
@@ -237,56 +306,297 @@ int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *new;
+        struct region *rg, *newrg;
+        unsigned i, num;
+        int result;
 
 	new = as_create();
 	if (new==NULL) {
 		return ENOMEM;
 	}
 
-        int result = as_init_pagetable(new, old->nsegs);
+        num = regionarray_num(&old->as_regions);
+        for (i = 0; i < num; i++) {
+                rg = regionarray_get(&old->as_regions, i);
+                result = as_addregion(new, rg->rg_vbase, rg->rg_npages,
+                                      rg->rg_perm, &newrg);
+                if (result) {
+                        as_destroy(new);
+                        return result;
+                }
+                *newrg = *rg;
+                if (rg->rg_obj != NULL) {
+                        vmobject_incref(rg->rg_obj);
+                }
+        }
+
+        new->as_heap = old->as_heap;
+        new->as_heapend = old->as_heapend;
+
+        result = pt_copy(old->as_pt, new->as_pt);
+
+        /*
+         * Whatever got shared is now copy-on-write in the parent too,
+         * so drop its TLB entries (which may still allow writes).
+         * Only this cpu can have usable ones; see vm_tlbactivate.
+         */
+        vm_tlbflush();
+
         if (result) {
+                as_destroy(new);
                 return result;
         }
 
-        new->nsegs = old->nsegs;
+	*ret = new;
+	return 0;
+}
 
-        int len = (int) new->nsegs;
-        for (int i = 0; i < len; i++) {
-                new->page_table[i].vaddr = old->page_table[i].vaddr;
-                new->page_table[i].chunksize = 
-                        old->page_table[i].chunksize;
+struct region *
+as_findregion(struct addrspace *as, vaddr_t vaddr)
+{
+        struct region *rg;
+        unsigned i, num;
+
+        num = regionarray_num(&as->as_regions);
+        for (i = 0; i < num; i++) {
+                rg = regionarray_get(&as->as_regions, i);
+                if (vaddr >= rg->rg_vbase &&
+                    vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+                        return rg;
+                }
         }
-        
-	/* (Mis)use as_prepare_load to allocate some physical memory. */
-	if (as_prepare_load(new)) {
-		as_destroy(new);
-		return ENOMEM;
-	}
 
-        for (int i = 0; i < len; i++) {
-                KASSERT(new->page_table[i].paddr != 0);
-                memmove((void *)PADDR_TO_KVADDR(new->page_table[i].paddr),
-                        (const void *)PADDR_TO_KVADDR(old->page_table[i].paddr),
-                        old->page_table[i].chunksize * PAGE_SIZE);
+        rg = &as->as_heap;
+        if (vaddr >= rg->rg_vbase &&
+            vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE) {
+                return rg;
         }
 
-	KASSERT(new->as_stackpbase != 0);
-	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
-		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
-		DUMBVM_STACKPAGES*PAGE_SIZE);
-
-	*ret = new;
-	return 0;
+        return NULL;
 }
 
 int
-as_init_pagetable(struct addrspace *as, uint32_t nsegs) {
-        /* Set nsegs as 0 here so that it can be used as a counter */
-        as->nsegs = 0;
-        as->page_table = kmalloc(nsegs * sizeof(struct pagetable_entry));
-        if (as->page_table == NULL) {
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+        vaddr_t base, newend;
+        size_t npages;
+
+        base = as->as_heap.rg_vbase;
+
+        if (amount < 0) {
+                if ((vaddr_t)-amount > as->as_heapend - base) {
+                        return EINVAL;
+                }
+        }
+        else if (amount > 0) {
+                /* Don't wrap around */
+                if ((vaddr_t)amount > USERSPACETOP - as->as_heapend) {
+                        return ENOMEM;
+                }
+        }
+        newend = as->as_heapend + amount;
+        npages = (ROUNDUP(newend, PAGE_SIZE) - base) / PAGE_SIZE;
+
+        /* Don't run into the stack or a mapping */
+        if (npages > as->as_heap.rg_npages &&
+            as_overlaps(as, base + as->as_heap.rg_npages * PAGE_SIZE,
+                        npages - as->as_heap.rg_npages)) {
                 return ENOMEM;
         }
 
+        if (npages < as->as_heap.rg_npages) {
+                pt_unmap(as->as_pt, base + npages * PAGE_SIZE,
+                         as->as_heap.rg_npages - npages);
+                /* Only this cpu can have entries for them; see vm.c */
+                vm_tlbflush();
+        }
+        as->as_heap.rg_npages = npages;
+
+        *oldbreak = as->as_heapend;
+        as->as_heapend = newend;
+        return 0;
+}
+
+int
+as_mmap(struct addrspace *as, size_t npages, int perm, struct vmobject *obj,
+        off_t offset, bool shared, vaddr_t *ret)
+{
+        struct region *rg;
+        vaddr_t bottom, top, vaddr;
+        unsigned i, num;
+        int result;
+
+        /*
+         * Take the highest free range below the stack: try just
+         * under TOP, and if that hits something, move TOP down to the
+         * bottom of it and try again.
+         */
+        bottom = ROUNDUP(as->as_heapend, PAGE_SIZE);
+        top = USERSTACK - VM_STACKPAGES * PAGE_SIZE;
+        while (1) {
+                if (top < bottom || top - bottom < npages * PAGE_SIZE) {
+                        return ENOMEM;
+                }
+                vaddr = top - npages * PAGE_SIZE;
+                if (!as_overlaps(as, vaddr, npages)) {
+                        break;
+                }
+                num = regionarray_num(&as->as_regions);
+                for (i = 0; i < num; i++) {
+                        rg = regionarray_get(&as->as_regions, i);
+                        if (vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE &&
+                            rg->rg_vbase < top) {
+                                top = rg->rg_vbase;
+                        }
+                }
+        }
+
+        result = as_addregion(as, vaddr, npages, perm, &rg);
+        if (result) {
+                return result;
+        }
+        rg->rg_obj = obj;
+        rg->rg_offset = offset;
+        rg->rg_filesz = npages * PAGE_SIZE;
+        rg->rg_shared = shared;
+        rg->rg_mmap = true;
+
+        *ret = vaddr;
+        return 0;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t npages)
+{
+        struct region *rg, *tail;
+        vaddr_t end, rgend, start, stop;
+        unsigned i, num;
+        int result;
+
+        end = vaddr + npages * PAGE_SIZE;
+
+        /* Check first, so that nothing changes if this fails */
+        num = regionarray_num(&as->as_regions);
+        for (i = 0; i < num; i++) {
+                rg = regionarray_get(&as->as_regions, i);
+                rgend = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+                if (vaddr < rgend && rg->rg_vbase < end && !rg->rg_mmap) {
+                        return EINVAL;
+                }
+        }
+        rg = &as->as_heap;
+        if (vaddr < rg->rg_vbase + rg->rg_npages * PAGE_SIZE &&
+            rg->rg_vbase < end) {
+                return EINVAL;
+        }
+
+        i = 0;
+        while (i < regionarray_num(&as->as_regions)) {
+                rg = regionarray_get(&as->as_regions, i);
+                rgend = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+                if (vaddr >= rgend || rg->rg_vbase >= end) {
+                        i++;
+                        continue;
+                }
+                start = vaddr > rg->rg_vbase ? vaddr : rg->rg_vbase;
+                stop = end < rgend ? end : rgend;
+
+                /* Punching a hole in the middle leaves a new region */
+                if (start > rg->rg_vbase && stop < rgend) {
+                        result = as_addregion(as, stop,
+                                              (rgend - stop) / PAGE_SIZE,
+                                              rg->rg_perm, &tail);
+                        if (result) {
+                                return result;
+                        }
+                        tail->rg_obj = rg->rg_obj;
+                        tail->rg_offset = rg->rg_offset +
+                                (stop - rg->rg_vbase);
+                        tail->rg_filesz = rgend - stop;
+                        tail->rg_shared = rg->rg_shared;
+                        tail->rg_mmap = true;
+                        vmobject_incref(tail->rg_obj);
+                        rgend = stop;
+                }
+
+                pt_unmap(as->as_pt, start, (stop - start) / PAGE_SIZE);
+                vm_tlbflush();
+                if (rg->rg_shared) {
+                        result = vmobject_sync(rg->rg_obj,
+                                (rg->rg_offset + (start - rg->rg_vbase)) /
+                                PAGE_SIZE, (stop - start) / PAGE_SIZE);
+                        if (result) {
+                                kprintf("munmap: writeback failed: %s\n",
+                                        strerror(result));
+                        }
+                }
+
+                if (start == rg->rg_vbase && stop == rgend) {
+                        vmobject_decref(rg->rg_obj);
+                        kfree(rg);
+                        regionarray_remove(&as->as_regions, i);
+                        continue;
+                }
+                if (start == rg->rg_vbase) {
+                        rg->rg_offset += stop - start;
+                        rg->rg_vbase = stop;
+                }
+                rg->rg_npages = (rgend - rg->rg_vbase) / PAGE_SIZE;
+                rg->rg_filesz = rgend - rg->rg_vbase;
+                i++;
+        }
+
         return 0;
 }
+
+int
+as_msync(struct addrspace *as, vaddr_t vaddr, size_t npages)
+{
+        struct region *rg;
+        vaddr_t end, rgend, start, stop;
+        size_t found;
+        unsigned i, num;
+        int result;
+
+        end = vaddr + npages * PAGE_SIZE;
+        found = 0;
+
+        num = regionarray_num(&as->as_regions);
+        for (i = 0; i < num; i++) {
+                rg = regionarray_get(&as->as_regions, i);
+                rgend = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+                if (vaddr >= rgend || rg->rg_vbase >= end) {
+                        continue;
+                }
+                start = vaddr > rg->rg_vbase ? vaddr : rg->rg_vbase;
+                stop = end < rgend ? end : rgend;
+                found += (stop - start) / PAGE_SIZE;
+                if (!rg->rg_shared) {
+                        continue;
+                }
+
+                /*
+                 * Write-protect our own mappings, so the pages can be
+                 * marked clean unless someone else is writing them.
+                 */
+                pt_unwrite(as->as_pt, start, (stop - start) / PAGE_SIZE);
+                vm_tlbflush();
+
+                result = vmobject_sync(rg->rg_obj,
+                        (rg->rg_offset + (start - rg->rg_vbase)) / PAGE_SIZE,
+                        (stop - start) / PAGE_SIZE);
+                if (result) {
+                        return result;
+                }
+        }
+
+        rg = &as->as_heap;
+        rgend = rg->rg_vbase + rg->rg_npages * PAGE_SIZE;
+        if (vaddr < rgend && rg->rg_vbase < end) {
+                start = vaddr > rg->rg_vbase ? vaddr : rg->rg_vbase;
+                stop = end < rgend ? end : rgend;
+                found += (stop - start) / PAGE_SIZE;
+        }
+
+        return found == npages ? 0 : ENOMEM;
+}
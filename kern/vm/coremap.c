@@ -10,6 +10,132 @@
 #include <vm.h>
 #include <coremap.h>
 
+/*
+ * Free frames are kept by a binary buddy allocator. A free block of
+ * order k is 2^k frames long and starts at a frame number that is a
+ * multiple of 2^k; its "buddy" is the block of the same order whose
+ * frame number differs only in bit k. The first frame of each free
+ * block records the block's order and links it into the free list for
+ * that order; every other frame has order -1.
+ *
+ * Separately, single free frames that are known to be zero-filled are
+ * kept in a zero pool (state ZEROED) so that user page allocation
+ * does not have to clear them. The pool is filled from the idle
+ * loop (vm_idlezero in vm.c); freeing a page never zeroes it.
+ *
+ * All of this is protected by the coremap lock in vm.c.
+ */
+static int freelist[COREMAP_NORDERS]; /* First free block of each order */
+static int zeropool;                  /* First frame of the zero pool */
+static int clockhand;                 /* Where the victim search resumes */
+
+/*
+ * Free list manipulation. Both are O(1).
+ */
+static
+void
+freelist_insert(int i, int order)
+{
+        coremap[i].order = order;
+        coremap[i].prev = -1;
+        coremap[i].next = freelist[order];
+        if (freelist[order] >= 0) {
+                coremap[freelist[order]].prev = i;
+        }
+        freelist[order] = i;
+}
+
+static
+void
+freelist_remove(int i)
+{
+        int order = coremap[i].order;
+
+        KASSERT(order >= 0 && order < COREMAP_NORDERS);
+
+        if (coremap[i].prev >= 0) {
+                coremap[coremap[i].prev].next = coremap[i].next;
+        }
+        else {
+                freelist[order] = coremap[i].next;
+        }
+        if (coremap[i].next >= 0) {
+                coremap[coremap[i].next].prev = coremap[i].prev;
+        }
+        coremap[i].order = -1;
+}
+
+/*
+ * Return a free block of 2^ORDER frames starting at frame I, merging
+ * it with its buddy for as long as the buddy is free too.
+ */
+static
+void
+buddy_free(int i, int order)
+{
+        int buddy;
+
+        while (order < COREMAP_NORDERS - 1) {
+                buddy = i ^ (1 << order);
+                if (buddy >= (int) num_total_frames ||
+                    coremap[buddy].state != FREE ||
+                    coremap[buddy].order != order) {
+                        break;
+                }
+                freelist_remove(buddy);
+                if (buddy < i) {
+                        i = buddy;
+                }
+                order++;
+        }
+
+        freelist_insert(i, order);
+}
+
+/*
+ * Give every frame in the zero pool back to the buddy allocator so it
+ * can be coalesced into larger blocks. They stay zeroed, but we stop
+ * keeping track of that.
+ */
+static
+void
+zeropool_flush(void)
+{
+        int i;
+
+        while (zeropool >= 0) {
+                i = zeropool;
+                zeropool = coremap[i].next;
+                coremap[i].state = FREE;
+                num_zeroed_frames--;
+                buddy_free(i, 0);
+        }
+}
+
+/*
+ * Free the NPAGES frames starting at frame I, which need not be a
+ * power of two long, by splitting them into the largest aligned
+ * blocks that fit.
+ */
+static
+void
+buddy_free_range(int i, int npages)
+{
+        int end = i + npages;
+        int order;
+
+        while (i < end) {
+                order = 0;
+                while (order < COREMAP_NORDERS - 1 &&
+                       (i & ((1 << (order + 1)) - 1)) == 0 &&
+                       i + (1 << (order + 1)) <= end) {
+                        order++;
+                }
+                buddy_free(i, order);
+                i += 1 << order;
+        }
+}
+
 void
 coremap_bootstrap(void) {
         // Get the first and last free address
@@ -17,36 +143,30 @@ coremap_bootstrap(void) {
         paddr_t firstpaddr = ram_getfirstfree();
 
         // Align first paddr to a page start (ie. multiple of PAGE_SIZE)
-        int mod = firstpaddr % PAGE_SIZE;
-        if (mod != 0) {
-                firstpaddr += mod;
-        }
+        firstpaddr = ROUNDUP(firstpaddr, PAGE_SIZE);
 
         // Calculate the number of physical frames that are
         // possible
-        int num_phy_frames = lastpaddr >> 12;
+        int num_phy_frames = lastpaddr / PAGE_SIZE;
 
         // Calculate number of physical frames of kernel
-        int num_kernel_frames = firstpaddr >> 12;
+        int num_kernel_frames = firstpaddr / PAGE_SIZE;
 
         // Get the size of a single coremap entry
         size_t coremap_entry_sz = sizeof(struct coremap_entry);
-        
+
         // Total size for coremap
         size_t coremap_total_sz = num_phy_frames * coremap_entry_sz;
 
         // Find the number of physical frames required for coremap
-        mod = coremap_total_sz % PAGE_SIZE;
-        if (mod != 0) {
-                coremap_total_sz += mod;
-        }
+        coremap_total_sz = ROUNDUP(coremap_total_sz, PAGE_SIZE);
         int num_coremap_frames = coremap_total_sz / PAGE_SIZE;
 
         // Total fixed physical frames
         int total_fixed_frames = num_kernel_frames + num_coremap_frames;
 
         num_total_frames = num_phy_frames;
-        num_free_frames  = num_total_frames - total_fixed_frames;
+        num_free_frames  = 0;
         coremap = (struct coremap_entry *) PADDR_TO_KVADDR(firstpaddr);
 
         // Zero out the coremap area
@@ -54,84 +174,270 @@ coremap_bootstrap(void) {
 
         // Initialize the coremap
         for (int i = 0; i < num_phy_frames; i++) {
-                if (i < total_fixed_frames) {
-                        coremap[i].state = FIXED;
-                }
-                else {
-                        coremap[i].state = FREE;
-                }
+                coremap[i].state = i < total_fixed_frames ? FIXED : ALLOCATED;
+                coremap[i].order = -1;
         }
+        for (int k = 0; k < COREMAP_NORDERS; k++) {
+                freelist[k] = -1;
+        }
+        zeropool = -1;
+        num_zeroed_frames = 0;
 
         // First free usable frame is one after the coremap frame
         first_index = total_fixed_frames;
+        clockhand = first_index;
+
+        // Hand everything after the coremap to the buddy allocator
+        for (int i = first_index; i < num_phy_frames; i++) {
+                coremap[i].state = FREE;
+        }
+        buddy_free_range(first_index, num_phy_frames - first_index);
+        num_free_frames = num_phy_frames - first_index;
 }
 
 paddr_t
 coremap_getpages(unsigned long npages)
 {
-        paddr_t ret = 0;
-
-        if (num_free_frames >= npages) {
-                int num_pages = (int) npages;
-                int len = num_total_frames - num_pages + 1; 
-                for (int i = first_index; i < len; i++) {
-                        bool free = true;
-                        // Check if continuous npages are availabe
-                        int j;
-                        for (j = i; j < i + num_pages; j++) {
-                                if (coremap[j].state != FREE) {
-                                        free = false;
-                                        break;
-                                }
-                        }
-                        
-                        if (free) {
-                                // Mark free pages as allocated
-                                for (int j = i; j < i + num_pages; j++) {
-                                        coremap[j].state = ALLOCATED;
-                                }
-
-                                // Store the number of physical frames allocated
-                                coremap[i].chunksize = npages;
-
-                                // Return physical address of starting physical frame
-                                ret = (paddr_t) (i * PAGE_SIZE); 
-
-                                // Decrement the number of free frames
-                                num_free_frames -= num_pages;
-                                break;
-                        }
-                        else {
-                                i = j;
-                        }
+        int order, k, i;
+
+        if (npages == 0 || num_free_frames < npages) {
+                return 0;
+        }
+
+        // Smallest block that holds npages
+        order = 0;
+        while ((1UL << order) < npages) {
+                order++;
+        }
+        if (order >= COREMAP_NORDERS) {
+                return 0;
+        }
+
+        // Find the smallest free block that is big enough
+        for (k = order; k < COREMAP_NORDERS; k++) {
+                if (freelist[k] >= 0) {
+                        break;
+                }
+        }
+        if (k == COREMAP_NORDERS) {
+                if (zeropool < 0) {
+                        return 0;
                 }
+                // Raid the zero pool before giving up
+                zeropool_flush();
+                return coremap_getpages(npages);
+        }
+
+        i = freelist[k];
+        freelist_remove(i);
+
+        // Split it down, returning the upper halves
+        while (k > order) {
+                k--;
+                freelist_insert(i + (1 << k), k);
+        }
+
+        // Mark free pages as allocated
+        for (int j = i; j < i + (int) npages; j++) {
+                coremap[j].state = ALLOCATED;
+                coremap[j].pt = NULL;
+                coremap[j].obj = NULL;
+                coremap[j].referenced = false;
+        }
+
+        // Give back the tail of the block that wasn't asked for
+        if ((1UL << order) > npages) {
+                buddy_free_range(i + npages, (1 << order) - npages);
         }
 
-        return ret;
+        // Store the number of physical frames allocated
+        coremap[i].chunksize = npages;
+        coremap[i].refcount = 1;
+
+        // Decrement the number of free frames
+        num_free_frames -= npages;
+
+        // Return physical address of starting physical frame
+        return (paddr_t) (i * PAGE_SIZE);
 }
 
 void
 coremap_freepages(vaddr_t addr)
 {
-        vaddr_t tmp_addr;
-        int len = num_total_frames;
-        for (int i = first_index; i < len; i++) {
-                tmp_addr = PADDR_TO_KVADDR(i * PAGE_SIZE);
-                if ( tmp_addr == addr) {
-                        int npages = coremap[i].chunksize;
-                        for(int j = i; j < i + npages; j++) {
-                                // Mark frame as free
-                                coremap[j].state = FREE;
-                                coremap[j].chunksize = 0;
-                                
-                                // Zero out the page being freed
-                                bzero((void *)PADDR_TO_KVADDR(j * PAGE_SIZE), 
-                                      PAGE_SIZE);
-                        }
-                        
-                        // Increment the number of free frames
-                        num_free_frames += npages;
-                        break;
+        int i = KVADDR_TO_PADDR(addr) / PAGE_SIZE;
+        int npages = coremap[i].chunksize;
+
+        KASSERT(i >= (int) first_index && i < (int) num_total_frames);
+        KASSERT(coremap[i].state == ALLOCATED);
+        KASSERT(!coremap[i].busy);
+        KASSERT(npages > 0);
+
+        // Mark frames as free; they get zeroed later, if needed
+        for(int j = i; j < i + npages; j++) {
+                coremap[j].state = FREE;
+                coremap[j].chunksize = 0;
+                coremap[j].refcount = 0;
+                coremap[j].pt = NULL;
+                coremap[j].obj = NULL;
+        }
+        buddy_free_range(i, npages);
+
+        // Increment the number of free frames
+        num_free_frames += npages;
+}
+
+/*
+ * Take a page from the zero pool. Returns 0 if the pool is empty.
+ */
+paddr_t
+coremap_getzeroedpage(void)
+{
+        int i = zeropool;
+
+        if (i < 0) {
+                return 0;
+        }
+        KASSERT(coremap[i].state == ZEROED);
+        zeropool = coremap[i].next;
+
+        coremap[i].state = ALLOCATED;
+        coremap[i].chunksize = 1;
+        coremap[i].refcount = 1;
+        coremap[i].pt = NULL;
+        coremap[i].obj = NULL;
+        coremap[i].referenced = false;
+        num_zeroed_frames--;
+        num_free_frames--;
+
+        return (paddr_t) (i * PAGE_SIZE);
+}
+
+/*
+ * Put a single allocated page, which the caller has just zeroed, into
+ * the zero pool.
+ */
+void
+coremap_addzeroedpage(paddr_t paddr)
+{
+        int i = paddr / PAGE_SIZE;
+
+        KASSERT(coremap[i].state == ALLOCATED);
+        KASSERT(coremap[i].chunksize == 1);
+
+        coremap[i].state = ZEROED;
+        coremap[i].chunksize = 0;
+        coremap[i].refcount = 0;
+        coremap[i].next = zeropool;
+        zeropool = i;
+        num_zeroed_frames++;
+        num_free_frames++;
+}
+
+/*
+ * Reference counts for frames shared copy-on-write between address
+ * spaces. The caller must hold the coremap lock. A shared frame has
+ * no single owner and so is never evicted; vm_fault registers it
+ * again once it is back down to one reference.
+ */
+void
+coremap_incref(paddr_t paddr)
+{
+        int i = paddr / PAGE_SIZE;
+
+        KASSERT(coremap[i].state == ALLOCATED);
+        KASSERT(coremap[i].refcount > 0);
+        coremap[i].refcount++;
+        coremap[i].pt = NULL;
+}
+
+unsigned
+coremap_decref(paddr_t paddr)
+{
+        int i = paddr / PAGE_SIZE;
+
+        KASSERT(coremap[i].state == ALLOCATED);
+        KASSERT(coremap[i].refcount > 0);
+        return --coremap[i].refcount;
+}
+
+unsigned
+coremap_refcount(paddr_t paddr)
+{
+        return coremap[paddr / PAGE_SIZE].refcount;
+}
+
+void
+coremap_setowner(paddr_t paddr, struct pagetable *pt, vaddr_t vaddr)
+{
+        int i = paddr / PAGE_SIZE;
+
+        KASSERT(coremap[i].state == ALLOCATED);
+        KASSERT(coremap[i].chunksize == 1);
+        KASSERT(pt == NULL || coremap[i].refcount == 1);
+        KASSERT(coremap[i].obj == NULL);
+
+        coremap[i].pt = pt;
+        coremap[i].vaddr = vaddr;
+        coremap[i].referenced = true;
+}
+
+void
+coremap_setobj(paddr_t paddr, struct vmobject *obj, unsigned idx)
+{
+        int i = paddr / PAGE_SIZE;
+
+        KASSERT(coremap[i].state == ALLOCATED);
+        KASSERT(coremap[i].chunksize == 1);
+        KASSERT(coremap[i].pt == NULL);
+
+        coremap[i].obj = obj;
+        coremap[i].objidx = idx;
+        coremap[i].referenced = true;
+}
+
+/*
+ * Second-chance clock. Frames whose referenced bit is set get it
+ * cleared and are passed over once; the first evictable frame found
+ * without it is the victim. Two full sweeps are always enough.
+ */
+paddr_t
+coremap_findvictim(bool anon, bool file)
+{
+        unsigned n;
+        int i;
+
+        for (n = 0; n < 2 * (num_total_frames - first_index); n++) {
+                i = clockhand;
+                if (++clockhand == (int) num_total_frames) {
+                        clockhand = first_index;
+                }
+
+                if (coremap[i].state != ALLOCATED ||
+                    coremap[i].busy ||
+                    coremap[i].refcount != 1) {
+                        continue;
+                }
+                if (coremap[i].pt != NULL ? !anon :
+                    coremap[i].obj == NULL || !file) {
+                        continue;
+                }
+                if (coremap[i].referenced) {
+                        coremap[i].referenced = false;
+                        continue;
                 }
+
+                coremap[i].busy = true;
+                return (paddr_t) (i * PAGE_SIZE);
         }
+
+        return 0;
+}
+
+void
+coremap_unbusy(paddr_t paddr)
+{
+        int i = paddr / PAGE_SIZE;
+
+        KASSERT(coremap[i].busy);
+        coremap[i].busy = false;
 }
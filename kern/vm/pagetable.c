@@ -0,0 +1,220 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <vm.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <vmobject.h>
+
+/*
+ * Create an empty page table. Only the directory is allocated here;
+ * second-level tables come into being as pages are touched.
+ */
+struct pagetable *
+pt_create(void)
+{
+        struct pagetable *pt;
+
+        pt = kmalloc(sizeof(struct pagetable));
+        if (pt == NULL) {
+                return NULL;
+        }
+        pt->pt_wchan = wchan_create("pagetable");
+        if (pt->pt_wchan == NULL) {
+                kfree(pt);
+                return NULL;
+        }
+        spinlock_init(&pt->pt_lock);
+        pt->pt_cpu = NULL;
+        bzero(pt->pt_dir, sizeof(pt->pt_dir));
+
+        return pt;
+}
+
+/*
+ * Clear a PTE and release the page behind it, waiting first if it is
+ * being paged out. Called with the lock held, which is dropped to free
+ * the page, since freeing may wait for the pageout code, which needs
+ * the lock.
+ */
+static
+void
+pt_release(struct pagetable *pt, pte_t *ptep)
+{
+        pte_t pte;
+
+        KASSERT(spinlock_do_i_hold(&pt->pt_lock));
+
+        while (*ptep & PTE_BUSY) {
+                wchan_sleep(pt->pt_wchan, &pt->pt_lock);
+        }
+        pte = *ptep;
+        *ptep = 0;
+        if (pte == 0) {
+                return;
+        }
+
+        spinlock_release(&pt->pt_lock);
+        if ((pte & (PTE_VALID | PTE_SHARED | PTE_WRITE)) ==
+            (PTE_VALID | PTE_SHARED | PTE_WRITE)) {
+                vmobject_unwrite(pte & PTE_FRAME);
+        }
+        if (pte & PTE_VALID) {
+                free_upage(pte & PTE_FRAME);
+        }
+        else if (pte & PTE_SWAPPED) {
+                swap_free(PTE_SLOT(pte));
+        }
+        spinlock_acquire(&pt->pt_lock);
+}
+
+/*
+ * Free every page, every second-level table and the directory itself.
+ */
+void
+pt_destroy(struct pagetable *pt)
+{
+        pte_t *table;
+        unsigned i, j;
+
+        for (i = 0; i < PT_L1_SIZE; i++) {
+                table = pt->pt_dir[i];
+                if (table == NULL) {
+                        continue;
+                }
+                spinlock_acquire(&pt->pt_lock);
+                for (j = 0; j < PT_L2_SIZE; j++) {
+                        pt_release(pt, &table[j]);
+                }
+                spinlock_release(&pt->pt_lock);
+                kfree(table);
+        }
+        spinlock_cleanup(&pt->pt_lock);
+        wchan_destroy(pt->pt_wchan);
+        kfree(pt);
+}
+
+/*
+ * Find the PTE for a virtual address, allocating (zeroed) the
+ * second-level table that holds it if asked to.
+ */
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+        pte_t **dirent, *table;
+
+        dirent = &pt->pt_dir[PT_L1_INDEX(vaddr)];
+        if (*dirent == NULL) {
+                if (!create) {
+                        return NULL;
+                }
+                table = kmalloc(PT_L2_SIZE * sizeof(pte_t));
+                if (table == NULL) {
+                        return NULL;
+                }
+                bzero(table, PT_L2_SIZE * sizeof(pte_t));
+                *dirent = table;
+        }
+
+        return &(*dirent)[PT_L2_INDEX(vaddr)];
+}
+
+/*
+ * Free the pages in a range. The second-level tables are kept.
+ */
+void
+pt_unmap(struct pagetable *pt, vaddr_t vaddr, size_t npages)
+{
+        pte_t *pte;
+
+        spinlock_acquire(&pt->pt_lock);
+        for (; npages > 0; npages--, vaddr += PAGE_SIZE) {
+                pte = pt_lookup(pt, vaddr, false);
+                if (pte != NULL) {
+                        pt_release(pt, pte);
+                }
+        }
+        spinlock_release(&pt->pt_lock);
+}
+
+void
+pt_unwrite(struct pagetable *pt, vaddr_t vaddr, size_t npages)
+{
+        pte_t *pte;
+        paddr_t pa;
+
+        spinlock_acquire(&pt->pt_lock);
+        for (; npages > 0; npages--, vaddr += PAGE_SIZE) {
+                pte = pt_lookup(pt, vaddr, false);
+                if (pte == NULL || (*pte & (PTE_SHARED | PTE_WRITE)) !=
+                    (PTE_SHARED | PTE_WRITE)) {
+                        continue;
+                }
+                *pte &= ~PTE_WRITE;
+                pa = *pte & PTE_FRAME;
+
+                /* The frame stays mapped, so it can't go away */
+                spinlock_release(&pt->pt_lock);
+                vmobject_unwrite(pa);
+                spinlock_acquire(&pt->pt_lock);
+        }
+        spinlock_release(&pt->pt_lock);
+}
+
+/*
+ * Share every page of OLD with NEW. Nothing is copied here: resident
+ * pages become copy-on-write in both and vm_fault makes the private
+ * copy on the first write from either side, and swapped pages share
+ * the slot until one side faults them back in. Only the second-level
+ * tables themselves are allocated, so the cost is proportional to the
+ * size of the page table rather than to memory use.
+ */
+int
+pt_copy(struct pagetable *old, struct pagetable *new)
+{
+        pte_t *oldtable, *newtable;
+        unsigned i, j;
+
+        for (i = 0; i < PT_L1_SIZE; i++) {
+                oldtable = old->pt_dir[i];
+                if (oldtable == NULL) {
+                        continue;
+                }
+
+                newtable = kmalloc(PT_L2_SIZE * sizeof(pte_t));
+                if (newtable == NULL) {
+                        return ENOMEM;
+                }
+                bzero(newtable, PT_L2_SIZE * sizeof(pte_t));
+                new->pt_dir[i] = newtable;
+
+                spinlock_acquire(&old->pt_lock);
+                for (j = 0; j < PT_L2_SIZE; j++) {
+                        while (oldtable[j] & PTE_BUSY) {
+                                wchan_sleep(old->pt_wchan, &old->pt_lock);
+                        }
+                        if (oldtable[j] & PTE_SHARED) {
+                                share_upage(oldtable[j] & PTE_FRAME);
+                                if (oldtable[j] & PTE_WRITE) {
+                                        vmobject_addwriter(oldtable[j] &
+                                                           PTE_FRAME);
+                                }
+                                newtable[j] = oldtable[j];
+                        }
+                        else if (oldtable[j] & PTE_VALID) {
+                                share_upage(oldtable[j] & PTE_FRAME);
+                                oldtable[j] |= PTE_COW;
+                                newtable[j] = oldtable[j];
+                        }
+                        else if (oldtable[j] & PTE_SWAPPED) {
+                                swap_share(PTE_SLOT(oldtable[j]));
+                                newtable[j] = oldtable[j];
+                        }
+                }
+                spinlock_release(&old->pt_lock);
+        }
+
+        return 0;
+}
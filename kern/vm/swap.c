@@ -0,0 +1,192 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <bitmap.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+#include <swap.h>
+
+static struct vnode *swap_vnode;        /* The swap device, or NULL */
+static struct bitmap *swap_map;         /* Slots in use */
+static unsigned *swap_refcount;         /* References to each slot */
+static unsigned swap_nslots;
+static unsigned swap_nused;
+
+static unsigned swap_pageins;
+static unsigned swap_pageouts;
+
+/* Protects everything above except the vnode */
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+void
+swap_bootstrap(void)
+{
+        char path[sizeof(SWAP_DEVICE)];
+        struct stat st;
+        int result;
+
+        /* vfs_open scribbles on its argument */
+        strcpy(path, SWAP_DEVICE);
+
+        result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+        if (result) {
+                kprintf("swap: %s: %s; running without swap\n",
+                        SWAP_DEVICE, strerror(result));
+                swap_vnode = NULL;
+                return;
+        }
+
+        result = VOP_STAT(swap_vnode, &st);
+        if (result) {
+                panic("swap: %s: stat: %s\n", SWAP_DEVICE, strerror(result));
+        }
+
+        swap_nslots = st.st_size / PAGE_SIZE;
+        if (swap_nslots == 0) {
+                kprintf("swap: %s is too small; running without swap\n",
+                        SWAP_DEVICE);
+                vfs_close(swap_vnode);
+                swap_vnode = NULL;
+                return;
+        }
+
+        swap_map = bitmap_create(swap_nslots);
+        swap_refcount = kmalloc(swap_nslots * sizeof(unsigned));
+        if (swap_map == NULL || swap_refcount == NULL) {
+                panic("swap: out of memory\n");
+        }
+        bzero(swap_refcount, swap_nslots * sizeof(unsigned));
+
+        kprintf("swap: %s, %u pages\n", SWAP_DEVICE, swap_nslots);
+}
+
+bool
+swap_enabled(void)
+{
+        return swap_vnode != NULL;
+}
+
+int
+swap_alloc(unsigned *slot)
+{
+        int result;
+
+        if (swap_vnode == NULL) {
+                return ENOSPC;
+        }
+
+        spinlock_acquire(&swap_lock);
+        result = bitmap_alloc(swap_map, slot);
+        if (result == 0) {
+                KASSERT(swap_refcount[*slot] == 0);
+                swap_refcount[*slot] = 1;
+                swap_nused++;
+        }
+        spinlock_release(&swap_lock);
+
+        return result;
+}
+
+void
+swap_share(unsigned slot)
+{
+        KASSERT(slot < swap_nslots);
+
+        spinlock_acquire(&swap_lock);
+        KASSERT(swap_refcount[slot] > 0);
+        swap_refcount[slot]++;
+        spinlock_release(&swap_lock);
+}
+
+void
+swap_free(unsigned slot)
+{
+        KASSERT(slot < swap_nslots);
+
+        spinlock_acquire(&swap_lock);
+        KASSERT(swap_refcount[slot] > 0);
+        if (--swap_refcount[slot] == 0) {
+                bitmap_unmark(swap_map, slot);
+                swap_nused--;
+        }
+        spinlock_release(&swap_lock);
+}
+
+/*
+ * Move one page between memory and a slot.
+ */
+static
+int
+swap_io(unsigned slot, paddr_t paddr, enum uio_rw rw)
+{
+        struct iovec iov;
+        struct uio ku;
+        int result;
+
+        KASSERT(swap_vnode != NULL);
+        KASSERT(slot < swap_nslots);
+        KASSERT((paddr & PAGE_FRAME) == paddr);
+
+        uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+                  (off_t)slot * PAGE_SIZE, rw);
+        if (rw == UIO_READ) {
+                result = VOP_READ(swap_vnode, &ku);
+        }
+        else {
+                result = VOP_WRITE(swap_vnode, &ku);
+        }
+        if (result) {
+                return result;
+        }
+        if (ku.uio_resid != 0) {
+                return EIO;
+        }
+
+        spinlock_acquire(&swap_lock);
+        if (rw == UIO_READ) {
+                swap_pageins++;
+        }
+        else {
+                swap_pageouts++;
+        }
+        spinlock_release(&swap_lock);
+
+        return 0;
+}
+
+int
+swap_pagein(unsigned slot, paddr_t paddr)
+{
+        return swap_io(slot, paddr, UIO_READ);
+}
+
+int
+swap_pageout(unsigned slot, paddr_t paddr)
+{
+        return swap_io(slot, paddr, UIO_WRITE);
+}
+
+void
+swap_printstats(void)
+{
+        unsigned nused, pageins, pageouts;
+
+        if (swap_vnode == NULL) {
+                kprintf("Swap: none\n");
+                return;
+        }
+
+        spinlock_acquire(&swap_lock);
+        nused = swap_nused;
+        pageins = swap_pageins;
+        pageouts = swap_pageouts;
+        spinlock_release(&swap_lock);
+
+        kprintf("Swap: %u of %u slots in use, %u swap-ins, %u swap-outs\n",
+                nused, swap_nslots, pageins, pageouts);
+}
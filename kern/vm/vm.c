@@ -34,10 +34,16 @@
 #include <spinlock.h>
 #include <proc.h>
 #include <current.h>
+#include <cpu.h>
+#include <thread.h>
+#include <wchan.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
 #include <coremap.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <vmobject.h>
 #include <syscall.h>
 
 /*
@@ -56,10 +62,6 @@
  * it's cutting (there are many) and why, and more importantly, how.
  */
 
-/* under dumbvm, always have 72k of user stack */
-/* (this must be > 64K so argument blocks of size ARG_MAX will fit) */
-#define DUMBVM_STACKPAGES    18
-
 /*
  * Wrap ram_stealmem in a spinlock.
  */
@@ -67,10 +69,79 @@
 
 struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
 
+/* Where to wait for a frame that is being paged out */
+static struct wchan *coremap_wchan;
+
+/*
+ * Once fewer than this many frames are free, user page allocations
+ * evict a page instead of taking one of the last free frames, which
+ * are left for the kernel (which cannot page).
+ */
+#define VM_RESERVE      16
+
+/*
+ * Background page zeroing.
+ *
+ * Freed pages go back to the coremap dirty. Whenever a cpu has
+ nothing to run, its idle loop calls vm_idlezero, which clears one
+ * free page (without holding the coremap lock) and adds it to the
+ * coremap's zero pool, until the pool holds PAGEZERO_HIGH pages. The
+ * idle loop runs with interrupts off, so it zeroes just one page each
+ * time before idling; the next interrupt brings it back for another,
+ * and zeroing only ever uses time nothing else wanted. alloc_upage takes pre-zeroed
+ * pages from the pool and only has to clear one itself if the pool
+ * is empty.
+ */
+#define PAGEZERO_HIGH   128
+
+static bool pagezero_ready;             /* set once vm_bootstrap ran */
+static unsigned pagezero_hits;          /* alloc_upage found a zeroed page */
+static unsigned pagezero_misses;        /* alloc_upage had to bzero */
+
+/*
+ * Zero one free page for the pool, if it needs one.
+ */
+void
+vm_idlezero(void)
+{
+        paddr_t pa;
+
+        if (!pagezero_ready) {
+                return;
+        }
+
+        spinlock_acquire(&coremap_lock);
+        if (num_zeroed_frames >= PAGEZERO_HIGH ||
+            num_free_frames == num_zeroed_frames) {
+                spinlock_release(&coremap_lock);
+                return;
+        }
+        pa = coremap_getpages(1);
+        spinlock_release(&coremap_lock);
+
+        if (pa == 0) {
+                return;
+        }
+
+        bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+
+        spinlock_acquire(&coremap_lock);
+        coremap_addzeroedpage(pa);
+        spinlock_release(&coremap_lock);
+}
+
 void
 vm_bootstrap(void)
 {
-	/* Do nothing. */
+        coremap_wchan = wchan_create("coremap");
+        if (coremap_wchan == NULL) {
+                panic("vm_bootstrap: could not create wchan\n");
+        }
+
+        swap_bootstrap();
+        vmobject_bootstrap();
+
+        pagezero_ready = true;
 }
 
 paddr_t
@@ -87,12 +158,176 @@ getppages(unsigned long npages)
         return addr;
 }
 
+/*
+ * Per-cpu caches of free single pages.
+ *
+ * Most kernel page allocations are one page (kmalloc's subpage
+ * allocator, page tables). Each cpu keeps a small stack of free pages
+ * in its struct cpu that only it touches, with interrupts off, so the
+ * common case never takes the coremap lock. An empty cache is
+ * refilled, and a full one drained, PAGECACHE_BATCH pages at a time
+ * under a single acquisition of the lock.
+ *
+ * Cached pages stay ALLOCATED in the coremap, so they are not in
+ * num_free_frames. When the coremap runs short, pagecache_drainall
+ * empties every cpu's cache: its own directly, the others' by IPI
+ * (see vm_pagecache_flush), as nobody else may touch them.
+ */
+#define PAGECACHE_BATCH (CPU_PAGECACHE_MAX / 2)
+
+static
+void
+pagecache_refill(struct cpu *c)
+{
+        paddr_t pa;
+
+        spinlock_acquire(&coremap_lock);
+        while (c->c_pagecache_count < PAGECACHE_BATCH) {
+                pa = coremap_getpages(1);
+                if (pa == 0) {
+                        break;
+                }
+                c->c_pagecache[c->c_pagecache_count++] = pa;
+        }
+        spinlock_release(&coremap_lock);
+}
+
+static
+void
+pagecache_drain(struct cpu *c, unsigned keep)
+{
+        paddr_t pa;
+
+        spinlock_acquire(&coremap_lock);
+        while (c->c_pagecache_count > keep) {
+                pa = c->c_pagecache[--c->c_pagecache_count];
+                coremap_freepages(PADDR_TO_KVADDR(pa));
+        }
+        spinlock_release(&coremap_lock);
+}
+
+/*
+ * Pages sitting in all the caches. This reads other cpus' counts
+ * without synchronization, so it is only an estimate.
+ */
+static
+unsigned
+pagecache_total(void)
+{
+        unsigned i, num, total;
+
+        total = 0;
+        num = cpu_numcpus();
+        for (i = 0; i < num; i++) {
+                total += cpu_getcpu(i)->c_pagecache_count;
+        }
+        return total;
+}
+
+/*
+ * Whether this thread may wait for other cpus to answer an IPI: it
+ * must be able to take one itself meanwhile, or two cpus doing this
+ * at once could wait for each other forever.
+ */
+static
+bool
+pagecache_canwait(void)
+{
+        return !curthread->t_in_interrupt &&
+                curcpu->c_spinlocks == 0 &&
+                curthread->t_curspl == 0;
+}
+
+/*
+ * Return every cpu's cached pages to the coremap. If WAIT is set,
+ * don't return until the other cpus have done it, which is only
+ * allowed if pagecache_canwait says so.
+ */
+static
+void
+pagecache_drainall(bool wait)
+{
+        struct cpu *c;
+        unsigned i, num, gen;
+        int spl;
+
+        spl = splhigh();
+        pagecache_drain(curcpu->c_self, 0);
+        splx(spl);
+
+        KASSERT(!wait || pagecache_canwait());
+
+        /* One at a time; this is rare enough not to bother overlapping */
+        num = cpu_numcpus();
+        for (i = 0; i < num; i++) {
+                c = cpu_getcpu(i);
+                if (c == curcpu->c_self || c->c_pagecache_count == 0) {
+                        continue;
+                }
+                gen = c->c_pagecache_flushes;
+                ipi_send(c, IPI_PAGECACHE);
+                while (wait && c->c_pagecache_flushes == gen) {
+                        /* spin; the IPI is handled promptly */
+                }
+        }
+}
+
+/*
+ * Another cpu is short of pages; give back ours.
+ */
+void
+vm_pagecache_flush(void)
+{
+        struct cpu *c;
+        int spl;
+
+        spl = splhigh();
+        c = curcpu->c_self;
+        pagecache_drain(c, 0);
+        c->c_pagecache_flushes++;
+        splx(spl);
+}
+
+static paddr_t vm_evict(void);
+
 /* Allocate/free some kernel-space virtual pages */
 vaddr_t
 alloc_kpages(unsigned npages)
 {
 	paddr_t pa;
-	pa = getppages(npages);
+        struct cpu *c;
+        int spl;
+
+        /* No curcpu early in boot; go straight to the coremap */
+        if (npages == 1 && CURCPU_EXISTS()) {
+                spl = splhigh();
+                c = curcpu->c_self;
+                if (c->c_pagecache_count > 0) {
+                        c->c_pagecache_hits++;
+                }
+                else {
+                        c->c_pagecache_misses++;
+                        pagecache_refill(c);
+                }
+                pa = 0;
+                if (c->c_pagecache_count > 0) {
+                        pa = c->c_pagecache[--c->c_pagecache_count];
+                }
+                splx(spl);
+        }
+        else {
+                pa = getppages(npages);
+        }
+        if (pa == 0 && CURCPU_EXISTS()) {
+                /*
+                 * Free pages might be sitting in per-cpu caches. We
+                 * don't page anything out for more: the caller may
+                 * hold locks the pager needs, so it has to cope with
+                 * failure instead.
+                 */
+                pagecache_drainall(pagecache_canwait());
+                pa = getppages(npages);
+        }
 	if (pa==0) {
 		return 0;
 	}
@@ -102,43 +337,672 @@ alloc_kpages(unsigned npages)
 void
 free_kpages(vaddr_t addr)
 {
-	/* nothing - leak the memory. */
+        struct cpu *c;
+        int spl;
+
+        /* The chunk is ours until it's freed, so no lock needed here */
+        if (coremap[KVADDR_TO_PADDR(addr) / PAGE_SIZE].chunksize == 1 &&
+            CURCPU_EXISTS()) {
+                spl = splhigh();
+                c = curcpu->c_self;
+                if (c->c_pagecache_count == CPU_PAGECACHE_MAX) {
+                        c->c_pagecache_drains++;
+                        pagecache_drain(c, PAGECACHE_BATCH);
+                }
+                else {
+                        c->c_pagecache_frees++;
+                }
+                c->c_pagecache[c->c_pagecache_count++] = KVADDR_TO_PADDR(addr);
+                splx(spl);
+                return;
+        }
+
+        spinlock_acquire(&coremap_lock);
+
         coremap_freepages(addr);
+
+        spinlock_release(&coremap_lock);
+}
+
+/*
+ * Print VM statistics.
+ */
+void
+vm_printstats(void)
+{
+        struct cpu *c;
+        unsigned i, num, nfree, nzeroed, zhits, zmisses;
+
+        spinlock_acquire(&coremap_lock);
+        nfree = num_free_frames;
+        nzeroed = num_zeroed_frames;
+        zhits = pagezero_hits;
+        zmisses = pagezero_misses;
+        spinlock_release(&coremap_lock);
+
+        kprintf("Physical frames: %u total, %u free (%u zeroed)\n",
+                num_total_frames, nfree, nzeroed);
+        kprintf("Zeroed user page allocations: %u from pool, %u cleared "
+                "on demand\n", zhits, zmisses);
+
+        kprintf("Per-cpu page cache:\n");
+        kprintf("    cpu  cached    hits  misses   frees  drains\n");
+        num = cpu_numcpus();
+        for (i = 0; i < num; i++) {
+                c = cpu_getcpu(i);
+                kprintf("    %3u  %6u  %6u  %6u  %6u  %6u\n", i,
+                        c->c_pagecache_count,
+                        c->c_pagecache_hits, c->c_pagecache_misses,
+                        c->c_pagecache_frees, c->c_pagecache_drains);
+        }
+
+        kprintf("Per-cpu TLB:\n");
+        kprintf("    cpu   refills    faults   flushes     keeps\n");
+        for (i = 0; i < num; i++) {
+                c = cpu_getcpu(i);
+                kprintf("    %3u  %8u  %8u  %8u  %8u\n", i,
+                        c->c_tlb_refills, c->c_tlb_faults,
+                        c->c_tlb_flushes, c->c_tlb_keeps);
+        }
+
+        swap_printstats();
+}
+
+/*
+ * Get a frame for a user page, zero-filled if ZERO is set (preferably
+ * one the idle loop has already cleared). When memory is short
+ * some other user page is paged out to make room.
+ */
+static
+paddr_t
+vm_getframe(bool zero)
+{
+        paddr_t pa;
+        bool low, zeroed;
+
+        spinlock_acquire(&coremap_lock);
+        low = num_free_frames < VM_RESERVE;
+        spinlock_release(&coremap_lock);
+
+        if (low && num_free_frames + pagecache_total() >= VM_RESERVE &&
+            pagecache_canwait()) {
+                /* Enough free pages, but they're in per-cpu caches */
+                pagecache_drainall(true);
+                spinlock_acquire(&coremap_lock);
+                low = num_free_frames < VM_RESERVE;
+                spinlock_release(&coremap_lock);
+        }
+
+        pa = low ? vm_evict() : 0;
+        zeroed = false;
+
+        if (pa == 0) {
+                spinlock_acquire(&coremap_lock);
+                if (zero) {
+                        pa = coremap_getzeroedpage();
+                        zeroed = pa != 0;
+                        if (zeroed) {
+                                pagezero_hits++;
+                        }
+                        else {
+                                pagezero_misses++;
+                        }
+                }
+                if (pa == 0) {
+                        pa = coremap_getpages(1);
+                }
+                spinlock_release(&coremap_lock);
+        }
+
+        if (pa == 0 && !low) {
+                pa = vm_evict();
+        }
+        if (pa == 0) {
+                return 0;
+        }
+        if (zero && !zeroed) {
+                bzero((void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+        }
+
+        return pa;
+}
+
+/*
+ * Allocate a zero-filled frame for a user page.
+ */
+paddr_t
+alloc_upage(void)
+{
+        return vm_getframe(true);
+}
+
+/*
+ * Drop one reference to a user frame, freeing it when the last
+ * address space sharing it lets go. If the frame is in the middle of
+ * being paged out, wait for the pageout code to give up on it.
+ */
+void
+free_upage(paddr_t paddr)
+{
+        spinlock_acquire(&coremap_lock);
+
+        while (coremap[paddr / PAGE_SIZE].busy) {
+                wchan_sleep(coremap_wchan, &coremap_lock);
+        }
+        if (coremap_decref(paddr) == 0) {
+                coremap_freepages(PADDR_TO_KVADDR(paddr));
+        }
+
+        spinlock_release(&coremap_lock);
+}
+
+/*
+ * Add a reference to a user frame that is being shared copy-on-write.
+ */
+void
+share_upage(paddr_t paddr)
+{
+        spinlock_acquire(&coremap_lock);
+        coremap_incref(paddr);
+        spinlock_release(&coremap_lock);
+}
+
+/*
+ * TLB management.
+ *
+ * No address space IDs are used (TLBHI_PID is always 0), so a TLB
+ * only holds one address space's translations at a time. Rather than
+ * flushing it on every context switch, each cpu remembers whose
+ * translations it holds (c_tlb_owner) and each page table remembers
+ * the last cpu it was activated on (pt_cpu). Reactivating the same
+ * page table on the same cpu, with no other activated on that cpu nor
+ * it on any other cpu in between, keeps the TLB as it was.
+ *
+ * It follows that only pt_cpu can hold usable translations for a page
+ * table: every other cpu will flush before using it again. So a change
+ * to a PTE has to be shot down on that one cpu only.
+ *
+ * After a flush the TLB is filled in slot order, c_tlb_next tracking
+ * the first slot never used since, and only once it is full are
+ * victims picked at random.
+ */
+
+/*
+ * Invalidate this cpu's whole TLB.
+ */
+void
+vm_tlbflush(void)
+{
+	int i, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	curcpu->c_tlb_next = 0;
+	curcpu->c_tlb_flushes++;
+
+	splx(spl);
+}
+
+/*
+ * Make PT's translations the ones in this cpu's TLB, flushing it only
+ * if it might hold anything else (or stale entries of PT's).
+ */
+void
+vm_tlbactivate(struct pagetable *pt)
+{
+	struct cpu *c;
+	bool keep;
+	int spl;
+
+	spl = splhigh();
+	c = curcpu->c_self;
+
+	/* Under the lock, so vm_evict sees pt_cpu before we load anything */
+	spinlock_acquire(&pt->pt_lock);
+	keep = c->c_tlb_owner == pt && pt->pt_cpu == c;
+	pt->pt_cpu = c;
+	spinlock_release(&pt->pt_lock);
+
+	if (keep) {
+		c->c_tlb_keeps++;
+	}
+	else {
+		vm_tlbflush();
+		c->c_tlb_owner = pt;
+	}
+
+	splx(spl);
 }
 
 void
 vm_tlbshootdown_all(void)
 {
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	vm_tlbflush();
 }
 
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	int i, spl;
+
+	spl = splhigh();
+	i = tlb_probe(ts->ts_vaddr, 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
+}
+
+/*
+ * Remove any translation for VADDR from TARGET's TLB (which may be
+ * this cpu's) and wait until that has happened. The IPI is sent with
+ * interrupts off so that we cannot migrate onto TARGET in between
+ * deciding it is another cpu and sending it.
+ */
+static
+void
+vm_shootdown(struct cpu *target, vaddr_t vaddr)
+{
+	struct tlbshootdown ts;
+	unsigned ticket;
+	bool self;
+	int spl;
+
+	if (target == NULL) {
+		/* Never activated, so in no TLB */
+		return;
+	}
+
+	ts.ts_vaddr = vaddr;
+	ticket = 0;
+
+	spl = splhigh();
+	self = target == curcpu->c_self;
+	if (self) {
+		vm_tlbshootdown(&ts);
+	}
+	else {
+		ticket = ipi_tlbshootdown(target, &ts);
+	}
+	splx(spl);
+
+	if (!self) {
+		ipi_tlbshootdown_wait(target, ticket);
+	}
+}
+
+/*
+ * Page out the anonymous page in frame PA, which coremap_findvictim
+ * picked as mapped at VADDR in PT, to a swap slot.
+ *
+ * The victim is chosen under the coremap lock, but its page table can
+ * only be locked after dropping that, so once the page table is
+ * locked we check that the frame is still mapped there and still not
+ * shared; if not, we fail with EAGAIN. The busy mark keeps the page
+ * table from being destroyed under us in the meantime (see pt_destroy
+ * and free_upage).
+ */
+static
+int
+vm_evict_anon(struct pagetable *pt, vaddr_t vaddr, paddr_t pa)
+{
+        struct cpu *target;
+        pte_t *pte;
+        unsigned slot;
+        bool ok;
+        int result;
+
+        spinlock_acquire(&pt->pt_lock);
+        pte = pt_lookup(pt, vaddr, false);
+
+        spinlock_acquire(&coremap_lock);
+        ok = pte != NULL &&
+                (*pte & (PTE_VALID | PTE_COW)) == PTE_VALID &&
+                (*pte & PTE_FRAME) == pa &&
+                coremap[pa / PAGE_SIZE].pt == pt &&
+                coremap[pa / PAGE_SIZE].vaddr == vaddr &&
+                coremap_refcount(pa) == 1;
+        spinlock_release(&coremap_lock);
+        if (!ok) {
+                spinlock_release(&pt->pt_lock);
+                return EAGAIN;
+        }
+
+        result = swap_alloc(&slot);
+        if (result) {
+                spinlock_release(&pt->pt_lock);
+                return result;
+        }
+
+        /* Nobody can map it from now on */
+        *pte = (*pte & ~PTE_VALID) | PTE_BUSY;
+        target = pt->pt_cpu;
+        spinlock_release(&pt->pt_lock);
+
+        vm_shootdown(target, vaddr);
+
+        result = swap_pageout(slot, pa);
+
+        spinlock_acquire(&pt->pt_lock);
+        if (result) {
+                *pte = (*pte & ~PTE_BUSY) | PTE_VALID;
+        }
+        else {
+                *pte = PTE_MKSLOT(slot) | PTE_SWAPPED;
+        }
+        wchan_wakeall(pt->pt_wchan, &pt->pt_lock);
+        spinlock_release(&pt->pt_lock);
+
+        if (result) {
+                kprintf("vm: pageout to swap slot %u: %s\n", slot,
+                        strerror(result));
+                swap_free(slot);
+        }
+        return result;
+}
+
+/*
+ * Page out one user page to make room. The frame it was in is handed
+ * back still allocated, with one reference and no owner, for the
+ * caller to reuse. Returns 0 if nothing could be evicted.
+ *
+ * Anonymous pages go to swap. Pages of mapped files that no mapping
+ * is using any more are dropped from the file's page cache, after
+ * being written back to the file if they are dirty.
+ *
+ * A victim can change state before we get to it; then we try another,
+ * but only a limited number of times.
+ */
+#define VM_EVICT_TRIES  16
+
+static
+paddr_t
+vm_evict(void)
+{
+        struct pagetable *pt;
+        struct vmobject *obj;
+        vaddr_t vaddr;
+        paddr_t pa;
+        unsigned idx, tries;
+        int result;
+
+        for (tries = 0; tries < VM_EVICT_TRIES; tries++) {
+                spinlock_acquire(&coremap_lock);
+                pa = coremap_findvictim(swap_enabled(), true);
+                if (pa == 0) {
+                        spinlock_release(&coremap_lock);
+                        return 0;
+                }
+                pt = coremap[pa / PAGE_SIZE].pt;
+                vaddr = coremap[pa / PAGE_SIZE].vaddr;
+                obj = coremap[pa / PAGE_SIZE].obj;
+                idx = coremap[pa / PAGE_SIZE].objidx;
+                spinlock_release(&coremap_lock);
+
+                if (obj != NULL) {
+                        result = vmobject_evict(obj, idx, pa);
+                }
+                else {
+                        result = vm_evict_anon(pt, vaddr, pa);
+                }
+
+                spinlock_acquire(&coremap_lock);
+                if (!result) {
+                        if (obj != NULL) {
+                                coremap_setobj(pa, NULL, 0);
+                        }
+                        else {
+                                coremap_setowner(pa, NULL, 0);
+                        }
+                }
+                coremap_unbusy(pa);
+                wchan_wakeall(coremap_wchan, &coremap_lock);
+                spinlock_release(&coremap_lock);
+
+                if (!result) {
+                        return pa;
+                }
+        }
+
+        return 0;
+}
+
+/*
+ * Load a translation into the TLB: over the old one for the page if
+ * there is one, else into the next never-used slot, else over a
+ * random victim.
+ */
+static
+void
+vm_tlbload(uint32_t ehi, uint32_t elo)
+{
+	struct cpu *c;
+	int i, spl;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+	c = curcpu->c_self;
+
+        i = tlb_probe(ehi, 0);
+        if (i >= 0) {
+		tlb_write(ehi, elo, i);
+        }
+        else if (c->c_tlb_next < NUM_TLB) {
+		tlb_write(ehi, elo, c->c_tlb_next++);
+        }
+        else {
+		tlb_random(ehi, elo);
+        }
+
+	splx(spl);
+}
+
+/*
+ * Bring in a page that is not resident: read it back from swap if it
+ * was paged out, and otherwise (first touch) back it with a zeroed
+ * frame. WRITE says whether the region allows writes. Called, and
+ * returns, with the page table locked, but drops the lock while
+ * allocating and doing I/O. Pages that are not resident are only ever
+ * changed by the process that owns them, so the PTE cannot change
+ * meanwhile.
+ */
+static
+int
+vm_pagein(struct pagetable *pt, pte_t *pte, vaddr_t vaddr, bool write)
+{
+        pte_t old;
+        paddr_t pa;
+        int result;
+
+        old = *pte;
+        KASSERT((old & (PTE_VALID | PTE_BUSY)) == 0);
+
+        spinlock_release(&pt->pt_lock);
+
+        pa = vm_getframe(!(old & PTE_SWAPPED));
+        if (pa == 0) {
+                spinlock_acquire(&pt->pt_lock);
+                return ENOMEM;
+        }
+        if (old & PTE_SWAPPED) {
+                result = swap_pagein(PTE_SLOT(old), pa);
+                if (result) {
+                        free_upage(pa);
+                        spinlock_acquire(&pt->pt_lock);
+                        return result;
+                }
+                swap_free(PTE_SLOT(old));
+        }
+
+        spinlock_acquire(&pt->pt_lock);
+        KASSERT(*pte == old);
+        *pte = pa | PTE_VALID | (write ? PTE_WRITE : 0);
+
+        spinlock_acquire(&coremap_lock);
+        coremap_setowner(pa, pt, vaddr);
+        spinlock_release(&coremap_lock);
+
+        return 0;
+}
+
+/*
+ * Bring in a page of a file mapping for the first time, from the
+ * file's page cache. Shared mappings map the cached frame itself,
+ * writeable only if this is a WRITE fault; private ones map it
+ * copy-on-write, except for a page that is only partly backed by the
+ * file (the end of an ELF segment followed by BSS), which gets a
+ * private copy with the rest zeroed. Called, and returns, with the
+ * page table locked, but drops the lock while the page is found or
+ * read in; like vm_pagein, this relies on nobody else changing a PTE
+ * that is not resident.
+ */
+static
+int
+vm_filein(struct pagetable *pt, pte_t *pte, struct region *rg,
+          vaddr_t vaddr, bool write)
+{
+        struct vmobject *obj;
+        unsigned idx;
+        size_t len;
+        pte_t old;
+        paddr_t pa, newpa;
+        int result;
+
+        old = *pte;
+        KASSERT((old & (PTE_VALID | PTE_BUSY | PTE_SWAPPED)) == 0);
+
+        obj = rg->rg_obj;
+        idx = (rg->rg_offset + (vaddr - rg->rg_vbase)) / PAGE_SIZE;
+        write = write && rg->rg_shared;
+        len = rg->rg_filesz - (vaddr - rg->rg_vbase);
+        if (rg->rg_shared || len > PAGE_SIZE) {
+                len = PAGE_SIZE;
+        }
+
+        spinlock_release(&pt->pt_lock);
+        result = vmobject_fault(obj, idx, write, &pa);
+        if (result == 0 && len < PAGE_SIZE) {
+                newpa = vm_getframe(false);
+                if (newpa != 0) {
+                        memmove((void *)PADDR_TO_KVADDR(newpa),
+                                (const void *)PADDR_TO_KVADDR(pa), len);
+                        bzero((void *)PADDR_TO_KVADDR(newpa + len),
+                              PAGE_SIZE - len);
+                }
+                else {
+                        result = ENOMEM;
+                }
+                free_upage(pa);
+                pa = newpa;
+        }
+        spinlock_acquire(&pt->pt_lock);
+        if (result) {
+                return result;
+        }
+
+        KASSERT(*pte == old);
+        if (len < PAGE_SIZE) {
+                *pte = pa | PTE_VALID |
+                        ((rg->rg_perm & VM_W) ? PTE_WRITE : 0);
+                spinlock_acquire(&coremap_lock);
+                coremap_setowner(pa, pt, vaddr);
+                spinlock_release(&coremap_lock);
+        }
+        else if (rg->rg_shared) {
+                *pte = pa | PTE_VALID | PTE_SHARED | (write ? PTE_WRITE : 0);
+        }
+        else {
+                *pte = pa | PTE_VALID | PTE_COW |
+                        ((rg->rg_perm & VM_W) ? PTE_WRITE : 0);
+        }
+
+        return 0;
+}
+
+/*
+ * Deal with a fault on a copy-on-write page. If nobody else holds a
+ * reference any more the frame is simply taken over (even on a read,
+ * so that it can be paged out again). Otherwise, on a WRITE, the
+ * faulting address space is given its own copy; reads leave the page
+ * shared and mapped read-only, deferring the copy to the first write.
+ * Called with the page table locked; the lock is dropped while
+ * copying. The old frame is shared, so it cannot be paged out,
+ * and the PTE stays as it was. The reference to the old frame is
+ * handed back in OLDPA for the caller to drop once it has let go of
+ * the page table lock.
+ */
+static
+int
+vm_breakcow(struct pagetable *pt, pte_t *pte, vaddr_t vaddr, bool write,
+            paddr_t *oldpa)
+{
+        paddr_t pa, newpa;
+        pte_t old;
+        bool shared;
+
+        old = *pte;
+        KASSERT(old & PTE_VALID);
+        KASSERT(old & PTE_COW);
+        pa = old & PTE_FRAME;
+
+        /* A frame in a page cache always belongs to the cache */
+        spinlock_acquire(&coremap_lock);
+        shared = coremap_refcount(pa) > 1 ||
+                coremap[pa / PAGE_SIZE].obj != NULL;
+        if (!shared) {
+                *pte &= ~PTE_COW;
+                coremap_setowner(pa, pt, vaddr);
+        }
+        spinlock_release(&coremap_lock);
+
+        if (!shared || !write) {
+                return 0;
+        }
+
+        spinlock_release(&pt->pt_lock);
+        newpa = vm_getframe(false);
+        if (newpa != 0) {
+                memmove((void *)PADDR_TO_KVADDR(newpa),
+                        (const void *)PADDR_TO_KVADDR(pa), PAGE_SIZE);
+        }
+        spinlock_acquire(&pt->pt_lock);
+
+        if (newpa == 0) {
+                return ENOMEM;
+        }
+        KASSERT(*pte == old);
+        *pte = newpa | (old & ~(PTE_FRAME | PTE_COW));
+
+        spinlock_acquire(&coremap_lock);
+        coremap_setowner(newpa, pt, vaddr);
+        spinlock_release(&coremap_lock);
+
+        *oldpa = pa;
+        return 0;
 }
 
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
-	//vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
-	vaddr_t vbase, vtop, stackbase, stacktop;
-	paddr_t paddr;
-	int i;
-	uint32_t ehi, elo;
 	struct addrspace *as;
-	int spl;
-        uint32_t readonly = 0;
+        struct region *rg;
+        struct pagetable *pt;
+        pte_t *pte;
+	paddr_t paddr, oldpa;
+	uint32_t ehi, elo;
+        bool writeable;
+        int result;
 
 	faultaddress &= PAGE_FRAME;
 
-	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
+	DEBUG(DB_VM, "vm: fault: 0x%x\n", faultaddress);
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
-                /* Return operation not permitted error */
-                return EPERM; 
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
@@ -164,81 +1028,116 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
-        KASSERT(as->as_stackpbase != 0);
-        KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
-
-	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
-	stacktop = USERSTACK;
-        
-        bool found = false;
-        int len = (int) as->nsegs;
-        for (int i = 0; i < len; i++) {
-	        /* 
-                 * Assert that the address space has been 
-                 * set up properly. 
-                 */
-                KASSERT(as->page_table[i].vaddr != 0);
-                KASSERT(as->page_table[i].paddr != 0);
-                KASSERT(as->page_table[i].chunksize != 0);
-
-                vbase = as->page_table[i].vaddr;
-                vtop  = vbase + as->page_table[i].chunksize * PAGE_SIZE;
-                if (faultaddress >= vbase && faultaddress < vtop) {
-                        paddr = (faultaddress - vbase) +
-                                as->page_table[i].paddr;
-                        uint32_t faultaddress_perm = 
-                                as->page_table[i].p_perm & (VM_R | VM_W);
-                        if (faultaddress_perm == VM_R) {
-                                readonly = 1;
+        /*
+         * Fast path for plain TLB misses: if the page is resident and
+         * its PTE alone allows the access, just reload it. This skips
+         * the region lookup, which is only needed to set up pages.
+         * Reading a copy-on-write page is fine too; it is loaded
+         * read-only, and only a write goes on to copy it.
+         */
+        pt = as->as_pt;
+        pte = pt_lookup(pt, faultaddress, false);
+        if (pte != NULL) {
+                spinlock_acquire(&pt->pt_lock);
+                if ((*pte & PTE_VALID) &&
+                    (faulttype == VM_FAULT_READ ||
+                     (*pte & (PTE_WRITE | PTE_COW)) == PTE_WRITE)) {
+                        paddr = *pte & PTE_FRAME;
+                        coremap[paddr / PAGE_SIZE].referenced = true;
+                        elo = paddr | TLBLO_VALID;
+                        if ((*pte & (PTE_WRITE | PTE_COW)) == PTE_WRITE) {
+                                elo |= TLBLO_DIRTY;
                         }
-                        found = true;
-                        break;
+                        vm_tlbload(faultaddress, elo);
+                        curcpu->c_tlb_refills++;
+                        spinlock_release(&pt->pt_lock);
+                        return 0;
                 }
-                
+                spinlock_release(&pt->pt_lock);
         }
 
-        if (!found && 
-            faultaddress >= stackbase && 
-            faultaddress < stacktop)
-        {
-                paddr = (faultaddress - stackbase) + as->as_stackpbase;
-                found = true;
+        rg = as_findregion(as, faultaddress);
+        if (rg == NULL || rg->rg_perm == 0) {
+                /* Not mapped, or mapped with PROT_NONE */
+                return EFAULT;
         }
 
-        if (!found) {
-                return EFAULT;
+        writeable = (rg->rg_perm & VM_W) || as->as_loading;
+        if (faulttype != VM_FAULT_READ && !writeable) {
+                /* Return operation not permitted error */
+                return EPERM;
         }
 
+        pte = pt_lookup(pt, faultaddress, true);
+        if (pte == NULL) {
+                return ENOMEM;
+        }
+
+        spinlock_acquire(&pt->pt_lock);
+        curcpu->c_tlb_faults++;
+
+        /* Wait for the pageout code if it is in the middle of this page */
+        while (*pte & PTE_BUSY) {
+                wchan_sleep(pt->pt_wchan, &pt->pt_lock);
+        }
+
+        result = 0;
+        oldpa = 0;
+        if (!(*pte & (PTE_VALID | PTE_SWAPPED)) && rg->rg_obj != NULL &&
+            faultaddress - rg->rg_vbase < rg->rg_filesz) {
+                result = vm_filein(pt, pte, rg, faultaddress,
+                                   faulttype != VM_FAULT_READ);
+        }
+        else if (!(*pte & PTE_VALID)) {
+                result = vm_pagein(pt, pte, faultaddress,
+                                   rg->rg_perm & VM_W);
+        }
+
+        /* First write through a shared mapping that was only read */
+        if (result == 0 && (*pte & PTE_SHARED) && !(*pte & PTE_WRITE) &&
+            faulttype != VM_FAULT_READ) {
+                vmobject_addwriter(*pte & PTE_FRAME);
+                *pte |= PTE_WRITE;
+        }
+
+        /* Page shared with another address space since fork */
+        if (result == 0 && (*pte & PTE_COW)) {
+                result = vm_breakcow(pt, pte, faultaddress,
+                                     faulttype != VM_FAULT_READ, &oldpa);
+        }
+        if (result) {
+                spinlock_release(&pt->pt_lock);
+                return result;
+        }
+        paddr = *pte & PTE_FRAME;
+
 	/* make sure it's page-aligned */
 	KASSERT((paddr & PAGE_FRAME) == paddr);
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
-	spl = splhigh();
+        /* Only a hint for the clock, so no need for the coremap lock */
+        coremap[paddr / PAGE_SIZE].referenced = true;
 
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_read(&ehi, &elo, i);
-		if (elo & TLBLO_VALID) {
-			continue;
-		}
-		ehi = faultaddress;
-		elo = paddr | TLBLO_VALID;
-                if (!readonly) {
+	ehi = faultaddress;
+	elo = paddr | TLBLO_VALID;
+        if (*pte & PTE_SHARED) {
+                /* Writes have to be counted first; see above */
+                if (*pte & PTE_WRITE) {
                         elo |= TLBLO_DIRTY;
                 }
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-		tlb_write(ehi, elo, i);
-		splx(spl);
-		return 0;
-	}
-
-        /* Overwrite a random entry if TLB is filled */
-        ehi = faultaddress;
-        elo = paddr | TLBLO_VALID;
-        if (!readonly) {
+        }
+        else if (writeable && !(*pte & PTE_COW)) {
                 elo |= TLBLO_DIRTY;
         }
-        tlb_random(ehi, elo);
-	splx(spl);
+	DEBUG(DB_VM, "vm: 0x%x -> 0x%x\n", faultaddress, paddr);
+
+        /* Still holding the page table lock, so it can't be paged out */
+        vm_tlbload(ehi, elo);
+
+        spinlock_release(&pt->pt_lock);
+
+        if (oldpa != 0) {
+                free_upage(oldpa);
+        }
 
         return 0;
 }
@@ -0,0 +1,862 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vm.h>
+#include <coremap.h>
+#include <vmobject.h>
+
+/*
+ * vn_mobj and mo_refcount are protected by this lock. An object whose
+ * count has dropped to zero stays attached to its vnode while its
+ * pages are written back; vmobject_get waits on vmobject_wchan for it
+ * to go away rather than reviving it.
+ */
+static struct spinlock vmobject_reflock = SPINLOCK_INITIALIZER;
+static struct wchan *vmobject_wchan;
+
+/*
+ * Buckets in a page hash table. It starts small and doubles whenever
+ * there are more than two entries per bucket, up to one page of
+ * buckets; beyond that the chains just get longer.
+ */
+#define VMOBJECT_MINHASH 8
+#define VMOBJECT_MAXHASH (PAGE_SIZE / sizeof(struct vmpage *))
+
+void
+vmobject_bootstrap(void)
+{
+        vmobject_wchan = wchan_create("vmobject");
+        if (vmobject_wchan == NULL) {
+                panic("vmobject_bootstrap: could not create wchan\n");
+        }
+}
+
+static
+struct vmobject *
+vmobject_create(struct vnode *vn)
+{
+        struct vmobject *obj;
+
+        obj = kmalloc(sizeof(struct vmobject));
+        if (obj == NULL) {
+                return NULL;
+        }
+        obj->mo_hash = kmalloc(VMOBJECT_MINHASH * sizeof(struct vmpage *));
+        if (obj->mo_hash == NULL) {
+                kfree(obj);
+                return NULL;
+        }
+        bzero(obj->mo_hash, VMOBJECT_MINHASH * sizeof(struct vmpage *));
+        obj->mo_wchan = wchan_create("vmobject");
+        if (obj->mo_wchan == NULL) {
+                kfree(obj->mo_hash);
+                kfree(obj);
+                return NULL;
+        }
+        spinlock_init(&obj->mo_lock);
+        obj->mo_hashsize = VMOBJECT_MINHASH;
+        obj->mo_count = 0;
+        obj->mo_refcount = 1;
+
+        VOP_INCREF(vn);
+        obj->mo_vnode = vn;
+
+        return obj;
+}
+
+static
+void
+vmobject_destroy(struct vmobject *obj)
+{
+        KASSERT(obj->mo_count == 0);
+        VOP_DECREF(obj->mo_vnode);
+        kfree(obj->mo_hash);
+        spinlock_cleanup(&obj->mo_lock);
+        wchan_destroy(obj->mo_wchan);
+        kfree(obj);
+}
+
+static
+unsigned
+vmobject_hash(struct vmobject *obj, unsigned idx)
+{
+        return idx & (obj->mo_hashsize - 1);
+}
+
+/*
+ * Find the entry for page IDX, or NULL if there is none. Called with
+ * the object locked. An entry can go away whenever the lock is let go
+ * unless it is busy.
+ */
+static
+struct vmpage *
+vmobject_page(struct vmobject *obj, unsigned idx)
+{
+        struct vmpage *pg;
+
+        KASSERT(spinlock_do_i_hold(&obj->mo_lock));
+
+        for (pg = obj->mo_hash[vmobject_hash(obj, idx)]; pg != NULL;
+             pg = pg->vp_next) {
+                if (pg->vp_idx == idx) {
+                        return pg;
+                }
+        }
+        return NULL;
+}
+
+/*
+ * Take the entry PG out of the table. The caller frees it, after
+ * letting go of the lock.
+ */
+static
+void
+vmobject_unlink(struct vmobject *obj, struct vmpage *pg)
+{
+        struct vmpage **pp;
+
+        KASSERT(spinlock_do_i_hold(&obj->mo_lock));
+        KASSERT(!pg->vp_busy);
+
+        for (pp = &obj->mo_hash[vmobject_hash(obj, pg->vp_idx)];
+             *pp != pg; pp = &(*pp)->vp_next) {
+                KASSERT(*pp != NULL);
+        }
+        *pp = pg->vp_next;
+        obj->mo_count--;
+}
+
+/*
+ * Double the hash table if it is getting full. Called with the object
+ * locked; the lock is dropped to allocate. Failing is harmless, it
+ * just leaves the chains longer.
+ */
+static
+void
+vmobject_grow(struct vmobject *obj)
+{
+        struct vmpage **hash, **old, *pg;
+        unsigned size, i, oldsize;
+
+        KASSERT(spinlock_do_i_hold(&obj->mo_lock));
+
+        size = obj->mo_hashsize * 2;
+        if (obj->mo_count <= obj->mo_hashsize * 2 ||
+            size > VMOBJECT_MAXHASH) {
+                return;
+        }
+
+        spinlock_release(&obj->mo_lock);
+        hash = kmalloc(size * sizeof(struct vmpage *));
+        spinlock_acquire(&obj->mo_lock);
+        if (hash == NULL) {
+                return;
+        }
+
+        /* Someone else may have grown it meanwhile */
+        if (obj->mo_hashsize * 2 != size) {
+                old = hash;
+        }
+        else {
+                bzero(hash, size * sizeof(struct vmpage *));
+                old = obj->mo_hash;
+                oldsize = obj->mo_hashsize;
+                obj->mo_hash = hash;
+                obj->mo_hashsize = size;
+                for (i = 0; i < oldsize; i++) {
+                        while (old[i] != NULL) {
+                                pg = old[i];
+                                old[i] = pg->vp_next;
+                                pg->vp_next =
+                                        hash[vmobject_hash(obj, pg->vp_idx)];
+                                hash[vmobject_hash(obj, pg->vp_idx)] = pg;
+                        }
+                }
+        }
+
+        spinlock_release(&obj->mo_lock);
+        kfree(old);
+        spinlock_acquire(&obj->mo_lock);
+}
+
+/*
+ * Make sure page IDX has an entry. Called with the object locked; the
+ * lock is dropped to allocate, so look the page up again afterwards.
+ */
+static
+int
+vmobject_reserve(struct vmobject *obj, unsigned idx)
+{
+        struct vmpage *pg;
+
+        KASSERT(spinlock_do_i_hold(&obj->mo_lock));
+
+        if (vmobject_page(obj, idx) != NULL) {
+                return 0;
+        }
+
+        spinlock_release(&obj->mo_lock);
+        pg = kmalloc(sizeof(struct vmpage));
+        spinlock_acquire(&obj->mo_lock);
+        if (pg == NULL) {
+                return ENOMEM;
+        }
+
+        /* Someone else may have added it meanwhile */
+        if (vmobject_page(obj, idx) != NULL) {
+                spinlock_release(&obj->mo_lock);
+                kfree(pg);
+                spinlock_acquire(&obj->mo_lock);
+                return 0;
+        }
+
+        pg->vp_idx = idx;
+        pg->vp_paddr = 0;
+        pg->vp_busy = false;
+        pg->vp_dirty = false;
+        pg->vp_writers = 0;
+        pg->vp_next = obj->mo_hash[vmobject_hash(obj, idx)];
+        obj->mo_hash[vmobject_hash(obj, idx)] = pg;
+        obj->mo_count++;
+
+        vmobject_grow(obj);
+        return 0;
+}
+
+/*
+ * Read or write page IDX of the file from or to the frame PADDR.
+ * Writes stop at the end of the file, so that a mapping that runs
+ * past it doesn't make the file longer. Reads past the end leave the
+ * (zeroed) frame as it is.
+ */
+static
+int
+vmobject_io(struct vmobject *obj, unsigned idx, paddr_t paddr,
+            enum uio_rw rw)
+{
+        struct iovec iov;
+        struct uio ku;
+        struct stat st;
+        off_t pos;
+        size_t len;
+        int result;
+
+        pos = (off_t)idx * PAGE_SIZE;
+        len = PAGE_SIZE;
+
+        if (rw == UIO_WRITE) {
+                result = VOP_STAT(obj->mo_vnode, &st);
+                if (result) {
+                        return result;
+                }
+                if (pos >= st.st_size) {
+                        return 0;
+                }
+                if (st.st_size - pos < (off_t)len) {
+                        len = st.st_size - pos;
+                }
+        }
+
+        uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr), len, pos, rw);
+        if (rw == UIO_READ) {
+                result = VOP_READ(obj->mo_vnode, &ku);
+        }
+        else {
+                result = VOP_WRITE(obj->mo_vnode, &ku);
+                if (result == 0 && ku.uio_resid != 0) {
+                        result = EIO;
+                }
+        }
+
+        return result;
+}
+
+int
+vmobject_get(struct vnode *vn, struct vmobject **ret)
+{
+        struct vmobject *obj, *new;
+
+        new = NULL;
+
+        spinlock_acquire(&vmobject_reflock);
+        while (1) {
+                obj = vn->vn_mobj;
+                if (obj != NULL && obj->mo_refcount > 0) {
+                        obj->mo_refcount++;
+                        break;
+                }
+                if (obj != NULL) {
+                        /* On its way out; wait for it to be gone */
+                        wchan_sleep(vmobject_wchan, &vmobject_reflock);
+                        continue;
+                }
+                if (new != NULL) {
+                        vn->vn_mobj = obj = new;
+                        new = NULL;
+                        break;
+                }
+
+                spinlock_release(&vmobject_reflock);
+                new = vmobject_create(vn);
+                if (new == NULL) {
+                        return ENOMEM;
+                }
+                spinlock_acquire(&vmobject_reflock);
+        }
+        spinlock_release(&vmobject_reflock);
+
+        /* Lost a race to create it */
+        if (new != NULL) {
+                vmobject_destroy(new);
+        }
+
+        *ret = obj;
+        return 0;
+}
+
+void
+vmobject_incref(struct vmobject *obj)
+{
+        spinlock_acquire(&vmobject_reflock);
+        KASSERT(obj->mo_refcount > 0);
+        obj->mo_refcount++;
+        spinlock_release(&vmobject_reflock);
+}
+
+
+/*
+ * Get the entry for page IDX, creating it if needed, and wait until
+ * it isn't busy. Called with the object locked, which may be dropped
+ * meanwhile.
+ */
+static
+int
+vmobject_getpage(struct vmobject *obj, unsigned idx, struct vmpage **ret)
+{
+        struct vmpage *pg;
+        int result;
+
+        while (1) {
+                pg = vmobject_page(obj, idx);
+                if (pg == NULL) {
+                        result = vmobject_reserve(obj, idx);
+                        if (result) {
+                                return result;
+                        }
+                        continue;
+                }
+                if (pg->vp_busy) {
+                        wchan_sleep(obj->mo_wchan, &obj->mo_lock);
+                        continue;
+                }
+                *ret = pg;
+                return 0;
+        }
+}
+
+void
+vmobject_decref(struct vmobject *obj)
+{
+        struct vnode *vn;
+        struct vmpage *pg;
+        paddr_t pa;
+        unsigned i;
+        bool last;
+        int result;
+
+        spinlock_acquire(&vmobject_reflock);
+        KASSERT(obj->mo_refcount > 0);
+        obj->mo_refcount--;
+        last = obj->mo_refcount == 0;
+        spinlock_release(&vmobject_reflock);
+
+        if (!last) {
+                return;
+        }
+
+        /* Nothing maps it any more, so no page can gain a writer */
+        result = vmobject_sync(obj, 0, (unsigned)-1);
+        if (result) {
+                kprintf("vmobject: writeback failed: %s\n",
+                        strerror(result));
+        }
+
+        /*
+         * Let go of the frames. A frame the pageout code is busy with
+         * may still be freed here; free_upage waits for it. Nobody
+         * adds pages now, so the table doesn't change size.
+         */
+        spinlock_acquire(&obj->mo_lock);
+        for (i = 0; i < obj->mo_hashsize; i++) {
+                while (obj->mo_hash[i] != NULL) {
+                        pg = obj->mo_hash[i];
+                        if (pg->vp_busy) {
+                                wchan_sleep(obj->mo_wchan, &obj->mo_lock);
+                                continue;
+                        }
+                        vmobject_unlink(obj, pg);
+                        pa = pg->vp_paddr;
+                        spinlock_release(&obj->mo_lock);
+                        if (pa != 0) {
+                                free_upage(pa);
+                        }
+                        kfree(pg);
+                        spinlock_acquire(&obj->mo_lock);
+                }
+        }
+        spinlock_release(&obj->mo_lock);
+
+        vn = obj->mo_vnode;
+        spinlock_acquire(&vmobject_reflock);
+        KASSERT(vn->vn_mobj == obj);
+        vn->vn_mobj = NULL;
+        wchan_wakeall(vmobject_wchan, &vmobject_reflock);
+        spinlock_release(&vmobject_reflock);
+
+        vmobject_destroy(obj);
+}
+
+int
+vmobject_fault(struct vmobject *obj, unsigned idx, bool write, paddr_t *ret)
+{
+        struct vmpage *pg;
+        paddr_t pa;
+        int result;
+
+        spinlock_acquire(&obj->mo_lock);
+        result = vmobject_getpage(obj, idx, &pg);
+        if (result) {
+                spinlock_release(&obj->mo_lock);
+                return result;
+        }
+
+        if (pg->vp_paddr != 0) {
+                pa = pg->vp_paddr;
+                if (write) {
+                        pg->vp_dirty = true;
+                        pg->vp_writers++;
+                }
+                spinlock_acquire(&coremap_lock);
+                coremap_incref(pa);
+                coremap[pa / PAGE_SIZE].referenced = true;
+                spinlock_release(&coremap_lock);
+                spinlock_release(&obj->mo_lock);
+
+                *ret = pa;
+                return 0;
+        }
+
+        /* Not cached: read it in, keeping others off it meanwhile */
+        pg->vp_busy = true;
+        spinlock_release(&obj->mo_lock);
+
+        pa = alloc_upage();
+        if (pa == 0) {
+                result = ENOMEM;
+        }
+        else {
+                result = vmobject_io(obj, idx, pa, UIO_READ);
+        }
+
+        /* Being busy, the entry is still there */
+        spinlock_acquire(&obj->mo_lock);
+        pg->vp_busy = false;
+        wchan_wakeall(obj->mo_wchan, &obj->mo_lock);
+        if (result) {
+                vmobject_unlink(obj, pg);
+                spinlock_release(&obj->mo_lock);
+                kfree(pg);
+                if (pa != 0) {
+                        free_upage(pa);
+                }
+                return result;
+        }
+
+        /* The cache keeps the reference from alloc_upage */
+        pg->vp_paddr = pa;
+        pg->vp_dirty = write;
+        pg->vp_writers = write ? 1 : 0;
+        spinlock_acquire(&coremap_lock);
+        coremap_setobj(pa, obj, idx);
+        coremap_incref(pa);
+        spinlock_release(&coremap_lock);
+        spinlock_release(&obj->mo_lock);
+
+        *ret = pa;
+        return 0;
+}
+
+/*
+ * Find the cache entry of a frame that is mapped by the caller (so it
+ * cannot be evicted or freed meanwhile). Returns with the object
+ * locked.
+ */
+static
+struct vmpage *
+vmobject_lookup(paddr_t paddr, struct vmobject **retobj)
+{
+        struct vmobject *obj;
+        struct vmpage *pg;
+        unsigned idx;
+
+        spinlock_acquire(&coremap_lock);
+        obj = coremap[paddr / PAGE_SIZE].obj;
+        idx = coremap[paddr / PAGE_SIZE].objidx;
+        spinlock_release(&coremap_lock);
+
+        KASSERT(obj != NULL);
+        spinlock_acquire(&obj->mo_lock);
+        pg = vmobject_page(obj, idx);
+        KASSERT(pg != NULL && pg->vp_paddr == paddr);
+
+        *retobj = obj;
+        return pg;
+}
+
+void
+vmobject_addwriter(paddr_t paddr)
+{
+        struct vmobject *obj;
+        struct vmpage *pg;
+
+        pg = vmobject_lookup(paddr, &obj);
+        pg->vp_dirty = true;
+        pg->vp_writers++;
+        spinlock_release(&obj->mo_lock);
+}
+
+void
+vmobject_unwrite(paddr_t paddr)
+{
+        struct vmobject *obj;
+        struct vmpage *pg;
+
+        pg = vmobject_lookup(paddr, &obj);
+        KASSERT(pg->vp_writers > 0);
+        pg->vp_writers--;
+        spinlock_release(&obj->mo_lock);
+}
+
+/*
+ * Write back page PG if it is dirty. Called with the object locked
+ * and PG not busy; the lock is dropped for the I/O, but PG, being
+ * busy meanwhile, stays in the table.
+ */
+static
+int
+vmobject_syncpage(struct vmobject *obj, struct vmpage *pg)
+{
+        paddr_t pa;
+        int result;
+
+        KASSERT(spinlock_do_i_hold(&obj->mo_lock));
+        KASSERT(!pg->vp_busy);
+
+        if (pg->vp_paddr == 0 || !pg->vp_dirty) {
+                return 0;
+        }
+
+        /*
+         * Clean from now on, unless some mapping may still be
+         * writing to it (or the write fails).
+         */
+        pa = pg->vp_paddr;
+        pg->vp_busy = true;
+        if (pg->vp_writers == 0) {
+                pg->vp_dirty = false;
+        }
+        spinlock_release(&obj->mo_lock);
+
+        result = vmobject_io(obj, pg->vp_idx, pa, UIO_WRITE);
+
+        spinlock_acquire(&obj->mo_lock);
+        pg->vp_busy = false;
+        if (result) {
+                pg->vp_dirty = true;
+        }
+        wchan_wakeall(obj->mo_wchan, &obj->mo_lock);
+
+        return result;
+}
+
+/*
+ * A few pages are looked up one by one; for more than that, the whole
+ * table is walked. The walk starts over if it had to wait for a busy
+ * page, or if the table was resized while the lock was dropped.
+ */
+int
+vmobject_sync(struct vmobject *obj, unsigned idx, unsigned npages)
+{
+        struct vmpage *pg;
+        unsigned i, size;
+        int result, err;
+
+        result = 0;
+
+        spinlock_acquire(&obj->mo_lock);
+        if (npages <= obj->mo_hashsize) {
+                i = idx;
+                while (i - idx < npages) {
+                        pg = vmobject_page(obj, i);
+                        if (pg != NULL && pg->vp_busy) {
+                                wchan_sleep(obj->mo_wchan, &obj->mo_lock);
+                                continue;
+                        }
+                        if (pg != NULL) {
+                                err = vmobject_syncpage(obj, pg);
+                                if (err && result == 0) {
+                                        result = err;
+                                }
+                        }
+                        i++;
+                }
+                spinlock_release(&obj->mo_lock);
+                return result;
+        }
+
+again:
+        size = obj->mo_hashsize;
+        for (i = 0; i < size; i++) {
+                for (pg = obj->mo_hash[i]; pg != NULL; pg = pg->vp_next) {
+                        if (pg->vp_idx - idx >= npages ||
+                            pg->vp_paddr == 0 || !pg->vp_dirty) {
+                                continue;
+                        }
+                        if (pg->vp_busy) {
+                                wchan_sleep(obj->mo_wchan, &obj->mo_lock);
+                                goto again;
+                        }
+                        err = vmobject_syncpage(obj, pg);
+                        if (err && result == 0) {
+                                result = err;
+                        }
+                        if (obj->mo_hashsize != size) {
+                                goto again;
+                        }
+                }
+        }
+        spinlock_release(&obj->mo_lock);
+
+        return result;
+}
+
+int
+vmobject_evict(struct vmobject *obj, unsigned idx, paddr_t paddr)
+{
+        struct vmpage *pg;
+        bool ok, dirty;
+        int result;
+
+        spinlock_acquire(&obj->mo_lock);
+        pg = vmobject_page(obj, idx);
+        ok = pg != NULL && pg->vp_paddr == paddr && !pg->vp_busy;
+        if (ok) {
+                spinlock_acquire(&coremap_lock);
+                ok = coremap_refcount(paddr) == 1;
+                spinlock_release(&coremap_lock);
+        }
+        if (!ok) {
+                spinlock_release(&obj->mo_lock);
+                return EAGAIN;
+        }
+
+        /* Busy, so it can't be mapped again from here on */
+        KASSERT(pg->vp_writers == 0);
+        pg->vp_busy = true;
+        dirty = pg->vp_dirty;
+        pg->vp_dirty = false;
+        spinlock_release(&obj->mo_lock);
+
+        result = dirty ? vmobject_io(obj, idx, paddr, UIO_WRITE) : 0;
+
+        spinlock_acquire(&obj->mo_lock);
+        pg->vp_busy = false;
+        wchan_wakeall(obj->mo_wchan, &obj->mo_lock);
+        if (result) {
+                pg->vp_dirty = true;
+                spinlock_release(&obj->mo_lock);
+                return result;
+        }
+        vmobject_unlink(obj, pg);
+        spinlock_release(&obj->mo_lock);
+
+        kfree(pg);
+        return 0;
+}
+
+/*
+ * Get a reference to VN's page cache if it has a live one. One that is
+ * on its way out is waited for (its pages get written back as it
+ * goes), and then we report there is none, setting *WAITED.
+ */
+static
+struct vmobject *
+vmobject_find(struct vnode *vn, bool *waited)
+{
+        struct vmobject *obj;
+
+        *waited = false;
+
+        spinlock_acquire(&vmobject_reflock);
+        while (1) {
+                obj = vn->vn_mobj;
+                if (obj == NULL || obj->mo_refcount > 0) {
+                        break;
+                }
+                wchan_sleep(vmobject_wchan, &vmobject_reflock);
+                *waited = true;
+        }
+        if (obj != NULL) {
+                obj->mo_refcount++;
+        }
+        spinlock_release(&vmobject_reflock);
+
+        return obj;
+}
+
+int
+vmobject_flush(struct vnode *vn, off_t pos, size_t len)
+{
+        struct vmobject *obj;
+        unsigned first, last;
+        bool waited;
+        int result;
+
+        if (len == 0) {
+                return 0;
+        }
+
+        obj = vmobject_find(vn, &waited);
+        if (obj == NULL) {
+                return 0;
+        }
+
+        first = pos / PAGE_SIZE;
+        last = (pos + len - 1) / PAGE_SIZE;
+        result = vmobject_sync(obj, first, last - first + 1);
+
+        vmobject_decref(obj);
+        return result;
+}
+
+bool
+vmobject_update(struct vnode *vn, off_t pos, const void *data, size_t len)
+{
+        struct vmobject *obj;
+        struct vmpage *pg;
+        const char *src = data;
+        unsigned idx;
+        size_t off, n;
+        bool waited;
+
+        obj = vmobject_find(vn, &waited);
+        if (obj == NULL) {
+                /* A dying cache may have written stale pages over it */
+                return waited;
+        }
+
+        spinlock_acquire(&obj->mo_lock);
+        while (len > 0) {
+                idx = pos / PAGE_SIZE;
+                off = pos % PAGE_SIZE;
+                n = PAGE_SIZE - off;
+                if (n > len) {
+                        n = len;
+                }
+                pg = vmobject_page(obj, idx);
+                if (pg != NULL && pg->vp_busy) {
+                        wchan_sleep(obj->mo_wchan, &obj->mo_lock);
+                        continue;
+                }
+
+                /*
+                 * Dirty, so that if it was written back between the
+                 * write and now, the new data goes out again.
+                 */
+                if (pg != NULL && pg->vp_paddr != 0) {
+                        memcpy((char *)PADDR_TO_KVADDR(pg->vp_paddr) + off,
+                               src, n);
+                        pg->vp_dirty = true;
+                }
+
+                pos += n;
+                src += n;
+                len -= n;
+        }
+        spinlock_release(&obj->mo_lock);
+
+        vmobject_decref(obj);
+        return false;
+}
+
+void
+vmobject_truncate(struct vnode *vn, off_t len)
+{
+        struct vmobject *obj;
+        struct vmpage *pg, *gone;
+        off_t start;
+        size_t off;
+        unsigned i;
+        bool waited, mapped;
+
+        obj = vmobject_find(vn, &waited);
+        if (obj == NULL) {
+                /* Writeback of a dying cache stops at the end of file */
+                return;
+        }
+
+        /*
+         * Pages only the cache refers to are dropped; the others are
+         * zeroed past the end, so they read as the file would if it
+         * grew back. Writeback of what is wholly past the end does
+         * nothing, as it stops at the end of the file.
+         */
+        gone = NULL;
+        spinlock_acquire(&obj->mo_lock);
+again:
+        for (i = 0; i < obj->mo_hashsize; i++) {
+                pg = obj->mo_hash[i];
+                while (pg != NULL) {
+                        start = (off_t)pg->vp_idx * PAGE_SIZE;
+                        if (pg->vp_paddr == 0 ||
+                            start + PAGE_SIZE <= len) {
+                                pg = pg->vp_next;
+                                continue;
+                        }
+                        if (pg->vp_busy) {
+                                wchan_sleep(obj->mo_wchan, &obj->mo_lock);
+                                goto again;
+                        }
+                        off = len > start ? len - start : 0;
+                        spinlock_acquire(&coremap_lock);
+                        mapped = coremap_refcount(pg->vp_paddr) > 1;
+                        spinlock_release(&coremap_lock);
+                        if (off == 0 && !mapped) {
+                                vmobject_unlink(obj, pg);
+                                pg->vp_next = gone;
+                                gone = pg;
+                                /* the chain changed; look at it again */
+                                pg = obj->mo_hash[i];
+                                continue;
+                        }
+                        bzero((char *)PADDR_TO_KVADDR(pg->vp_paddr) + off,
+                              PAGE_SIZE - off);
+                        pg = pg->vp_next;
+                }
+        }
+        spinlock_release(&obj->mo_lock);
+
+        while (gone != NULL) {
+                pg = gone;
+                gone = pg->vp_next;
+                free_upage(pg->vp_paddr);
+                kfree(pg);
+        }
+
+        vmobject_decref(obj);
+}
@@ -40,6 +40,7 @@
  */
 #include <kern/fcntl.h>
 #include <kern/ioctl.h>
+#include <kern/mman.h>
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
@@ -141,6 +142,11 @@ int chdir(const char *path);
 
 /* Optional. */
 void *sbrk(__intptr_t change);
+#define MAP_FAILED ((void *)-1)		/* mmap's error return */
+void *mmap(void *addr, size_t length, int prot, int flags,
+	   int filehandle, off_t offset);
+int munmap(void *addr, size_t length);
+int msync(void *addr, size_t length, int flags);
 ssize_t getdirentry(int filehandle, char *buf, size_t buflen);
 int symlink(const char *target, const char *linkname);
 ssize_t readlink(const char *path, char *buf, size_t buflen);
@@ -159,6 +159,9 @@ dumpsb(void)
 	printf("----------\n");
 	dumpvalf("Magic", "0x%8x", SWAP32(sb.sb_magic));
 	dumpvalf("Size", "%u blocks", SWAP32(sb.sb_nblocks));
+	dumpvalf("Index generation", "%u", SWAP32(sb.sb_dhgen));
+	dumpvalf("Unmounted cleanly", "%s",
+		 SWAP32(sb.sb_dirty) ? "no" : "yes");
 	dumpvalf("Freemap size", "%u blocks",
 		 SFS_FREEMAPBLOCKS(SWAP32(sb.sb_nblocks)));
 	dumpvalf("Block size", "%u bytes", SFS_BLOCKSIZE);
@@ -228,9 +231,13 @@ dumpfreemap(uint32_t fsblocks)
 	printf("\n");
 }
 
+/*
+ * Dump an indirect block at level LEVEL (1 for the one that points to
+ * data blocks), and the indirect blocks under it.
+ */
 static
 void
-dumpindirect(uint32_t block)
+dumpindirect(uint32_t block, unsigned level)
 {
 	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
 	char tmp[128];
@@ -239,7 +246,7 @@ dumpindirect(uint32_t block)
 	if (block == 0) {
 		return;
 	}
-	printf("Indirect block %u\n", block);
+	printf("Indirect block %u (level %u)\n", block, level);
 
 	diskread(ib, block);
 	for (i=0; i<ARRAYCOUNT(ib); i++) {
@@ -253,12 +260,21 @@ dumpindirect(uint32_t block)
 			printf("\n");
 		}
 	}
+	if (level > 1) {
+		for (i=0; i<ARRAYCOUNT(ib); i++) {
+			dumpindirect(SWAP32(ib[i]), level - 1);
+		}
+	}
 }
 
+/*
+ * Traverse the part of a file mapped by the indirect block BLOCK, at
+ * level LEVEL, which starts at file block FILEBLOCK.
+ */
 static
 uint32_t
 traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
-	    void (*doblock)(uint32_t, uint32_t))
+	    unsigned level, void (*doblock)(uint32_t, uint32_t))
 {
 	uint32_t ib[SFS_BLOCKSIZE/sizeof(uint32_t)];
 	unsigned i;
@@ -270,7 +286,14 @@ traverse_ib(uint32_t fileblock, uint32_t numblocks, uint32_t block,
 		diskread(ib, block);
 	}
 	for (i=0; i<ARRAYCOUNT(ib) && fileblock < numblocks; i++) {
-		doblock(fileblock++, SWAP32(ib[i]));
+		if (level > 1) {
+			fileblock = traverse_ib(fileblock, numblocks,
+						SWAP32(ib[i]), level - 1,
+						doblock);
+		}
+		else {
+			doblock(fileblock++, SWAP32(ib[i]));
+		}
 	}
 	return fileblock;
 }
@@ -291,7 +314,15 @@ traverse(const struct sfs_dinode *sfi, void (*doblock)(uint32_t, uint32_t))
 	}
 	if (fileblock < numblocks) {
 		fileblock = traverse_ib(fileblock, numblocks,
-					SWAP32(sfi->sfi_indirect), doblock);
+					SWAP32(sfi->sfi_indirect), 1, doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_dindirect), 2, doblock);
+	}
+	if (fileblock < numblocks) {
+		fileblock = traverse_ib(fileblock, numblocks,
+					SWAP32(sfi->sfi_tindirect), 3, doblock);
 	}
 	assert(fileblock == numblocks);
 }
@@ -324,6 +355,52 @@ dumpdirblock(uint32_t fileblock, uint32_t diskblock)
 	}
 }
 
+static
+void
+dumpdirhash(const struct sfs_dinode *sfi)
+{
+	struct sfs_dirhashent ents[SFS_DHPERBLOCK];
+	uint32_t map[SFS_DBPERIDB];
+	uint32_t nbuckets, mapblock, block, slot;
+	unsigned i, j, k, bucket;
+
+	nbuckets = SWAP32(sfi->sfi_dirhash);
+	printf("Directory index: %u buckets\n", nbuckets);
+	for (i=0; i<SFS_NDIRHASH &&
+		     i*SFS_DBPERIDB*SFS_DHPERBLOCK < nbuckets; i++) {
+		mapblock = SWAP32(sfi->sfi_dirhashblocks[i]);
+		if (mapblock == 0) {
+			continue;
+		}
+		diskread(map, mapblock);
+		printf("    [map block %u]\n", mapblock);
+		for (j=0; j<SFS_DBPERIDB; j++) {
+			block = SWAP32(map[j]);
+			if (block == 0) {
+				continue;
+			}
+			diskread(ents, block);
+			printf("    [block %u]\n", block);
+			for (k=0; k<SFS_DHPERBLOCK; k++) {
+				slot = SWAP32(ents[k].sdh_slot);
+				if (slot == SFS_DH_EMPTY) {
+					continue;
+				}
+				bucket = (i*SFS_DBPERIDB + j)*SFS_DHPERBLOCK
+					+ k;
+				printf("        @%-6u 0x%08x ", bucket,
+				       SWAP32(ents[k].sdh_hash));
+				if (slot == SFS_DH_DELETED) {
+					printf("[deleted]\n");
+				}
+				else {
+					printf("slot %u\n", slot - 1);
+				}
+			}
+		}
+	}
+}
+
 static
 void
 dumpdir(uint32_t ino, const struct sfs_dinode *sfi)
@@ -336,6 +413,9 @@ dumpdir(uint32_t ino, const struct sfs_dinode *sfi)
 	}
 	printf("Directory contents for inode %u: %d entries\n", ino, nentries);
 	traverse(sfi, dumpdirblock);
+	if (sfi->sfi_dirhash != 0) {
+		dumpdirhash(sfi);
+	}
 }
 
 static
@@ -476,6 +556,24 @@ dumpinode(uint32_t ino, const char *name)
 	}
 	printf("    Indirect block: %u (0x%x)\n",
 	       SWAP32(sfi.sfi_indirect), SWAP32(sfi.sfi_indirect));
+	printf("    Double indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_dindirect), SWAP32(sfi.sfi_dindirect));
+	printf("    Triple indirect block: %u (0x%x)\n",
+	       SWAP32(sfi.sfi_tindirect), SWAP32(sfi.sfi_tindirect));
+	if (sfi.sfi_dirhash != 0 || sfi.sfi_dhused != 0 ||
+	    sfi.sfi_dhdeleted != 0 || sfi.sfi_dhgen != 0) {
+		printf("    Directory index: %u buckets, %u used, %u deleted, "
+		       "generation %u\n",
+		       SWAP32(sfi.sfi_dirhash), SWAP32(sfi.sfi_dhused),
+		       SWAP32(sfi.sfi_dhdeleted), SWAP32(sfi.sfi_dhgen));
+	}
+	for (i=0; i<SFS_NDIRHASH; i++) {
+		if (sfi.sfi_dirhashblocks[i] != 0) {
+			printf("    Index map block %u: %u (0x%x)\n", i,
+			       SWAP32(sfi.sfi_dirhashblocks[i]),
+			       SWAP32(sfi.sfi_dirhashblocks[i]));
+		}
+	}
 	for (i=0; i<ARRAYCOUNT(sfi.sfi_waste); i++) {
 		if (sfi.sfi_waste[i] != 0) {
 			printf("    Word %u in waste area: 0x%x\n",
@@ -484,7 +582,9 @@ dumpinode(uint32_t ino, const char *name)
 	}
 
 	if (doindirect) {
-		dumpindirect(SWAP32(sfi.sfi_indirect));
+		dumpindirect(SWAP32(sfi.sfi_indirect), 1);
+		dumpindirect(SWAP32(sfi.sfi_dindirect), 2);
+		dumpindirect(SWAP32(sfi.sfi_tindirect), 3);
 	}
 
 	if (SWAP16(sfi.sfi_type) == SFS_TYPE_DIR && dodirs) {
@@ -73,6 +73,8 @@ check(void)
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(SFS_BLOCKSIZE % sizeof(struct sfs_dirhashent) == 0);
+	assert((SFS_DIRHASH_MIN & (SFS_DIRHASH_MIN - 1)) == 0);
 }
 
 /*
@@ -179,6 +181,12 @@ writerootdir(void)
 	sfi.sfi_type = SWAP16(SFS_TYPE_DIR);
 	sfi.sfi_linkcount = SWAP16(1);
 
+	/*
+	 * The root directory is usually the biggest, so give it an
+	 * index from the start. It's empty, so it needs no blocks yet.
+	 */
+	sfi.sfi_dirhash = SWAP32(SFS_DIRHASH_MIN);
+
 	/* Write it out */
 	diskwrite(&sfi, SFS_ROOTDIR_INO);
 }
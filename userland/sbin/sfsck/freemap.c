@@ -107,6 +107,10 @@ blockusagestr(blockusage_t how, uint32_t howdesc)
 		snprintf(rv, sizeof(rv), "directory data from inode %lu",
 			 (unsigned long) howdesc);
 		break;
+	    case B_DIRHASH:
+		snprintf(rv, sizeof(rv), "directory index from inode %lu",
+			 (unsigned long) howdesc);
+		break;
 	    case B_DATA:
 		snprintf(rv, sizeof(rv), "file data from inode %lu",
 			 (unsigned long) howdesc);
@@ -91,6 +91,7 @@ main(int argc, char **argv)
 	printf("Phase 3 -- check reference counts\n");
 	inode_adjust_filelinks();
 
+	sb_markclean();
 	closedisk();
 
 	warnx("%lu blocks used (of %lu); %lu directories; %lu files",
@@ -277,6 +277,14 @@ pass1_inode(uint32_t ino, struct sfs_dinode *sfi, int alreadychanged)
 		changed = 1;
 	}
 
+	if (!isdir && sfsdir_hasindex(sfi)) {
+		warnx("Inode %lu: directory index fields set in a file "
+		      "(cleared)", (unsigned long) ino);
+		setbadness(EXIT_RECOV);
+		sfsdir_dropindex(sfi);
+		changed = 1;
+	}
+
 	if (check_inode_blocks(ino, sfi, isdir)) {
 		changed = 1;
 	}
@@ -350,6 +358,187 @@ pass1_direntry(const char *path, uint32_t index, struct sfs_direntry *sfd)
 	return dchanged;
 }
 
+/*
+ * Check the index of a directory, loaded into SFI, against its
+ * entries D[0..ND-1]. Returns NULL if it's good, or what's wrong
+ * with it.
+ */
+static
+const char *
+check_dirindex(const struct sfs_dinode *sfi,
+	       const struct sfs_direntry *d, uint32_t nd)
+{
+	struct sfs_dirhashent *table;
+	const char *problem;
+	uint32_t *blocks;
+	uint32_t n, mask, nblocks, nmaps, block, used, deleted, live, slot;
+	uint32_t i, j;
+
+	n = sfi->sfi_dirhash;
+	if (n > SFS_DIRHASH_MAX || (n & (n-1)) != 0) {
+		return "has invalid size";
+	}
+	nblocks = (n + SFS_DHPERBLOCK - 1) / SFS_DHPERBLOCK;
+	nmaps = (nblocks + SFS_DBPERIDB - 1) / SFS_DBPERIDB;
+	for (i=0; i<SFS_NDIRHASH; i++) {
+		block = sfi->sfi_dirhashblocks[i];
+		if (block >= sb_totalblocks()) {
+			return "has a block outside of volume";
+		}
+		if (i >= nmaps && block != 0) {
+			return "has blocks past its end";
+		}
+	}
+
+	/* Load the index block numbers out of the map blocks */
+	blocks = domalloc(nmaps * SFS_BLOCKSIZE);
+	for (i=0; i<nmaps; i++) {
+		block = sfi->sfi_dirhashblocks[i];
+		if (block == 0) {
+			memset(&blocks[i*SFS_DBPERIDB], 0, SFS_BLOCKSIZE);
+		}
+		else {
+			sfs_readindirect(block, &blocks[i*SFS_DBPERIDB]);
+		}
+	}
+	for (i=0; i<nmaps*SFS_DBPERIDB; i++) {
+		if (blocks[i] >= sb_totalblocks()) {
+			free(blocks);
+			return "has a block outside of volume";
+		}
+		if (i >= nblocks && blocks[i] != 0) {
+			free(blocks);
+			return "has blocks past its end";
+		}
+	}
+
+	/* Load the whole table; blocks that are 0 are empty buckets */
+	table = domalloc(nblocks * SFS_BLOCKSIZE);
+	for (i=0; i<nblocks; i++) {
+		if (blocks[i] == 0) {
+			memset(&table[i*SFS_DHPERBLOCK], 0, SFS_BLOCKSIZE);
+		}
+		else {
+			sfs_readdirhash(blocks[i], &table[i*SFS_DHPERBLOCK]);
+		}
+	}
+	free(blocks);
+
+	/* Every bucket in use must refer to a matching entry */
+	problem = NULL;
+	used = deleted = 0;
+	for (i=0; i<n; i++) {
+		slot = table[i].sdh_slot;
+		if (slot == SFS_DH_EMPTY) {
+			continue;
+		}
+		if (slot == SFS_DH_DELETED) {
+			deleted++;
+			continue;
+		}
+		used++;
+		if (slot > nd || d[slot-1].sfd_ino == SFS_NOINO ||
+		    table[i].sdh_hash != sfsdir_hash(d[slot-1].sfd_name)) {
+			problem = "does not match entries";
+			goto done;
+		}
+	}
+	if (used != sfi->sfi_dhused || deleted != sfi->sfi_dhdeleted) {
+		problem = "has wrong counts";
+		goto done;
+	}
+	if (used + deleted >= n) {
+		problem = "is full";
+		goto done;
+	}
+
+	/* Every entry must be found where a lookup will probe for it */
+	mask = n - 1;
+	live = 0;
+	for (j=0; j<nd; j++) {
+		if (d[j].sfd_ino == SFS_NOINO) {
+			continue;
+		}
+		live++;
+		i = sfsdir_hash(d[j].sfd_name) & mask;
+		while (table[i].sdh_slot != j+1) {
+			if (table[i].sdh_slot == SFS_DH_EMPTY) {
+				problem = "is missing entries";
+				goto done;
+			}
+			i = (i + 1) & mask;
+		}
+	}
+	if (used != live) {
+		problem = "has duplicate entries";
+	}
+
+ done:
+	free(table);
+	return problem;
+}
+
+/*
+ * Check the index of directory PATH (inode INO, loaded into SFI)
+ * against its entries D[0..ND-1]; DCHANGED says if we've changed
+ * them. A bad index is removed rather than repaired: the kernel makes
+ * a new one when the directory grows. The blocks of an index we keep
+ * are marked in use, and it is stamped with the current generation so
+ * the kernel trusts it; those of one we remove are left for
+ * freemap_check to free.
+ *
+ * Returns nonzero if SFI has been modified and needs to be written
+ * back.
+ */
+static
+int
+pass1_dirindex(uint32_t ino, const char *path, struct sfs_dinode *sfi,
+	       const struct sfs_direntry *d, uint32_t nd, int dchanged)
+{
+	const char *problem;
+	uint32_t map[SFS_DBPERIDB];
+	unsigned i, j;
+
+	if (sfi->sfi_dirhash == 0) {
+		if (!sfsdir_hasindex(sfi)) {
+			return 0;
+		}
+		problem = "fields set without an index";
+	}
+	else if (dchanged) {
+		problem = "out of date";
+	}
+	else {
+		problem = check_dirindex(sfi, d, nd);
+	}
+
+	if (problem != NULL) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory %s: index %s (removed)", path, problem);
+		sfsdir_dropindex(sfi);
+		return 1;
+	}
+
+	for (i=0; i<SFS_NDIRHASH; i++) {
+		if (sfi->sfi_dirhashblocks[i] == 0) {
+			continue;
+		}
+		freemap_blockinuse(sfi->sfi_dirhashblocks[i], B_DIRHASH, ino);
+		sfs_readindirect(sfi->sfi_dirhashblocks[i], map);
+		for (j=0; j<SFS_DBPERIDB; j++) {
+			if (map[j] != 0) {
+				freemap_blockinuse(map[j], B_DIRHASH, ino);
+			}
+		}
+	}
+
+	if (sfi->sfi_dhgen != sb_dhgeneration()) {
+		sfi->sfi_dhgen = sb_dhgeneration();
+		return 1;
+	}
+	return 0;
+}
+
 /*
  * Check a directory. INO is the inode number; PATHSOFAR is the path
  * to this directory. This traverses the volume directory tree
@@ -439,6 +628,11 @@ pass1_dir(uint32_t ino, const char *pathsofar)
 		sfs_writedir(&sfi, direntries, ndirentries);
 	}
 
+	if (pass1_dirindex(ino, pathsofar, &sfi, direntries, ndirentries,
+			   dchanged)) {
+		sfs_writeinode(ino, &sfi);
+	}
+
 	free(direntries);
 }
 
@@ -297,6 +297,20 @@ pass2_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		ichanged = 1;
 	}
 
+	/*
+	 * If the entries changed, the index no longer matches them.
+	 * The freemap has already been written, so its blocks stay
+	 * allocated until we're run again.
+	 */
+
+	if (dchanged && sfsdir_hasindex(&sfi)) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory %s: index out of date (removed)",
+		      pathsofar);
+		sfsdir_dropindex(&sfi);
+		ichanged = 1;
+	}
+
 	/*
 	 * Write back anything that changed, clean up, and return.
 	 */
@@ -114,6 +114,27 @@ sb_freemapblocks(void)
 	return SFS_FREEMAPBLOCKS(sb.sb_nblocks);
 }
 
+/*
+ * Return the generation directory indexes are stamped with.
+ */
+uint32_t
+sb_dhgeneration(void)
+{
+	return sb.sb_dhgen;
+}
+
+/*
+ * Clear the in-use flag, once every directory index has been checked.
+ */
+void
+sb_markclean(void)
+{
+	if (sb.sb_dirty) {
+		sb.sb_dirty = 0;
+		sfs_writesb(SFS_SUPER_BLOCK, &sb);
+	}
+}
+
 /*
  * Return the volume name.
  */
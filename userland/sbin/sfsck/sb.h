@@ -49,6 +49,12 @@ uint32_t sb_freemapblocks(void);
 /* After the superblock is loaded: return volume name. */
 const char *sb_volname(void);
 
+/* After the superblock is loaded: return directory index generation. */
+uint32_t sb_dhgeneration(void);
+
+/* After all the checks: mark the volume as cleanly unmounted. */
+void sb_markclean(void);
+
 /* Check the superblock. Must load it first. */
 void sb_check(void);
 
@@ -51,6 +51,7 @@ sfs_setup(void)
 	assert(sizeof(struct sfs_superblock)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_dinode)==SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_direntry) == 0);
+	assert(SFS_BLOCKSIZE % sizeof(struct sfs_dirhashent) == 0);
 }
 
 ////////////////////////////////////////////////////////////
@@ -62,6 +63,8 @@ swapsb(struct sfs_superblock *sb)
 {
 	sb->sb_magic = SWAP32(sb->sb_magic);
 	sb->sb_nblocks = SWAP32(sb->sb_nblocks);
+	sb->sb_dhgen = SWAP32(sb->sb_dhgen);
+	sb->sb_dirty = SWAP32(sb->sb_dirty);
 }
 
 static
@@ -97,6 +100,14 @@ swapinode(struct sfs_dinode *sfi)
 	for (i=0; i<NUM_III; i++) {
 		SET_III(sfi, i) = SWAP32(GET_III(sfi, i));
 	}
+
+	sfi->sfi_dirhash = SWAP32(sfi->sfi_dirhash);
+	sfi->sfi_dhused = SWAP32(sfi->sfi_dhused);
+	sfi->sfi_dhdeleted = SWAP32(sfi->sfi_dhdeleted);
+	sfi->sfi_dhgen = SWAP32(sfi->sfi_dhgen);
+	for (i=0; i<SFS_NDIRHASH; i++) {
+		sfi->sfi_dirhashblocks[i] = SWAP32(sfi->sfi_dirhashblocks[i]);
+	}
 }
 
 static
@@ -106,6 +117,18 @@ swapdir(struct sfs_direntry *sfd)
 	sfd->sfd_ino = SWAP32(sfd->sfd_ino);
 }
 
+static
+void
+swapdirhash(struct sfs_dirhashent *ents)
+{
+	unsigned i;
+
+	for (i=0; i<SFS_DHPERBLOCK; i++) {
+		ents[i].sdh_hash = SWAP32(ents[i].sdh_hash);
+		ents[i].sdh_slot = SWAP32(ents[i].sdh_slot);
+	}
+}
+
 static
 void
 swapindir(uint32_t *entries)
@@ -264,6 +287,17 @@ sfs_writeindirect(uint32_t blocknum, uint32_t *entries)
 	swapindir(entries);
 }
 
+/*
+ *  directory index blocks - blocknum is a disk block number.
+ */
+
+void
+sfs_readdirhash(uint32_t blocknum, struct sfs_dirhashent *ents)
+{
+	diskread(ents, blocknum);
+	swapdirhash(ents);
+}
+
 ////////////////////////////////////////////////////////////
 // directory I/O
 
@@ -394,6 +428,60 @@ sfs_writedir(const struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd)
 ////////////////////////////////////////////////////////////
 // directory utilities
 
+/*
+ * Check if any of the directory index fields of SFI are set.
+ */
+int
+sfsdir_hasindex(const struct sfs_dinode *sfi)
+{
+	unsigned i;
+
+	if (sfi->sfi_dirhash != 0 || sfi->sfi_dhused != 0 ||
+	    sfi->sfi_dhdeleted != 0 || sfi->sfi_dhgen != 0) {
+		return 1;
+	}
+	for (i=0; i<SFS_NDIRHASH; i++) {
+		if (sfi->sfi_dirhashblocks[i] != 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Clear the directory index fields of SFI. Freeing the index blocks
+ * is up to the caller.
+ */
+void
+sfsdir_dropindex(struct sfs_dinode *sfi)
+{
+	unsigned i;
+
+	sfi->sfi_dirhash = 0;
+	sfi->sfi_dhused = 0;
+	sfi->sfi_dhdeleted = 0;
+	sfi->sfi_dhgen = 0;
+	for (i=0; i<SFS_NDIRHASH; i++) {
+		sfi->sfi_dirhashblocks[i] = 0;
+	}
+}
+
+/*
+ * Hash a name the way the directory index does.
+ */
+uint32_t
+sfsdir_hash(const char *name)
+{
+	uint32_t h;
+
+	h = SFS_DH_FNVBASIS;
+	for (; *name != 0; name++) {
+		h ^= (unsigned char)*name;
+		h *= SFS_DH_FNVPRIME;
+	}
+	return h;
+}
+
 /* this exists because qsort() doesn't pass a context pointer through */
 static struct sfs_direntry *global_sortdirs;
 
@@ -41,6 +41,7 @@
 struct sfs_superblock;
 struct sfs_dinode;
 struct sfs_direntry;
+struct sfs_dirhashent;
 
 /* Call this before anything else in this module */
 void sfs_setup(void);
@@ -65,11 +66,19 @@ void sfs_writeinode(uint32_t inum, struct sfs_dinode *sfi);
 void sfs_readindirect(uint32_t blocknum, uint32_t *entries);
 void sfs_writeindirect(uint32_t blocknum, uint32_t *entries);
 
+/* directory index block */
+void sfs_readdirhash(uint32_t blocknum, struct sfs_dirhashent *ents);
+
 /* directory - ND should be the number of directory entries D points to */
 void sfs_readdir(struct sfs_dinode *sfi, struct sfs_direntry *d, unsigned nd);
 void sfs_writedir(const struct sfs_dinode *sfi,
 		  struct sfs_direntry *d, unsigned nd);
 
+/* Directory index utilities. */
+int sfsdir_hasindex(const struct sfs_dinode *sfi);
+void sfsdir_dropindex(struct sfs_dinode *sfi);
+uint32_t sfsdir_hash(const char *name);
+
 /* Try to add an entry to a directory. */
 int sfsdir_tryadd(struct sfs_direntry *d, int nd,
 		  const char *name, uint32_t ino);
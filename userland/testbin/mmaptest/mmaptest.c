@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2014
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * mmaptest - test shared file mappings.
+ *
+ * Maps a file MAP_SHARED and checks that:
+ *    - the mapping shows the file's contents;
+ *    - a store made by a forked child through the inherited mapping
+ *      is seen by the parent, and msync works;
+ *    - read() sees stores to the mapping, and the mapping sees
+ *      write(), with no msync in between;
+ *    - after munmap, the file holds both the stores and the write(),
+ *      the latter not undone by the writeback of the page;
+ *    - a second, separate mapping of the file sees the same data;
+ *    - truncating the file and growing it back zeroes what was cut
+ *      off, in the mapping and in the file, and unmapping afterwards
+ *      doesn't bring the old data back.
+ */
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <err.h>
+
+#define TESTFILE "mmaptestfile"
+#define PAGESIZE 4096
+#define NPAGES 3
+#define FILESIZE (NPAGES * PAGESIZE)
+
+/* Offsets touched by the tests, on different pages */
+#define CHILDOFF (PAGESIZE + 100)
+#define STOREOFF (2 * PAGESIZE + 10)
+#define WRITEOFF (2 * PAGESIZE + 20)
+
+/* Where the file is truncated to: mid-page, but on a disk block */
+#define CUTOFF (PAGESIZE + 1024)
+
+static const char childmsg[] = "stored by the child";
+static const char storemsg[] = "stored by the parent";
+static const char writemsg[] = "written with write()";
+
+static char buf[FILESIZE];
+
+static
+char
+pattern(unsigned off)
+{
+	return 'a' + (off * 7 + off / PAGESIZE) % 26;
+}
+
+/*
+ * Compute what the whole file should hold after STAGE of the tests.
+ */
+static
+void
+expected(char *exp, unsigned stage)
+{
+	unsigned i;
+
+	for (i = 0; i < FILESIZE; i++) {
+		exp[i] = pattern(i);
+	}
+	if (stage >= 1) {
+		memcpy(exp + CHILDOFF, childmsg, sizeof(childmsg));
+	}
+	if (stage >= 2) {
+		memcpy(exp + STOREOFF, storemsg, sizeof(storemsg));
+		memcpy(exp + WRITEOFF, writemsg, sizeof(writemsg));
+	}
+	if (stage >= 3) {
+		memset(exp + CUTOFF, 0, FILESIZE - CUTOFF);
+	}
+}
+
+static
+void
+check(const char *what, const char *got, unsigned stage)
+{
+	static char exp[FILESIZE];
+	unsigned i;
+
+	expected(exp, stage);
+	for (i = 0; i < FILESIZE; i++) {
+		if (got[i] != exp[i]) {
+			errx(1, "%s: byte %u is %d, should be %d",
+			     what, i, got[i], exp[i]);
+		}
+	}
+}
+
+static
+void
+readfile(int fd, char *into)
+{
+	ssize_t r;
+
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		err(1, "%s: lseek", TESTFILE);
+	}
+	r = read(fd, into, FILESIZE);
+	if (r < 0) {
+		err(1, "%s: read", TESTFILE);
+	}
+	if (r != FILESIZE) {
+		errx(1, "%s: read: short count %zd", TESTFILE, r);
+	}
+}
+
+static
+void
+writeat(int fd, off_t pos, const void *data, size_t len)
+{
+	ssize_t r;
+
+	if (lseek(fd, pos, SEEK_SET) < 0) {
+		err(1, "%s: lseek", TESTFILE);
+	}
+	r = write(fd, data, len);
+	if (r < 0) {
+		err(1, "%s: write", TESTFILE);
+	}
+	if ((size_t)r != len) {
+		errx(1, "%s: write: short count %zd", TESTFILE, r);
+	}
+}
+
+static
+char *
+mapfile(int fd)
+{
+	void *p;
+
+	p = mmap(NULL, FILESIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "%s: mmap", TESTFILE);
+	}
+	return p;
+}
+
+int
+main(void)
+{
+	char *map, *map2;
+	pid_t pid;
+	int fd, status;
+
+	fd = open(TESTFILE, O_RDWR|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: create", TESTFILE);
+	}
+	expected(buf, 0);
+	writeat(fd, 0, buf, FILESIZE);
+
+	printf("Mapping the file...\n");
+	map = mapfile(fd);
+	check("mapping", map, 0);
+
+	printf("Storing through the mapping in a child...\n");
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		memcpy(map + CHILDOFF, childmsg, sizeof(childmsg));
+		if (msync(map, FILESIZE, MS_SYNC) < 0) {
+			err(1, "child: msync");
+		}
+		_exit(0);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		errx(1, "child failed");
+	}
+	check("mapping after the child's store", map, 1);
+	readfile(fd, buf);
+	check("read() after the child's msync", buf, 1);
+
+	printf("Mixing stores with read() and write()...\n");
+	memcpy(map + STOREOFF, storemsg, sizeof(storemsg));
+	writeat(fd, WRITEOFF, writemsg, sizeof(writemsg));
+	check("mapping after write()", map, 2);
+	readfile(fd, buf);
+	check("read() after the store", buf, 2);
+
+	printf("Unmapping...\n");
+	if (munmap(map, FILESIZE) < 0) {
+		err(1, "munmap");
+	}
+	readfile(fd, buf);
+	check("read() after munmap", buf, 2);
+	close(fd);
+
+	printf("Checking the file again...\n");
+	fd = open(TESTFILE, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", TESTFILE);
+	}
+	readfile(fd, buf);
+	check("file after reopening", buf, 2);
+	close(fd);
+
+	fd = open(TESTFILE, O_RDWR);
+	if (fd < 0) {
+		err(1, "%s: open", TESTFILE);
+	}
+	map2 = mapfile(fd);
+	check("new mapping", map2, 2);
+
+	printf("Truncating and growing the file back...\n");
+	if (ftruncate(fd, CUTOFF) < 0) {
+		err(1, "%s: ftruncate", TESTFILE);
+	}
+	if (ftruncate(fd, FILESIZE) < 0) {
+		err(1, "%s: ftruncate", TESTFILE);
+	}
+	check("mapping after truncating", map2, 3);
+	readfile(fd, buf);
+	check("read() after truncating", buf, 3);
+	if (munmap(map2, FILESIZE) < 0) {
+		err(1, "munmap");
+	}
+	readfile(fd, buf);
+	check("read() after the last munmap", buf, 3);
+	close(fd);
+
+	if (remove(TESTFILE) < 0) {
+		err(1, "%s: remove", TESTFILE);
+	}
+
+	printf("Passed mmaptest.\n");
+	return 0;
+}